@@ -0,0 +1,265 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cr.h"
+#include "libpill.h"
+#include "list.h"
+#include "timer.h"
+#include "utils.h"
+
+/* Broadcast channel. The values are written once into a ring of 'cap'
+   elements, the position of the value in the stream being 'seq & mask'.
+   Each subscriber reads them through its own cursor. With the blocking
+   policy, 'pending' counts the subscribers which haven't read the value
+   in each slot yet and the sender waits for the slot it's going to write
+   to to be read by everyone. With the dropping policy, the sender simply
+   overwrites the oldest value and the subscribers which fall more than
+   'cap' values behind skip forward. */
+struct mill_bcast_s {
+    size_t sz;
+    uint64_t mask;
+    int policy;
+    /* Sequence number of the next value to be sent. */
+    uint64_t head;
+    /* 1 if bcdone() was called. */
+    int done;
+    int refcount;
+    int nsubs;
+    /* Coroutines waiting for a value or for a free slot, respectively. */
+    struct mill_list receivers;
+    struct mill_list senders;
+    /* Per-slot counts of pending readers, NULL with the dropping policy.
+       The ring itself follows the structure. */
+    int *pending;
+};
+
+struct mill_bsub_s {
+    struct mill_bcast_s *bc;
+    /* Sequence number of the next value to be read. */
+    uint64_t pos;
+};
+
+/* A coroutine blocked on the broadcast channel. Lives on its stack. */
+struct mill_bcwaiter {
+    struct mill_list_item item;
+    struct mill_list *list;
+    struct mill_cr *cr;
+};
+
+static void *mill_bcslot(struct mill_bcast_s *bc, uint64_t seq) {
+    return ((char*)(bc + 1)) + ((seq & bc->mask) * bc->sz);
+}
+
+static void mill_bcwakeall(struct mill_list *list, int result) {
+    while(!mill_list_empty(list)) {
+        struct mill_bcwaiter *w = mill_cont(mill_list_begin(list),
+            struct mill_bcwaiter, item);
+        mill_list_erase(list, &w->item);
+        w->list = NULL;
+        if(mill_timer_enabled(&w->cr->timer))
+            mill_timer_rm(&w->cr->timer);
+        mill_resume(w->cr, result);
+    }
+}
+
+static void mill_bcwait_timedout(struct mill_timer *timer) {
+    struct mill_cr *cr = mill_cont(timer, struct mill_cr, timer);
+    struct mill_bcwaiter *w = timer->data;
+    mill_list_erase(w->list, &w->item);
+    w->list = NULL;
+    mill_resume(cr, -1);
+}
+
+/* Blocks until woken up by the peer. Returns -1 if the deadline expired. */
+static int mill_bcwait(struct mill_list *list, int64_t deadline) {
+    struct mill_bcwaiter w;
+    w.list = list;
+    w.cr = mill->running;
+    mill_list_insert(list, &w.item, NULL);
+    if(deadline >= 0) {
+        mill_timer_add(&mill->running->timer, deadline,
+            mill_bcwait_timedout);
+        mill->running->timer.data = &w;
+    }
+    return mill_suspend();
+}
+
+bcast mill_bcmake(size_t sz, size_t bufsz, int policy) {
+    if(mill_slow(bufsz == 0 || bufsz > SIZE_MAX / 2 ||
+          (policy != MILL_BCAST_BLOCK && policy != MILL_BCAST_DROP))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t cap = 1;
+    while(cap < bufsz)
+        cap <<= 1;
+    size_t pendsz = policy == MILL_BCAST_BLOCK ? cap * sizeof(int) : 0;
+    struct mill_bcast_s *bc = mill_malloc(sizeof(struct mill_bcast_s) +
+        (cap * sz) + pendsz);
+    if(!bc) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    bc->sz = sz;
+    bc->mask = cap - 1;
+    bc->policy = policy;
+    bc->head = 0;
+    bc->done = 0;
+    bc->refcount = 1;
+    bc->nsubs = 0;
+    mill_list_init(&bc->receivers);
+    mill_list_init(&bc->senders);
+    bc->pending = NULL;
+    if(pendsz) {
+        bc->pending = (int*)(((char*)(bc + 1)) + (cap * sz));
+        memset(bc->pending, 0, pendsz);
+    }
+    return bc;
+}
+
+static void mill_bcrelease(struct mill_bcast_s *bc) {
+    if(--bc->refcount)
+        return;
+    mill_assert(mill_list_empty(&bc->receivers));
+    mill_assert(mill_list_empty(&bc->senders));
+    mill_free(bc);
+}
+
+int mill_bcclose(bcast bc) {
+    if(mill_slow(!mill_list_empty(&bc->senders))) {
+        errno = EBUSY;
+        return -1;
+    }
+    mill_bcrelease(bc);
+    return 0;
+}
+
+bsub mill_bcsubscribe(bcast bc) {
+    struct mill_bsub_s *s = mill_malloc(sizeof(struct mill_bsub_s));
+    if(!s) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    s->bc = bc;
+    /* Only the values sent from now on are received. */
+    s->pos = bc->head;
+    ++bc->nsubs;
+    ++bc->refcount;
+    return s;
+}
+
+/* The subscriber won't read the value in the slot. */
+static void mill_bcconsumed(struct mill_bcast_s *bc, uint64_t seq) {
+    int *pending = &bc->pending[seq & bc->mask];
+    mill_assert(*pending > 0);
+    if(--*pending == 0 && !mill_list_empty(&bc->senders))
+        mill_bcwakeall(&bc->senders, 0);
+}
+
+void mill_bcunsubscribe(bsub s) {
+    struct mill_bcast_s *bc = s->bc;
+    if(bc->pending) {
+        for(; s->pos != bc->head; ++s->pos)
+            mill_bcconsumed(bc, s->pos);
+    }
+    --bc->nsubs;
+    mill_bcrelease(bc);
+    mill_free(s);
+}
+
+int mill_bcsend(bcast bc, void *val, int64_t deadline) {
+    if(mill_slow(bc->done)) {
+        errno = EPIPE;
+        return -1;
+    }
+    mill->running->state = MILL_CHS;
+    if(bc->pending) {
+        /* Wait till the slot was read by all the subscribers. */
+        while(bc->pending[bc->head & bc->mask]) {
+            if(mill_bcwait(&bc->senders, deadline) < 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if(mill_slow(bc->done)) {
+                errno = EPIPE;
+                return -1;
+            }
+        }
+        bc->pending[bc->head & bc->mask] = bc->nsubs;
+    }
+    memcpy(mill_bcslot(bc, bc->head), val, bc->sz);
+    ++bc->head;
+    mill_bcwakeall(&bc->receivers, 0);
+    /* Sending is a scheduling point even if it doesn't block. */
+    mill_resume(mill->running, 0);
+    mill_suspend();
+    return 0;
+}
+
+int mill_bcrecv(bsub s, void *val, int64_t deadline) {
+    struct mill_bcast_s *bc = s->bc;
+    mill->running->state = MILL_CHR;
+    while(s->pos == bc->head) {
+        if(bc->done) {
+            errno = EPIPE;
+            return -1;
+        }
+        if(mill_bcwait(&bc->receivers, deadline) < 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    /* The values overwritten in the meantime are lost. */
+    int lost = 0;
+    if(bc->head - s->pos > bc->mask + 1) {
+        uint64_t skip = bc->head - s->pos - (bc->mask + 1);
+        lost = skip > INT_MAX ? INT_MAX : (int)skip;
+        s->pos += skip;
+    }
+    memcpy(val, mill_bcslot(bc, s->pos), bc->sz);
+    if(bc->pending)
+        mill_bcconsumed(bc, s->pos);
+    ++s->pos;
+    /* Receiving is a scheduling point even if it doesn't block. */
+    mill_resume(mill->running, 0);
+    mill_suspend();
+    return lost;
+}
+
+int mill_bcdone(bcast bc) {
+    if(mill_slow(bc->done)) {
+        errno = EPIPE;
+        return -1;
+    }
+    bc->done = 1;
+    mill_bcwakeall(&bc->receivers, 0);
+    mill_bcwakeall(&bc->senders, 0);
+    return 0;
+}
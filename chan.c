@@ -23,15 +23,22 @@
 */
 
 #include <assert.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chan.h"
+#include "chset.h"
+#include "chspill.h"
+#include "chstats.h"
 #include "cr.h"
 #include "libpill.h"
+#include "poller.h"
 #include "utils.h"
+#include "worker.h"
+#include "xchan.h"
 
 MILL_CT_ASSERT(MILL_CLAUSELEN == sizeof(struct mill_clause));
 
@@ -46,12 +53,130 @@ struct mill_chan *mill_getchan(struct mill_ep *ep) {
     }
 }
 
+/* Segments of unbounded channels are MILL_CHSEG_SIZE bytes long, unless
+   the values are too large to fit. The thread keeps up to MILL_CHSEG_CACHE
+   of the unused ones for reuse. */
+#define MILL_CHSEG_SIZE 4096
+#define MILL_CHSEG_CACHE 64
+
+struct mill_slist_item *mill_allocchseg(size_t size) {
+    if(size <= MILL_CHSEG_SIZE && mill->num_chsegs) {
+        --mill->num_chsegs;
+        return mill_slist_pop(&mill->chsegs);
+    }
+    struct mill_slist_item *seg = mill_malloc(
+        size < MILL_CHSEG_SIZE ? MILL_CHSEG_SIZE : size);
+    if(mill_slow(!seg))
+        mill_panic("not enough memory to grow the channel");
+    return seg;
+}
+
+void mill_freechseg(size_t size, struct mill_slist_item *seg) {
+    if(size <= MILL_CHSEG_SIZE && mill->num_chsegs < MILL_CHSEG_CACHE) {
+        ++mill->num_chsegs;
+        mill_slist_push(&mill->chsegs, seg);
+        return;
+    }
+    mill_free(seg);
+}
+
+void mill_purgechsegs(void) {
+    struct mill_slist_item *seg;
+    while((seg = mill_slist_pop(&mill->chsegs)))
+        mill_free(seg);
+    mill->num_chsegs = 0;
+}
+
+/* Appends up to 'n' messages at the tail of the segment queue, allocating
+   a new segment if the tail one is full, and returns the number appended.
+   A spilling channel may divert the messages to its own queue, see
+   chspill.c. */
+static size_t mill_chsegwrite(chan ch, const char *vals, size_t n) {
+    struct mill_slist *segs = &ch->segs;
+    if(mill_slow(ch->spill))
+        segs = mill_chspill_tail(ch);
+    int grown = 0;
+    if(!segs->last || ch->last == ch->seglen) {
+        if(!ch->segs.last)
+            ch->first = 0;
+        mill_slist_push_back(segs, mill_allocchseg(mill_chsegsize(ch)));
+        ch->last = 0;
+        grown = 1;
+    }
+    if(n > ch->seglen - ch->last)
+        n = ch->seglen - ch->last;
+    memcpy(mill_chsegdata(segs->last) + (ch->last * ch->sz), vals,
+        n * ch->sz);
+    ch->last += n;
+    if(mill_fast(segs == &ch->segs)) {
+        ch->items += n;
+        if(mill_slow(ch->spill))
+            ch->spill->nsegs += grown;
+        return n;
+    }
+    ch->spill->pending += n;
+    ch->spill->nsegs += grown;
+    if(grown || !ch->items)
+        mill_chspill_wake(ch->spill);
+    return n;
+}
+
+/* Consumes 'n' messages from the head segment, which must hold them.
+   Segments are released as soon as they are read out. */
+static void mill_chseghead(chan ch, size_t n) {
+    ch->first += n;
+    ch->items -= n;
+    if(ch->first != ch->seglen && ch->items)
+        return;
+    mill_freechseg(mill_chsegsize(ch), mill_slist_pop(&ch->segs));
+    ch->first = 0;
+    if(!ch->items)
+        mill_assert(mill_slist_empty(&ch->segs));
+    if(mill_slow(ch->spill)) {
+        --ch->spill->nsegs;
+        if(ch->spill->pending)
+            mill_chspill_wake(ch->spill);
+    }
+}
+
+static void mill_chsegpop(chan ch, void *val) {
+    memcpy(val, mill_chsegdata(ch->segs.first) + (ch->first * ch->sz),
+        ch->sz);
+    mill_chseghead(ch, 1);
+}
+
+/* Returns 1 if the channel doesn't accept values anymore. A spilling
+   channel turns done-with for the receivers only after the values
+   still in the file get through. */
+static inline int mill_chclosed(chan ch) {
+    return ch->done || (mill_slow(ch->spill) && ch->spill->done);
+}
+
+/* Returns 1 if the values sent can go straight to the waiting receivers,
+   that is, if there are some and no values are queued ahead of them. */
+static inline int mill_chbypass(chan ch) {
+    return !mill_list_empty(&ch->receiver.clauses) &&
+        (mill_fast(!ch->spill) || !ch->spill->pending);
+}
+
 chan mill_chmake(size_t sz, size_t bufsz) {
+    /* The buffer is rounded up to a power of two so that the positions
+       can be masked rather than computed modulo the size. */
+    size_t cap = 0;
+    if(bufsz > 0 && bufsz != MILL_UNBOUNDED) {
+        if(mill_slow(bufsz > SIZE_MAX / 2)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        cap = 1;
+        while(cap < bufsz)
+            cap <<= 1;
+    }
     /* We are allocating 1 additional element after the channel buffer to
        store the done-with value. It can't be stored in the regular buffer
        because that would mean chdone() would block when buffer is full. */
     struct mill_chan *ch = (struct mill_chan*)
-        mill_malloc(sizeof(struct mill_chan) + (sz * (bufsz + 1)));
+        mill_malloc(sizeof(struct mill_chan) + (sz * (cap + 1)));
     if(!ch) {
         errno = ENOMEM;
         return NULL;
@@ -60,14 +185,29 @@ chan mill_chmake(size_t sz, size_t bufsz) {
     ch->sender.type = MILL_SENDER;
     ch->sender.seqnum = mill->choose_seqnum;
     mill_list_init(&ch->sender.clauses);
+    ch->sender.waiting = 0;
+    ch->sender.set = NULL;
     ch->receiver.type = MILL_RECEIVER;
     ch->receiver.seqnum = mill->choose_seqnum;
     mill_list_init(&ch->receiver.clauses);
+    ch->receiver.waiting = 0;
+    ch->receiver.set = NULL;
     ch->refcount = 1;
     ch->done = 0;
     ch->bufsz = bufsz;
+    ch->cap = cap;
     ch->items = 0;
     ch->first = 0;
+    mill_slist_init(&ch->segs);
+    ch->seglen = 0;
+    if(bufsz == MILL_UNBOUNDED) {
+        size_t room = MILL_CHSEG_SIZE - sizeof(struct mill_slist_item);
+        ch->seglen = sz > room ? 1 : room / (sz ? sz : 1);
+    }
+    ch->last = 0;
+    ch->spill = NULL;
+    ch->xa = NULL;
+    ch->stats = NULL;
     return ch;
 }
 
@@ -87,32 +227,116 @@ int mill_chclose(chan ch) {
         errno = EBUSY;
         return -1;
     }
+    if(mill_slow(ch->xa))
+        mill_xchdetach(ch->xa);
+    if(mill_slow(ch->receiver.set))
+        mill_chset_drop(ch->receiver.set);
+    if(mill_slow(ch->stats))
+        mill_chstats_free(ch);
+    if(mill_slow(ch->spill))
+        mill_chspill_close(ch);
+    struct mill_slist_item *seg;
+    while((seg = mill_slist_pop(&ch->segs)))
+        mill_freechseg(mill_chsegsize(ch), seg);
     mill_free(ch);
     return 0;
 }
 
-/* Unblock a coroutine blocked in mill_choose_wait() function.
-   It also cleans up the associated clause list. */
-static void mill_choose_unblock(struct mill_clause *cl) {
+/* Unregisters the clauses of the blocked coroutine from the channels,
+   file descriptors and tasks, except for the file descriptor 'fired',
+   which the poller takes care of. */
+static void mill_choose_cleanup(struct mill_cr *cr, struct mill_fd_s *fired) {
     struct mill_slist_item *it;
     struct mill_clause *itcl;
-    for(it = mill_slist_begin(&cl->cr->choosedata.clauses);
+    for(it = mill_slist_begin(&cr->choosedata.clauses);
           it; it = mill_slist_next(it)) {
         itcl = mill_cont(it, struct mill_clause, chitem);
         if(!itcl->used)
             continue;
-        mill_list_erase(&itcl->ep->clauses, &itcl->epitem);
+        switch(itcl->kind) {
+        case MILL_CLAUSE_CHAN:
+            mill_list_erase(&itcl->ep->clauses, &itcl->epitem);
+            --itcl->ep->waiting;
+            break;
+        case MILL_CLAUSE_FD: {
+            struct mill_fd_s *mfd = itcl->val;
+            if(mfd != fired && (mfd->in == cr || mfd->out == cr))
+                mill_fdunregister(mfd, cr);
+            break;
+        }
+        case MILL_CLAUSE_TASK:
+            mill_task_setwaiter(itcl->val, NULL);
+            break;
+        }
     }
+}
+
+/* Unblock a coroutine blocked in mill_choose_wait() function.
+   It also cleans up the associated clause list. */
+void mill_choose_unblock(struct mill_clause *cl) {
+    mill_choose_cleanup(cl->cr, NULL);
     if(cl->cr->choosedata.ddline >= 0)
         mill_timer_rm(&cl->cr->timer);
     mill_resume(cl->cr, cl->idx);
 }
 
+void mill_choose_fdready(struct mill_cr *cr, struct mill_fd_s *mfd,
+      int events) {
+    struct mill_slist_item *it;
+    struct mill_clause *cl = NULL;
+    for(it = mill_slist_begin(&cr->choosedata.clauses);
+          it; it = mill_slist_next(it)) {
+        struct mill_clause *itcl = mill_cont(it, struct mill_clause, chitem);
+        if(itcl->kind != MILL_CLAUSE_FD || itcl->val != mfd)
+            continue;
+        if(!cl || (itcl->fd.events & events))
+            cl = itcl;
+        if(itcl->fd.events & events)
+            break;
+    }
+    mill_assert(cl);
+    *(int*)mill_valbuf(cr, sizeof(int)) =
+        events & (cl->fd.events | FDW_ERR);
+    mill_choose_cleanup(cr, mfd);
+    if(cr->choosedata.ddline >= 0)
+        mill_timer_rm(&cr->timer);
+    mill_resume(cr, cl->idx);
+}
+
+/* The result of the task is handed over to the coroutine through its
+   valbuf, see mill_choose_taskres(). */
+struct mill_taskres {
+    int rc;
+    int err;
+};
+
+static void mill_choose_reap(struct mill_cr *cr, struct mill_task_s *t) {
+    struct mill_taskres *res = mill_valbuf(cr, sizeof(struct mill_taskres));
+    res->rc = mill_task_reap(t, &res->err);
+}
+
+void mill_choose_taskdone(struct mill_cr *cr, struct mill_task_s *t) {
+    struct mill_slist_item *it;
+    for(it = mill_slist_begin(&cr->choosedata.clauses);
+          it; it = mill_slist_next(it)) {
+        struct mill_clause *cl = mill_cont(it, struct mill_clause, chitem);
+        if(cl->kind == MILL_CLAUSE_TASK && cl->val == t) {
+            /* Unregisters from the task before it's released. */
+            mill_choose_unblock(cl);
+            mill_choose_reap(cr, t);
+            return;
+        }
+    }
+    mill_assert(0);
+}
+
 static void mill_choose_init_(void) {
     mill_slist_init(&mill->running->choosedata.clauses);
     mill->running->choosedata.othws = 0;
     mill->running->choosedata.ddline = -1;
     mill->running->choosedata.available = 0;
+    mill->running->choosedata.xclauses = 0;
+    mill->running->choosedata.fdclauses = 0;
     ++mill->choose_seqnum;
 }
 
@@ -135,9 +359,12 @@ void mill_choose_in(void *clause, chan ch, int idx) {
     cl->cr = mill->running;
     cl->ep = &ch->receiver;
     cl->val = NULL;
+    if(mill_slow(ch->xa))
+        ++mill->running->choosedata.xclauses;
     cl->idx = idx;
     cl->available = available;
     cl->used = 1;
+    cl->kind = MILL_CLAUSE_CHAN;
     mill_slist_push_back(&mill->running->choosedata.clauses, &cl->chitem);
     if(cl->ep->seqnum == mill->choose_seqnum) {
         ++cl->ep->refs;
@@ -149,7 +376,7 @@ void mill_choose_in(void *clause, chan ch, int idx) {
 }
 
 int mill_choose_out(void *clause, chan ch, void *val, int idx) {
-    if(mill_slow(ch->done)) {
+    if(mill_slow(mill_chclosed(ch) || (ch->xa && mill_xchisdone(ch->xa)))) {
         /* send to done-with channel */
         errno = EPIPE;
         return -1;
@@ -167,9 +394,12 @@ int mill_choose_out(void *clause, chan ch, void *val, int idx) {
     cl->cr = mill->running;
     cl->ep = &ch->sender;
     cl->val = val;
+    if(mill_slow(ch->xa))
+        ++mill->running->choosedata.xclauses;
     cl->available = available;
     cl->idx = idx;
     cl->used = 1;
+    cl->kind = MILL_CLAUSE_CHAN;
     mill_slist_push_back(&mill->running->choosedata.clauses, &cl->chitem);
     if(cl->ep->seqnum == mill->choose_seqnum) {
         ++cl->ep->refs;
@@ -181,15 +411,46 @@ int mill_choose_out(void *clause, chan ch, void *val, int idx) {
     return 0;
 }
 
+void mill_choose_fd(void *clause, struct mill_fd_s *mfd, int events,
+      int idx) {
+    /* Readiness of the file descriptor is only known to the poller, so
+       the clause is never immediately available. */
+    if(mill->running->choosedata.available)
+        return;
+    struct mill_clause *cl = (struct mill_clause*) clause;
+    cl->cr = mill->running;
+    cl->ep = NULL;
+    cl->val = mfd;
+    cl->fd.events = events & (FDW_IN | FDW_OUT);
+    cl->fd.revents = 0;
+    cl->idx = idx;
+    cl->available = 0;
+    cl->used = 1;
+    cl->kind = MILL_CLAUSE_FD;
+    mill_slist_push_back(&mill->running->choosedata.clauses, &cl->chitem);
+    ++mill->running->choosedata.fdclauses;
+}
+
+void mill_choose_task(void *clause, struct mill_task_s *t, int idx) {
+    int available = mill_task_isdone(t);
+    if(available)
+        ++mill->running->choosedata.available;
+    if(!available && mill->running->choosedata.available)
+        return;
+    struct mill_clause *cl = (struct mill_clause*) clause;
+    cl->cr = mill->running;
+    cl->ep = NULL;
+    cl->val = t;
+    cl->idx = idx;
+    cl->available = available;
+    cl->used = 1;
+    cl->kind = MILL_CLAUSE_TASK;
+    mill_slist_push_back(&mill->running->choosedata.clauses, &cl->chitem);
+}
+
 static void mill_choose_callback(struct mill_timer *timer) {
     struct mill_cr *cr = mill_cont(timer, struct mill_cr, timer);
-    struct mill_slist_item *it;
-    for(it = mill_slist_begin(&cr->choosedata.clauses);
-          it; it = mill_slist_next(it)) {
-        struct mill_clause *itcl = mill_cont(it, struct mill_clause, chitem);
-        mill_assert(itcl->used);
-        mill_list_erase(&itcl->ep->clauses, &itcl->epitem);
-    }
+    mill_choose_cleanup(cr, NULL);
     mill_resume(cr, -1);
 }
 
@@ -218,22 +479,45 @@ int mill_choose_otherwise(void) {
     return 0;
 }
 
+/* That's the user's variable if the clause was created by mill_chrecv(). */
+void *mill_clause_dst(struct mill_clause *cl, size_t sz) {
+    if(cl->val)
+        return cl->val;
+    return mill_valbuf(cl->cr, sz);
+}
+
+/* Tell the select set the channel belongs to, if any, that there may be
+   something to receive. */
+static inline void mill_chnotify(chan ch) {
+    if(mill_slow(ch->receiver.set))
+        mill_chset_notify(ch->receiver.set);
+}
+
 /* Push new item to the channel. */
 static void mill_enqueue(chan ch, void *val) {
+    int bypass = mill_chbypass(ch);
+    if(mill_slow(ch->stats))
+        mill_chstats_xfer(ch, 1, bypass);
     /* If there's a receiver already waiting, let's resume it. */
-    if(!mill_list_empty(&ch->receiver.clauses)) {
+    if(bypass) {
         mill_assert(ch->items == 0);
         struct mill_clause *cl = mill_cont(
             mill_list_begin(&ch->receiver.clauses), struct mill_clause, epitem);
-        memcpy(mill_valbuf(cl->cr, ch->sz), val, ch->sz);
+        memcpy(mill_clause_dst(cl, ch->sz), val, ch->sz);
         mill_choose_unblock(cl);
         return;
     }
     /* Write the value to the buffer. */
     assert(ch->items < ch->bufsz);
-    size_t pos = (ch->first + ch->items) % ch->bufsz;
-    memcpy(((char*)(ch + 1)) + (pos * ch->sz) , val, ch->sz);
-    ++ch->items;
+    if(mill_slow(ch->seglen)) {
+        mill_chsegwrite(ch, val, 1);
+    }
+    else {
+        size_t pos = (ch->first + ch->items) & (ch->cap - 1);
+        memcpy(((char*)(ch + 1)) + (pos * ch->sz) , val, ch->sz);
+        ++ch->items;
+    }
+    mill_chnotify(ch);
 }
 
 /* Pop one value from the channel. */
@@ -241,12 +525,14 @@ static void mill_dequeue(chan ch, void *val) {
     /* Get a blocked sender, if any. */
     struct mill_clause *cl = mill_cont(
         mill_list_begin(&ch->sender.clauses), struct mill_clause, epitem);
+    if(mill_slow(ch->stats))
+        mill_chstats_xfer(ch, cl ? 1 : 0, ch->items || !ch->done ? 1 : 0);
     if(!ch->items) {
         /* If chdone was already called we can return the value immediately.
            There are no senders waiting to send. */
         if(mill_slow(ch->done)) {
             mill_assert(!cl);
-            memcpy(val, ((char*)(ch + 1)) + (ch->bufsz * ch->sz), ch->sz);
+            memcpy(val, ((char*)(ch + 1)) + (ch->cap * ch->sz), ch->sz);
             return;
         }
         /* Otherwise there must be a sender waiting to send. */
@@ -255,20 +541,123 @@ static void mill_dequeue(chan ch, void *val) {
         mill_choose_unblock(cl);
         return;
     }
+    /* Unbounded channels never have senders waiting. */
+    if(mill_slow(ch->seglen)) {
+        mill_chsegpop(ch, val);
+        return;
+    }
     /* If there's a value in the buffer start by retrieving it. */
     memcpy(val, ((char*)(ch + 1)) + (ch->first * ch->sz), ch->sz);
-    ch->first = (ch->first + 1) % ch->bufsz;
+    ch->first = (ch->first + 1) & (ch->cap - 1);
     --ch->items;
     /* And if there was a sender waiting, unblock it. */
     if(cl) {
         assert(ch->items < ch->bufsz);
-        size_t pos = (ch->first + ch->items) % ch->bufsz;
+        size_t pos = (ch->first + ch->items) & (ch->cap - 1);
         memcpy(((char*)(ch + 1)) + (pos * ch->sz) , cl->val, ch->sz);
         ++ch->items;
         mill_choose_unblock(cl);
     }
 }
 
+/* Pushes as many of the 'n' values to the channel as possible without
+   blocking, first to the waiting receivers, then to the free space
+   in the buffer. Returns the number of values pushed. */
+static size_t mill_enqueue_many(chan ch, char *vals, size_t n) {
+    size_t i = 0;
+    if(mill_slow(ch->xa)) {
+        while(i != n && mill_xchtrysend(ch->xa, vals + (i * ch->sz)) == 0)
+            ++i;
+        return i;
+    }
+    while(i != n && mill_chbypass(ch)) {
+        mill_enqueue(ch, vals + (i * ch->sz));
+        ++i;
+    }
+    size_t count = ch->bufsz - ch->items;
+    if(count > n - i)
+        count = n - i;
+    if(!count)
+        return i;
+    if(mill_slow(ch->stats))
+        mill_chstats_xfer(ch, count, 0);
+    if(mill_slow(ch->seglen)) {
+        size_t end = i + count;
+        while(i != end)
+            i += mill_chsegwrite(ch, vals + (i * ch->sz), end - i);
+        mill_chnotify(ch);
+        return i;
+    }
+    /* The free space wraps around the end of the buffer at most once. */
+    char *buf = (char*)(ch + 1);
+    size_t pos = (ch->first + ch->items) & (ch->cap - 1);
+    size_t chunk = ch->cap - pos < count ? ch->cap - pos : count;
+    memcpy(buf + (pos * ch->sz), vals + (i * ch->sz), chunk * ch->sz);
+    memcpy(buf, vals + ((i + chunk) * ch->sz), (count - chunk) * ch->sz);
+    ch->items += count;
+    mill_chnotify(ch);
+    return i + count;
+}
+
+/* Pops as many values, up to 'n', as are available without blocking.
+   The senders blocked on a full buffer are unblocked as the space frees
+   up. Doesn't return the done-with value. */
+static size_t mill_dequeue_many(chan ch, char *vals, size_t n) {
+    size_t i = 0;
+    if(mill_slow(ch->xa)) {
+        while(i != n && mill_xchtryrecv(ch->xa, vals + (i * ch->sz)) == 0)
+            ++i;
+        return i;
+    }
+    if(mill_slow(ch->seglen)) {
+        while(i != n && ch->items) {
+            size_t avail = ch->seglen - ch->first;
+            if(avail > ch->items)
+                avail = ch->items;
+            size_t chunk = avail < n - i ? avail : n - i;
+            memcpy(vals + (i * ch->sz),
+                mill_chsegdata(ch->segs.first) + (ch->first * ch->sz),
+                chunk * ch->sz);
+            if(mill_slow(ch->stats))
+                mill_chstats_xfer(ch, 0, chunk);
+            mill_chseghead(ch, chunk);
+            i += chunk;
+        }
+        return i;
+    }
+    char *buf = (char*)(ch + 1);
+    while(i != n && ch->items) {
+        size_t count = ch->items < n - i ? ch->items : n - i;
+        size_t chunk = ch->cap - ch->first < count ?
+            ch->cap - ch->first : count;
+        memcpy(vals + (i * ch->sz), buf + (ch->first * ch->sz),
+            chunk * ch->sz);
+        memcpy(vals + ((i + chunk) * ch->sz), buf, (count - chunk) * ch->sz);
+        if(mill_slow(ch->stats))
+            mill_chstats_xfer(ch, 0, count);
+        ch->first = (ch->first + count) & (ch->cap - 1);
+        ch->items -= count;
+        i += count;
+        while(ch->items < ch->bufsz && !mill_list_empty(&ch->sender.clauses)) {
+            struct mill_clause *cl = mill_cont(
+                mill_list_begin(&ch->sender.clauses), struct mill_clause,
+                epitem);
+            if(mill_slow(ch->stats))
+                mill_chstats_xfer(ch, 1, 0);
+            size_t pos = (ch->first + ch->items) & (ch->cap - 1);
+            memcpy(buf + (pos * ch->sz), cl->val, ch->sz);
+            ++ch->items;
+            mill_choose_unblock(cl);
+        }
+    }
+    /* Unbuffered channel. */
+    while(i != n && !mill_list_empty(&ch->sender.clauses)) {
+        mill_dequeue(ch, vals + (i * ch->sz));
+        ++i;
+    }
+    return i;
+}
+
 int mill_choose_wait(void) {
     struct mill_choosedata *cd = &mill->running->choosedata;
     struct mill_slist_item *it;
@@ -277,7 +666,8 @@ int mill_choose_wait(void) {
     /* If there are clauses that are immediately available
        randomly choose one of them. */
     if(cd->available > 0) {
-        int chosen = cd->available == 1 ? 0 : (int)(random() % (cd->available));
+        int chosen = cd->available == 1 ? 0 :
+            (int)(mill_xorshift(&mill->rand_state) % cd->available);
         for(it = mill_slist_begin(&cd->clauses); it; it = mill_slist_next(it)) {
             cl = mill_cont(it, struct mill_clause, chitem);
             if(!cl->available)
@@ -286,15 +676,71 @@ int mill_choose_wait(void) {
                 break;
             --chosen;
         }
-        struct mill_chan *ch = mill_getchan(cl->ep);
-        if(cl->ep->type == MILL_SENDER)
-            mill_enqueue(ch, cl->val);
-        else
-            mill_dequeue(ch, mill_valbuf(cl->cr, ch->sz));
+        if(cl->kind == MILL_CLAUSE_TASK) {
+            mill_choose_reap(mill->running, cl->val);
+        }
+        else {
+            struct mill_chan *ch = mill_getchan(cl->ep);
+            if(cl->ep->type == MILL_SENDER)
+                mill_enqueue(ch, cl->val);
+            else
+                mill_dequeue(ch, mill_clause_dst(cl, ch->sz));
+        }
         mill_resume(mill->running, cl->idx);
         return mill_suspend();
     }
 
+    /* Cross-thread channels have nothing available locally, but there may
+       be something in their rings. */
+    if(mill_slow(cd->xclauses)) {
+        for(it = mill_slist_begin(&cd->clauses); it; it = mill_slist_next(it)) {
+            cl = mill_cont(it, struct mill_clause, chitem);
+            if(cl->kind != MILL_CLAUSE_CHAN)
+                continue;
+            struct mill_chan *ch = mill_getchan(cl->ep);
+            if(!ch->xa)
+                continue;
+            int rc;
+            if(cl->ep->type == MILL_SENDER) {
+                rc = mill_xchtrysend(ch->xa, cl->val);
+            }
+            else {
+                void *dst = mill_clause_dst(cl, ch->sz);
+                rc = mill_xchtryrecv(ch->xa, dst);
+                if(rc < 0)
+                    rc = mill_xchgetdone(ch->xa, dst);
+            }
+            if(rc == 0) {
+                mill_resume(mill->running, cl->idx);
+                return mill_suspend();
+            }
+        }
+    }
+
+    /* The file descriptors have to be asked directly if the coroutine
+       isn't going to wait for the poller. */
+    if(mill_slow(cd->othws && cd->fdclauses)) {
+        for(it = mill_slist_begin(&cd->clauses); it; it = mill_slist_next(it)) {
+            cl = mill_cont(it, struct mill_clause, chitem);
+            if(cl->kind != MILL_CLAUSE_FD)
+                continue;
+            struct mill_fd_s *mfd = cl->val;
+            struct pollfd pfd;
+            pfd.fd = mfd->fd;
+            pfd.events = (cl->fd.events & FDW_IN ? POLLIN : 0) |
+                (cl->fd.events & FDW_OUT ? POLLOUT : 0);
+            pfd.revents = 0;
+            if(poll(&pfd, 1, 0) <= 0)
+                continue;
+            int events = (pfd.revents & POLLIN ? FDW_IN : 0) |
+                (pfd.revents & POLLOUT ? FDW_OUT : 0) |
+                (pfd.revents & (POLLERR | POLLHUP | POLLNVAL) ? FDW_ERR : 0);
+            *(int*)mill_valbuf(mill->running, sizeof(int)) = events;
+            mill_resume(mill->running, cl->idx);
+            return mill_suspend();
+        }
+    }
+
     /* If not so but there's an 'otherwise' clause we can go straight to it. */
     if(cd->othws) {
         mill_resume(mill->running, -1);
@@ -309,10 +755,19 @@ int mill_choose_wait(void) {
        and wait till one of the clauses unblocks. */
     for(it = mill_slist_begin(&cd->clauses); it; it = mill_slist_next(it)) {
         cl = mill_cont(it, struct mill_clause, chitem);
+        if(mill_slow(cl->kind == MILL_CLAUSE_FD)) {
+            if(mill_fdregister(cl->val, cl->fd.events) < 0)
+                mill_panic("multiple goroutine waiting for the same fd");
+            continue;
+        }
+        if(mill_slow(cl->kind == MILL_CLAUSE_TASK)) {
+            mill_task_setwaiter(cl->val, mill->running);
+            continue;
+        }
         if(mill_slow(cl->ep->refs > 1)) {
             if(cl->ep->tmp == -1)
-                cl->ep->tmp =
-                    cl->ep->refs == 1 ? 0 : (int)(random() % cl->ep->refs);
+                cl->ep->tmp = (int)(mill_xorshift(&mill->rand_state) %
+                    cl->ep->refs);
             if(cl->ep->tmp) {
                 --cl->ep->tmp;
                 cl->used = 0;
@@ -321,12 +776,29 @@ int mill_choose_wait(void) {
             cl->ep->tmp = -2;
         }
         mill_list_insert(&cl->ep->clauses, &cl->epitem, NULL);
+        ++cl->ep->waiting;
+        if(mill_slow(mill_getchan(cl->ep)->stats))
+            mill_chstats_block(cl->ep);
+        if(cl->ep->type == MILL_SENDER)
+            mill_chnotify(mill_getchan(cl->ep));
+        if(mill_slow(cd->xclauses)) {
+            struct mill_chan *ch = mill_getchan(cl->ep);
+            if(ch->xa)
+                mill_xchblock(ch->xa);
+        }
     }
     /* If there are multiple parallel chooses done from different coroutines
        all but one must be blocked on the following line. */
     return mill_suspend();
 }
 
+int mill_choose_taskres(void) {
+    struct mill_taskres *res = mill_valbuf(mill->running,
+        sizeof(struct mill_taskres));
+    errno = res->err;
+    return res->rc;
+}
+
 void *mill_choose_val(size_t sz) {
     /* The assumption here is that by supplying the same size as before
        we are going to get the same buffer which already has the data
@@ -334,51 +806,236 @@ void *mill_choose_val(size_t sz) {
     return mill_valbuf(mill->running, sz);
 }
 
-int mill_chs(chan ch, void *val) {
-    if(mill_slow(ch->done)) {
+/* chs() and chr() don't need the full choose machinery. If the operation
+   can't be done immediately, the single clause is registered with
+   the channel and the coroutine blocks until a peer or the deadline
+   unblocks it. Returns -1 if the deadline expired, and -2 if the sender
+   was unblocked because a cross-thread channel is done with. */
+static int mill_chwait(struct mill_clause *cl, int64_t deadline) {
+    struct mill_choosedata *cd = &mill->running->choosedata;
+    mill_slist_init(&cd->clauses);
+    mill_slist_push_back(&cd->clauses, &cl->chitem);
+    cd->othws = 0;
+    cd->ddline = deadline;
+    cd->available = 0;
+    cl->cr = mill->running;
+    cl->idx = 0;
+    cl->available = 0;
+    cl->used = 1;
+    cl->kind = MILL_CLAUSE_CHAN;
+    if(deadline >= 0)
+        mill_timer_add(&mill->running->timer, deadline, mill_choose_callback);
+    mill_list_insert(&cl->ep->clauses, &cl->epitem, NULL);
+    ++cl->ep->waiting;
+    struct mill_chan *ch = mill_getchan(cl->ep);
+    if(mill_slow(ch->stats))
+        mill_chstats_block(cl->ep);
+    if(cl->ep->type == MILL_SENDER)
+        mill_chnotify(ch);
+    if(mill_slow(ch->xa))
+        mill_xchblock(ch->xa);
+    return mill_suspend();
+}
+
+int mill_chsd(chan ch, void *val, int64_t deadline) {
+    if(mill_slow(mill_chclosed(ch))) {
         errno = EPIPE;
         return -1;
     }
-    mill_choose_init_();
     mill->running->state = MILL_CHS;
+    if(mill_slow(ch->xa)) {
+        if(mill_xchtrysend(ch->xa, val) == 0) {
+            mill_resume(mill->running, 0);
+            mill_suspend();
+            return 0;
+        }
+        if(errno == EPIPE)
+            return -1;
+    }
+    else if(mill_fast(!mill_list_empty(&ch->receiver.clauses) ||
+          ch->items < ch->bufsz)) {
+        mill_enqueue(ch, val);
+        /* Sending is a scheduling point even if it doesn't block. */
+        mill_resume(mill->running, 0);
+        mill_suspend();
+        return 0;
+    }
     struct mill_clause cl;
-    mill_choose_out(&cl, ch, val, 0);
-    mill_choose_wait();
+    cl.ep = &ch->sender;
+    cl.val = val;
+    int rc = mill_chwait(&cl, deadline);
+    if(mill_slow(rc < 0)) {
+        /* -2 if the cross-thread channel was done with meanwhile. */
+        errno = rc == -1 ? ETIMEDOUT : EPIPE;
+        return -1;
+    }
     return 0;
 }
 
-void *mill_chr(chan ch) {
+int mill_chs(chan ch, void *val) {
+    return mill_chsd(ch, val, -1);
+}
+
+int mill_chrd(chan ch, void *val, int64_t deadline) {
     mill->running->state = MILL_CHR;
-    mill_choose_init_();
+    if(mill_slow(ch->xa)) {
+        if(mill_xchtryrecv(ch->xa, val) == 0 ||
+              mill_xchgetdone(ch->xa, val) == 0) {
+            mill_resume(mill->running, 0);
+            mill_suspend();
+            return 0;
+        }
+    }
+    else if(mill_fast(ch->items || ch->done ||
+          !mill_list_empty(&ch->sender.clauses))) {
+        mill_dequeue(ch, val);
+        /* Receiving is a scheduling point even if it doesn't block. */
+        mill_resume(mill->running, 0);
+        mill_suspend();
+        return 0;
+    }
+    /* The sender copies the value straight to the destination. */
     struct mill_clause cl;
-    mill_choose_in(&cl, ch, 0);
-    mill_choose_wait();
-    return mill_choose_val(ch->sz);
+    cl.ep = &ch->receiver;
+    cl.val = val;
+    if(mill_slow(mill_chwait(&cl, deadline) < 0)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+void *mill_chr(chan ch) {
+    void *val = mill_valbuf(mill->running, ch->sz);
+    mill_chrd(ch, val, -1);
+    return val;
+}
+
+void mill_chrecv(chan ch, void *val) {
+    mill_chrd(ch, val, -1);
+}
+
+int mill_chtrysend(chan ch, void *vals, int n) {
+    if(mill_slow(mill_chclosed(ch))) {
+        errno = EPIPE;
+        return -1;
+    }
+    if(mill_slow(n < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return (int)mill_enqueue_many(ch, vals, n);
+}
+
+int mill_chtryrecv(chan ch, void *vals, int n) {
+    if(mill_slow(n < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t count = mill_dequeue_many(ch, vals, n);
+    if(mill_slow(!count && n && ch->xa)) {
+        if(mill_xchgetdone(ch->xa, vals) == 0)
+            count = 1;
+    }
+    else if(!count && n && ch->done) {
+        mill_dequeue(ch, vals);
+        count = 1;
+    }
+    return (int)count;
+}
+
+int mill_chs_many(chan ch, void *vals, int n) {
+    int count = mill_chtrysend(ch, vals, n);
+    if(mill_slow(count < 0))
+        return -1;
+    if(n == 0)
+        return 0;
+    if(count > 0) {
+        mill->running->state = MILL_CHS;
+        mill_resume(mill->running, 0);
+        mill_suspend();
+        return count;
+    }
+    /* Nothing could be sent. Block till the first value gets through and
+       send whatever fits afterwards. */
+    if(mill_slow(mill_chs(ch, vals) < 0))
+        return -1;
+    if(mill_chclosed(ch))
+        return 1;
+    return 1 + (int)mill_enqueue_many(ch, ((char*)vals) + ch->sz, n - 1);
+}
+
+int mill_chr_many(chan ch, void *vals, int n, int64_t deadline) {
+    int count = mill_chtryrecv(ch, vals, n);
+    if(mill_slow(count < 0))
+        return -1;
+    if(n == 0)
+        return 0;
+    if(count > 0) {
+        mill->running->state = MILL_CHR;
+        mill_resume(mill->running, 0);
+        mill_suspend();
+        return count;
+    }
+    /* Nothing is available. Block till the first value arrives and take
+       whatever else is there afterwards. */
+    if(mill_slow(mill_chrd(ch, vals, deadline) < 0))
+        return -1;
+    return 1 + (int)mill_dequeue_many(ch, ((char*)vals) + ch->sz, n - 1);
+}
+
+/* Puts the channel into done-with mode and resumes all the receivers
+   currently waiting on it. The done-with value must already be stored. */
+static void mill_chfinish(chan ch) {
+    ch->done = 1;
+    mill_chnotify(ch);
+    void *val = ((char*)(ch + 1)) + (ch->cap * ch->sz);
+    while(!mill_list_empty(&ch->receiver.clauses)) {
+        struct mill_clause *cl = mill_cont(
+            mill_list_begin(&ch->receiver.clauses), struct mill_clause, epitem);
+        memcpy(mill_clause_dst(cl, ch->sz), val, ch->sz);
+        mill_choose_unblock(cl);
+    }
+}
+
+void mill_chfeed(chan ch) {
+    while(ch->items && !mill_list_empty(&ch->receiver.clauses)) {
+        struct mill_clause *cl = mill_cont(
+            mill_list_begin(&ch->receiver.clauses), struct mill_clause, epitem);
+        if(mill_slow(ch->stats))
+            mill_chstats_xfer(ch, 0, 1);
+        mill_chsegpop(ch, mill_clause_dst(cl, ch->sz));
+        mill_choose_unblock(cl);
+    }
+    if(ch->items)
+        mill_chnotify(ch);
+    if(ch->spill && ch->spill->done && !ch->spill->pending && !ch->done)
+        mill_chfinish(ch);
 }
 
 int mill_chdone(chan ch, void *val) {
-    if(mill_slow(ch->done)) {
+    if(mill_slow(mill_chclosed(ch))) {
         /* chdone on already done-with channel */
         errno = EPIPE;
         return -1;
     }
+    /* The bridges deliver the value to the blocked receivers. */
+    if(mill_slow(ch->xa))
+        return mill_xchdone(ch->xa, val);
     /* Panic if there are other senders on the same channel. */
     if(mill_slow(!mill_list_empty(&ch->sender.clauses))) {
         /* send to done-with channel"); */
         errno = EPIPE;
         return -1;
     }
-    /* Put the channel into done-with mode. */
-    ch->done = 1;
     /* Store the terminal value into a special position in the channel. */
-    memcpy(((char*)(ch + 1)) + (ch->bufsz * ch->sz) , val, ch->sz);
-    /* Resume all the receivers currently waiting on the channel. */
-    while(!mill_list_empty(&ch->receiver.clauses)) {
-        struct mill_clause *cl = mill_cont(
-            mill_list_begin(&ch->receiver.clauses), struct mill_clause, epitem);
-        memcpy(mill_valbuf(cl->cr, ch->sz), val, ch->sz);
-        mill_choose_unblock(cl);
+    memcpy(((char*)(ch + 1)) + (ch->cap * ch->sz) , val, ch->sz);
+    /* The values spilled to the file have to be received first. */
+    if(mill_slow(ch->spill && ch->spill->pending)) {
+        ch->spill->done = 1;
+        return 0;
     }
+    mill_chfinish(ch);
     return 0;
 }
 
@@ -30,6 +30,10 @@
 #include "list.h"
 #include "slist.h"
 
+struct mill_cr;
+struct mill_fd_s;
+struct mill_task_s;
+
 /* One of these structures is preallocated for every coroutine. */
 struct mill_choosedata {
     /* List of clauses in the 'choose' statement. */
@@ -40,6 +44,10 @@ struct mill_choosedata {
     int64_t ddline;
     /* Number of clauses that are immediately available. */
     int available;
+    /* Number of clauses on channels attached to cross-thread channels. */
+    int xclauses;
+    /* Number of clauses waiting for file descriptors. */
+    int fdclauses;
 };
 
 /* Channel endpoint. */
@@ -53,8 +61,12 @@ struct mill_ep {
     int refs;
     /* Number of refs already processed. */
     int tmp;
-    /* List of clauses waiting for this endpoint. */
+    /* List of clauses waiting for this endpoint and their number. */
     struct mill_list clauses;
+    int waiting;
+    /* Registration with the select set the channel belongs to, if any.
+       Used by the receiving endpoint only. See chset.c. */
+    struct mill_chsetitem *set;
 };
 
 /* Channel. */
@@ -71,43 +83,118 @@ struct mill_chan {
     int done;
 
     /* The message buffer directly follows the chan structure. 'bufsz' specifies
-       the maximum capacity of the buffer. 'items' is the number of messages
-       currently in the buffer. 'first' is the index of the next message to
-       be received from the buffer. There's one extra element at the end of
-       the buffer used to store the message supplied by chdone() function. */
+       the maximum capacity of the buffer. 'cap' is the actual size of the
+       buffer, 'bufsz' rounded up to a power of two. 'items' is the number
+       of messages currently in the buffer. 'first' is the index of the next
+       message to be received from the buffer. There's one extra element at
+       the end of the buffer used to store the message supplied by chdone()
+       function. */
     size_t bufsz;
+    size_t cap;
     size_t items;
     size_t first;
+    /* Unbounded channels (bufsz == MILL_UNBOUNDED) have no inline buffer,
+       'cap' is 0. The messages are kept in a queue of segments instead,
+       'seglen' messages each. 'first' is the index of the next message in
+       the head segment, 'last' the index of the next free slot in the tail
+       one. The queue is empty when no messages are buffered. */
+    struct mill_slist segs;
+    size_t seglen;
+    size_t last;
+    /* Overflow of an unbounded channel into a file, NULL unless chspill()
+       was called. See chspill.c. */
+    struct mill_chspill_s *spill;
+    /* If the channel is attached to a cross-thread channel, the values are
+       exchanged through its ring rather than the buffer. See xchan.c. */
+    struct mill_xattach_s *xa;
+    /* Statistics, NULL unless the channel was registered with chname().
+       See chstats.c. */
+    struct mill_chstats_s *stats;
 #ifdef MILLDEBUG
     /* Debugging info. */
     struct mill_debug_chan debug;
 #endif
 };
 
+/* Kinds of clauses. */
+#define MILL_CLAUSE_CHAN 0
+#define MILL_CLAUSE_FD 1
+#define MILL_CLAUSE_TASK 2
+
 /* This structure represents a single clause in a choose statement.
    Similarly, both chs() and chr() each create a single clause. */
 struct mill_clause {
-    /* Member of list of clauses waiting for a channel endpoint. */
-    struct mill_list_item epitem;
+    union {
+        /* Member of list of clauses waiting for a channel endpoint. */
+        struct mill_list_item epitem;
+        /* For file descriptor clauses, the events waited for and those
+           that fired. */
+        struct {
+            int events;
+            int revents;
+        } fd;
+    };
     /* Linked list of clauses in the choose statement. */
     struct mill_slist_item chitem;
     /* The coroutine which created the clause. */
     struct mill_cr *cr;
-    /* Channel endpoint the clause is waiting for. */
+    /* Channel endpoint the clause is waiting for, NULL for the clauses
+       of other kinds. */
     struct mill_ep *ep;
-    /* For out clauses, pointer to the value to send. NULL for in clauses. */
+    /* For out clauses, pointer to the value to send. For in clauses,
+       the buffer to receive the value into, NULL to use the valbuf.
+       The file descriptor or the task for the clauses of those kinds. */
     void *val;
     /* The index to jump to when the clause is executed. */
     int idx;
     /* If 0, there's no peer waiting for the clause at the moment.
        If 1, there is one. */
     int available;
-    /* If 1, the clause is in the list of channel's senders/receivers. */
+    /* If 1, the clause is in the list of channel's senders/receivers,
+       or registered with the poller or the task. */
     int used;
+    /* One of MILL_CLAUSE_*. */
+    int kind;
 };
 
+/* Allocates and releases segments of unbounded channels. 'size' is
+   the size of the segment including the list item heading it. */
+struct mill_slist_item *mill_allocchseg(size_t size);
+void mill_freechseg(size_t size, struct mill_slist_item *seg);
+
+static inline size_t mill_chsegsize(struct mill_chan *ch) {
+    return sizeof(struct mill_slist_item) + (ch->seglen * ch->sz);
+}
+
+static inline char *mill_chsegdata(struct mill_slist_item *seg) {
+    return (char*)(seg + 1);
+}
+
+/* Releases the segments of unbounded channels cached by the thread. */
+void mill_purgechsegs(void);
+
+/* Hands the buffered values to the receivers waiting on the channel.
+   Used when the values are appended to the buffer by other means than
+   sending. */
+void mill_chfeed(struct mill_chan *ch);
+
 /* Returns pointer to the channel that contains specified endpoint. */
 struct mill_chan *mill_getchan(struct mill_ep *ep);
 
+/* Unblocks the coroutine which created the clause. */
+void mill_choose_unblock(struct mill_clause *cl);
+
+/* Unblocks the coroutine waiting in choose for the file descriptor to
+   become ready. Called by the poller, which unregisters the coroutine
+   from 'mfd' itself. */
+void mill_choose_fdready(struct mill_cr *cr, struct mill_fd_s *mfd,
+    int events);
+
+/* Unblocks the coroutine waiting in choose for the task to finish. */
+void mill_choose_taskdone(struct mill_cr *cr, struct mill_task_s *t);
+
+/* Returns the buffer to store the value received by an in clause into. */
+void *mill_clause_dst(struct mill_clause *cl, size_t sz);
+
 #endif
 
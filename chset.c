@@ -0,0 +1,190 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "chan.h"
+#include "chset.h"
+#include "cr.h"
+#include "libpill.h"
+#include "list.h"
+#include "timer.h"
+#include "utils.h"
+
+/* The channels stay registered with the set between the waits. Instead of
+   inspecting all of them on every wait, the channels report to the set
+   when they become readable, i.e. when a value is put into the buffer,
+   when a sender blocks on them or when chdone() is called. The readable
+   channels are queued and served in turn. The queue may contain channels
+   which were drained in the meantime by other receivers, these are simply
+   skipped. */
+struct mill_chset_s {
+    /* All the channels in the set. */
+    struct mill_list items;
+    /* Channels which may be readable, in the order they became so. */
+    struct mill_list ready;
+    /* The coroutine blocked in chsetwait(), if any. */
+    struct mill_cr *waiter;
+};
+
+static int mill_chreadable(chan ch) {
+    return ch->items || ch->done || !mill_list_empty(&ch->sender.clauses);
+}
+
+chset mill_chsetmake(void) {
+    struct mill_chset_s *s = mill_malloc(sizeof(struct mill_chset_s));
+    if(!s) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mill_list_init(&s->items);
+    mill_list_init(&s->ready);
+    s->waiter = NULL;
+    return s;
+}
+
+void mill_chset_notify(struct mill_chsetitem *it) {
+    if(it->ready)
+        return;
+    it->ready = 1;
+    struct mill_chset_s *s = it->set;
+    mill_list_insert(&s->ready, &it->readyitem, NULL);
+    if(s->waiter) {
+        if(mill_timer_enabled(&s->waiter->timer))
+            mill_timer_rm(&s->waiter->timer);
+        mill_resume(s->waiter, 0);
+        s->waiter = NULL;
+    }
+}
+
+void mill_chset_drop(struct mill_chsetitem *it) {
+    struct mill_chset_s *s = it->set;
+    if(it->ready)
+        mill_list_erase(&s->ready, &it->readyitem);
+    mill_list_erase(&s->items, &it->item);
+    it->ch->receiver.set = NULL;
+    mill_free(it);
+}
+
+int mill_chsetadd(chset s, chan ch, int idx) {
+    if(mill_slow(idx < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* The values of cross-thread channels don't pass through the local
+       channel, there would be no one to report them. */
+    if(mill_slow(ch->xa)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if(mill_slow(ch->receiver.set)) {
+        errno = EBUSY;
+        return -1;
+    }
+    struct mill_chsetitem *it = mill_malloc(sizeof(struct mill_chsetitem));
+    if(!it) {
+        errno = ENOMEM;
+        return -1;
+    }
+    it->ready = 0;
+    it->set = s;
+    it->ch = ch;
+    it->idx = idx;
+    mill_list_insert(&s->items, &it->item, NULL);
+    ch->receiver.set = it;
+    if(mill_chreadable(ch))
+        mill_chset_notify(it);
+    return 0;
+}
+
+int mill_chsetrm(chset s, chan ch) {
+    struct mill_chsetitem *it = ch->receiver.set;
+    if(mill_slow(!it || it->set != s)) {
+        errno = ENOENT;
+        return -1;
+    }
+    mill_chset_drop(it);
+    return 0;
+}
+
+static void mill_chset_callback(struct mill_timer *timer) {
+    struct mill_cr *cr = mill_cont(timer, struct mill_cr, timer);
+    struct mill_chset_s *s = timer->data;
+    s->waiter = NULL;
+    mill_resume(cr, -1);
+}
+
+int mill_chsetwait(chset s, void *val, int64_t deadline) {
+    if(mill_slow(s->waiter)) {
+        errno = EBUSY;
+        return -1;
+    }
+    mill->running->state = MILL_CHOOSE;
+    while(1) {
+        struct mill_chsetitem *it = mill_cont(mill_list_begin(&s->ready),
+            struct mill_chsetitem, readyitem);
+        if(!it) {
+            s->waiter = mill->running;
+            if(deadline >= 0) {
+                mill_timer_add(&mill->running->timer, deadline,
+                    mill_chset_callback);
+                mill->running->timer.data = s;
+            }
+            if(mill_suspend() < 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        }
+        mill_list_erase(&s->ready, &it->readyitem);
+        it->ready = 0;
+        chan ch = it->ch;
+        if(!mill_chreadable(ch))
+            continue;
+        int idx = it->idx;
+        int rc = mill_chtryrecv(ch, val, 1);
+        mill_assert(rc == 1);
+        /* The channel goes to the back of the queue if there's more to
+           receive so that the other channels get their turn. */
+        if(mill_chreadable(ch))
+            mill_chset_notify(it);
+        /* Receiving is a scheduling point even if it doesn't block. */
+        mill_resume(mill->running, 0);
+        mill_suspend();
+        return idx;
+    }
+}
+
+int mill_chsetclose(chset s) {
+    if(mill_slow(s->waiter)) {
+        errno = EBUSY;
+        return -1;
+    }
+    while(!mill_list_empty(&s->items))
+        mill_chset_drop(mill_cont(mill_list_begin(&s->items),
+            struct mill_chsetitem, item));
+    mill_free(s);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_CHSET_INCLUDED
+#define MILL_CHSET_INCLUDED
+
+#include "list.h"
+#include "libpill.h"
+
+/* Registration of a channel with a select set. It stays linked to the
+   receiving endpoint of the channel between the waits so that the channel
+   can report that it has become readable. See chset.c. */
+struct mill_chsetitem {
+    /* Member of the list of all the channels in the set. */
+    struct mill_list_item item;
+    /* Member of the list of readable channels, if 'ready' is 1. */
+    struct mill_list_item readyitem;
+    int ready;
+    struct mill_chset_s *set;
+    chan ch;
+    /* The value to be returned from chsetwait() for this channel. */
+    int idx;
+};
+
+/* The channel may have become readable. */
+void mill_chset_notify(struct mill_chsetitem *it);
+
+/* The channel is being deallocated. */
+void mill_chset_drop(struct mill_chsetitem *it);
+
+#endif
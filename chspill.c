@@ -0,0 +1,236 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "chan.h"
+#include "chspill.h"
+#include "chstats.h"
+#include "cr.h"
+#include "libpill.h"
+#include "slist.h"
+#include "utils.h"
+
+struct mill_slist *mill_chspill_tail(chan ch) {
+    struct mill_chspill_s *sp = ch->spill;
+    /* Nothing may overtake the values already pending. */
+    if(sp->pending || !mill_slist_empty(&sp->tail))
+        return &sp->tail;
+    /* Keep filling the last segment of the channel, or add one if
+       the limit allows. */
+    if((ch->segs.last && ch->last != ch->seglen) || sp->nsegs < sp->maxsegs ||
+          mill_slow(sp->err))
+        return &ch->segs;
+    return &sp->tail;
+}
+
+void mill_chspill_wake(struct mill_chspill_s *sp) {
+    if(!sp->idle)
+        return;
+    sp->idle = 0;
+    mill->num_cr++;
+    mill_resume(sp->cr, 0);
+}
+
+/* Reads the next segment from the file into the channel. */
+static void mill_chspill_read(struct mill_chspill_s *sp) {
+    chan ch = sp->ch;
+    size_t len = ch->seglen * ch->sz;
+    struct mill_slist_item *seg = mill_allocchseg(sp->segsize);
+    ++sp->nsegs;
+    ssize_t sz = pread_a(sp->fd, mill_chsegdata(seg), len,
+        (off_t)(sp->rpos * len));
+    int err = sz < 0 ? errno : EIO;
+    if(mill_slow(!sp->ch)) {
+        mill_freechseg(sp->segsize, seg);
+        return;
+    }
+    /* The values in the file are lost. Drop them all, so that the rest
+       of the channel can go on. */
+    if(mill_slow(sz != (ssize_t)len)) {
+        mill_freechseg(sp->segsize, seg);
+        --sp->nsegs;
+        if(!sp->err)
+            sp->err = err;
+        sp->pending -= (sp->wpos - sp->rpos) * ch->seglen;
+        sp->rpos = sp->wpos = 0;
+        mill_chfeed(ch);
+        return;
+    }
+    ++sp->rpos;
+    if(sp->rpos == sp->wpos)
+        sp->rpos = sp->wpos = 0;
+    if(mill_slow(ch->stats))
+        mill_chstats_xfer(ch, 0, 0);
+    if(mill_slist_empty(&ch->segs))
+        ch->first = 0;
+    mill_slist_push_back(&ch->segs, seg);
+    ch->items += ch->seglen;
+    sp->pending -= ch->seglen;
+    mill_chfeed(ch);
+}
+
+/* Writes the first segment of the queue to the file. If that fails,
+   the segment goes back to the queue and the channel doesn't spill
+   anymore. */
+static void mill_chspill_write(struct mill_chspill_s *sp) {
+    chan ch = sp->ch;
+    size_t len = ch->seglen * ch->sz;
+    struct mill_slist_item *seg = mill_slist_pop(&sp->tail);
+    ssize_t sz = pwrite_a(sp->fd, mill_chsegdata(seg), len,
+        (off_t)(sp->wpos * len));
+    if(mill_slow(sz != (ssize_t)len && sp->ch)) {
+        sp->err = sz < 0 ? errno : ENOSPC;
+        mill_slist_push(&sp->tail, seg);
+        return;
+    }
+    mill_freechseg(sp->segsize, seg);
+    --sp->nsegs;
+    ++sp->wpos;
+}
+
+/* Moves the queue to the channel once the file is empty. */
+static void mill_chspill_join(struct mill_chspill_s *sp) {
+    chan ch = sp->ch;
+    if(mill_slow(ch->stats))
+        mill_chstats_xfer(ch, 0, 0);
+    if(mill_slist_empty(&ch->segs))
+        ch->first = 0;
+    struct mill_slist_item *seg;
+    while((seg = mill_slist_pop(&sp->tail)))
+        mill_slist_push_back(&ch->segs, seg);
+    ch->items += sp->pending;
+    sp->pending = 0;
+    mill_chfeed(ch);
+}
+
+/* Does one step of the work, if there's any. Returns 0 otherwise. */
+static int mill_chspill_step(struct mill_chspill_s *sp) {
+    chan ch = sp->ch;
+    int ondisk = sp->rpos != sp->wpos;
+    /* The receivers are running out of values. Unless they have nothing
+       at all, don't exceed the limit to read ahead. */
+    if(ondisk && ch->items < ch->seglen &&
+          (!ch->items || sp->nsegs < sp->maxsegs)) {
+        mill_chspill_read(sp);
+        return 1;
+    }
+    if(mill_slist_empty(&sp->tail))
+        return 0;
+    if(!ondisk && (sp->nsegs <= sp->maxsegs || !ch->items || sp->err)) {
+        mill_chspill_join(sp);
+        return 1;
+    }
+    /* Only the segments the senders are done with can be written. */
+    if(sp->nsegs > sp->maxsegs && !sp->err &&
+          (sp->tail.first != sp->tail.last || ch->last == ch->seglen)) {
+        mill_chspill_write(sp);
+        return 1;
+    }
+    return 0;
+}
+
+coroutine static void mill_chspiller(struct mill_chspill_s *sp) {
+    sp->cr = mill->running;
+    while(sp->ch) {
+        if(mill_chspill_step(sp))
+            continue;
+        /* The spiller counts as a coroutine for mill_waitall() only while
+           it has some work, see mill_chspill_wake(). */
+        sp->idle = 1;
+        mill->num_cr--;
+        mill_waitall_check();
+        mill_suspend();
+    }
+    close_a(sp->fd);
+    mill_free(sp);
+}
+
+void mill_chspill_close(chan ch) {
+    struct mill_chspill_s *sp = ch->spill;
+    struct mill_slist_item *seg;
+    while((seg = mill_slist_pop(&sp->tail)))
+        mill_freechseg(sp->segsize, seg);
+    ch->spill = NULL;
+    /* The spiller frees the rest once it's done with the file. */
+    sp->ch = NULL;
+    mill_chspill_wake(sp);
+}
+
+int mill_chspill(chan ch, const char *path, size_t limit) {
+    if(mill_slow(!ch->seglen || ch->spill)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open_a(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(mill_slow(fd < 0))
+        return -1;
+    /* Nobody else is supposed to see the file. */
+    if(mill_slow(unlink_a(path) < 0)) {
+        int err = errno;
+        close_a(fd);
+        errno = err;
+        return -1;
+    }
+    struct mill_chspill_s *sp = mill_malloc(sizeof(struct mill_chspill_s));
+    if(mill_slow(!sp)) {
+        close_a(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    sp->ch = ch;
+    sp->cr = NULL;
+    sp->idle = 0;
+    sp->fd = fd;
+    sp->segsize = mill_chsegsize(ch);
+    sp->maxsegs = limit / sp->segsize;
+    if(sp->maxsegs < 1)
+        sp->maxsegs = 1;
+    sp->nsegs = 0;
+    struct mill_slist_item *it;
+    for(it = mill_slist_begin(&ch->segs); it; it = mill_slist_next(it))
+        ++sp->nsegs;
+    mill_slist_init(&sp->tail);
+    sp->pending = 0;
+    sp->rpos = 0;
+    sp->wpos = 0;
+    sp->done = 0;
+    sp->err = 0;
+    ch->spill = sp;
+    /* Most of the time the spiller waits for the worker threads. */
+    mill_setspawnstack(MILL_STACK_16K);
+    mill_go(mill_chspiller(sp), NULL);
+    return 0;
+}
+
+int mill_chspillerr(chan ch) {
+    if(mill_slow(!ch->spill)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ch->spill->err;
+}
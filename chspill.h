@@ -0,0 +1,79 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_CHSPILL_INCLUDED
+#define MILL_CHSPILL_INCLUDED
+
+#include <stddef.h>
+
+#include "libpill.h"
+#include "slist.h"
+
+struct mill_cr;
+
+/* Overflow of an unbounded channel into a file, see chspill(). Once the
+   segments of the channel exceed the limit, the new ones are queued here
+   instead, behind the segments already in the file. The spiller coroutine
+   writes them to the file as long as the limit is exceeded, and reads them
+   back into the channel as the receivers catch up. Once the file is empty,
+   the rest of the queue joins the channel. The queue is kept in order:
+   the channel, the file, the queue here. */
+struct mill_chspill_s {
+    /* The channel, NULL once it's been deallocated. */
+    chan ch;
+    /* The spiller coroutine and whether it's waiting for work. */
+    struct mill_cr *cr;
+    int idle;
+    int fd;
+    /* Size of a segment and the maximum number of them in memory. */
+    size_t segsize;
+    size_t maxsegs;
+    /* Number of segments of the channel in memory. */
+    size_t nsegs;
+    /* The segments waiting to be written to the file, the last one is
+       being filled by the senders. */
+    struct mill_slist tail;
+    /* Number of values in the file and in the queue. Those don't count
+       in ch->items, as they can't be received straight away. */
+    size_t pending;
+    /* Range of the segments in the file, in segments. */
+    size_t rpos;
+    size_t wpos;
+    /* 1 if chdone() was called while there were values pending. */
+    int done;
+    /* The first error accessing the file, see chspillerr(). */
+    int err;
+};
+
+/* Returns the list of segments the values sent to the channel go to. */
+struct mill_slist *mill_chspill_tail(chan ch);
+
+/* Lets the spiller coroutine know there may be some work for it. Till it
+   runs out of work, the spiller counts as a coroutine for mill_waitall(). */
+void mill_chspill_wake(struct mill_chspill_s *spill);
+
+/* Called when the channel is deallocated. */
+void mill_chspill_close(chan ch);
+
+#endif
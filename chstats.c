@@ -0,0 +1,140 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "chan.h"
+#include "chstats.h"
+#include "cr.h"
+#include "libpill.h"
+#include "utils.h"
+
+static int64_t mill_chstats_now(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    mill_assert(rc == 0);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Accounts for the time the current number of values spent in the buffer. */
+static void mill_chstats_occupancy(chan ch, int64_t nw) {
+    ch->stats->occupancy += (double)ch->items * (nw - ch->stats->stamp);
+    ch->stats->stamp = nw;
+}
+
+void mill_chstats_xfer(chan ch, size_t sent, size_t received) {
+    mill_chstats_occupancy(ch, mill_chstats_now());
+    ch->stats->totals.sent += sent;
+    ch->stats->totals.received += received;
+}
+
+void mill_chstats_block(struct mill_ep *ep) {
+    struct mill_chan *ch = mill_getchan(ep);
+    struct mill_chstats *st = &ch->stats->totals;
+    if(ep->type == MILL_SENDER) {
+        st->sendblocks++;
+        if(ep->waiting > st->maxsenders)
+            st->maxsenders = ep->waiting;
+    }
+    else {
+        st->recvblocks++;
+        if(ep->waiting > st->maxreceivers)
+            st->maxreceivers = ep->waiting;
+    }
+}
+
+void mill_chstats_free(chan ch) {
+    mill_list_erase(&mill->chans, &ch->stats->item);
+    mill_free(ch->stats->name);
+    mill_free(ch->stats);
+    ch->stats = NULL;
+}
+
+int mill_chname(chan ch, const char *name) {
+    size_t len = strlen(name);
+    char *copy = mill_malloc(len + 1);
+    if(!copy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(copy, name, len + 1);
+    /* Renaming a registered channel keeps its statistics. */
+    if(ch->stats) {
+        mill_free(ch->stats->name);
+        ch->stats->name = copy;
+        return 0;
+    }
+    struct mill_chstats_s *stats = mill_malloc(sizeof(struct mill_chstats_s));
+    if(!stats) {
+        mill_free(copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(stats, 0, sizeof(struct mill_chstats_s));
+    stats->ch = ch;
+    stats->name = copy;
+    stats->stamp = stats->start = mill_chstats_now();
+    mill_list_insert(&mill->chans, &stats->item, NULL);
+    ch->stats = stats;
+    return 0;
+}
+
+int mill_chstats(chan ch, struct mill_chstats *stats, int reset) {
+    if(mill_slow(!ch->stats)) {
+        errno = ENOENT;
+        return -1;
+    }
+    int64_t nw = mill_chstats_now();
+    mill_chstats_occupancy(ch, nw);
+    *stats = ch->stats->totals;
+    stats->name = ch->stats->name;
+    stats->items = ch->items;
+    stats->senders = ch->sender.waiting;
+    stats->receivers = ch->receiver.waiting;
+    stats->elapsed = nw - ch->stats->start;
+    stats->occupancy = stats->elapsed ?
+        ch->stats->occupancy / stats->elapsed : (double)ch->items;
+    if(reset) {
+        memset(&ch->stats->totals, 0, sizeof(struct mill_chstats));
+        ch->stats->occupancy = 0;
+        ch->stats->start = nw;
+    }
+    return 0;
+}
+
+int mill_chlist(chan *chs, int n) {
+    int count = 0;
+    struct mill_list_item *it;
+    for(it = mill_list_begin(&mill->chans); it; it = mill_list_next(it)) {
+        if(count < n) {
+            struct mill_chstats_s *stats = mill_cont(it,
+                struct mill_chstats_s, item);
+            chs[count] = stats->ch;
+        }
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,63 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_CHSTATS_INCLUDED
+#define MILL_CHSTATS_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libpill.h"
+#include "list.h"
+
+struct mill_ep;
+
+/* Statistics of a channel registered with chname(). Channels that aren't
+   registered have no statistics and pay only for checking ch->stats. */
+struct mill_chstats_s {
+    /* Member of the registry of the thread, mill->chans. */
+    struct mill_list_item item;
+    chan ch;
+    char *name;
+    /* Time of the last change of the number of buffered values, and of
+       the last reset. */
+    int64_t stamp;
+    int64_t start;
+    /* Integral of the number of buffered values over time, in value-ns. */
+    double occupancy;
+    struct mill_chstats totals;
+};
+
+/* Called before the number of values in the buffer changes. 'sent' and
+   'received' are the numbers of values that got into and out of the
+   channel. */
+void mill_chstats_xfer(chan ch, size_t sent, size_t received);
+
+/* Called when a clause of a coroutine blocks on the endpoint. */
+void mill_chstats_block(struct mill_ep *ep);
+
+/* Called when the channel is deallocated. */
+void mill_chstats_free(chan ch);
+
+#endif
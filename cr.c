@@ -28,7 +28,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <signal.h>
+#if defined __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "cr.h"
 #include "libpill.h"
@@ -54,57 +58,141 @@ static void *mill_getvalbuf(struct mill_cr *cr) {
     return (void*)mill->main_valbuf;
 }
 
+void *mill_valbuf(struct mill_cr *cr, size_t size) {
+    if(mill_fast(size <= mill->valbuf_size))
+        return mill_getvalbuf(cr);
+    /* Large values go to the heap rather than making the valbuf of every
+       stack bigger. The buffer is never shrunk. */
+    if(size > cr->bigvalbuf_size) {
+        void *buf = mill_realloc(cr->bigvalbuf, size);
+        if(!buf)
+            mill_panic("not enough memory to store the value");
+        cr->bigvalbuf = buf;
+        cr->bigvalbuf_size = size;
+    }
+    return cr->bigvalbuf;
+}
+
+static void mill_freevalbuf(struct mill_cr *cr) {
+    if(mill_fast(!cr->bigvalbuf))
+        return;
+    mill_free(cr->bigvalbuf);
+    cr->bigvalbuf = NULL;
+    cr->bigvalbuf_size = 0;
+}
+
+/* A non-empty lower priority queue is served once per this many
+   coroutines picked from the higher priority queues. */
+#define MILL_PRIO_STARVE_LIMIT 32
+
+/* Returns the next coroutine to run or NULL if there's none ready. */
+static inline struct mill_cr *mill_pick(void) {
+    unsigned mask = mill->ready_mask;
+    if(mill_slow(!mask))
+        return NULL;
+    int prio = __builtin_ctz(mask);
+    /* Starvation guard. Lower priority levels which were passed over too
+       many times get their turn. */
+    if(mill_slow(mask >> (prio + 1))) {
+        int l;
+        for(l = MILL_PRIO_COUNT - 1; l > prio; --l) {
+            if(!(mask & (1u << l)))
+                continue;
+            if(++mill->ready_skips[l] >= MILL_PRIO_STARVE_LIMIT) {
+                mill->ready_skips[l] = 0;
+                prio = l;
+                break;
+            }
+        }
+    }
+    struct mill_slist *q = &mill->ready[prio];
+    struct mill_slist_item *it = q->first;
+    q->first = it->next;
+    if(!q->first) {
+        q->last = NULL;
+        mill->ready_mask = mask & ~(1u << prio);
+        mill->ready_skips[prio] = 0;
+    }
+    mill_slist_set_detached(it);
+    return mill_cont(it, struct mill_cr, ready);
+}
+
 int mill_suspend(void) {
     /* Even if process never gets idle, we have to process external events
        once in a while. The external signal may very well be a deadline or
        a user-issued command that cancels the CPU intensive operation. */
     struct mill_cr *mill_running = mill->running;
 
-    if(mill->counter >= 103) {
+    if(mill->counter >= mill->poll_budget) {
         mill_wait(0);
         mill->counter = 0;
     }
     if(mill_running && mill_running->suspend_hook)
         mill_running->suspend_hook(mill_running->cls, 0);
+    if(mill_running) {
+        mill_stats_stop(mill_running);
+        mill_trace(mill_trace_id(mill_running), MILL_TRACE_SUSPEND,
+            mill_running->state);
+    }
     /* Store the context of the current coroutine, if any. */
-    if(mill_running && sigsetjmp(mill_running->ctx, 0))
+    if(mill_running && mill_setjmp(&mill_running->ctx))
         return mill_running->result;
     while(1) {
         /* If there's a coroutine ready to be executed go for it. */
-        if(!mill_slist_empty(&mill->ready)) {
+        struct mill_cr *cr = mill_pick();
+        if(cr) {
             ++mill->counter;
-            struct mill_slist_item *it = mill_slist_pop(&mill->ready);
-            mill->running = mill_running = mill_cont(it, struct mill_cr, ready);
+            mill->running = mill_running = cr;
             mill_running->state = 0;
+            mill_stats_run(cr);
+            mill_trace(mill_trace_id(cr), MILL_TRACE_RUN, 0);
             if(mill_slow(mill_running->resume_hook))
                 mill_running->resume_hook(mill_running->cls);
-            siglongjmp(mill_running->ctx, 1);
+            mill_longjmp(&mill_running->ctx);
         }
         /* Otherwise, we are going to wait for sleeping coroutines
            and for external events. */
+        mill_trace(0, MILL_TRACE_IDLE, 0);
         mill_wait(1);
+        mill_trace(0, MILL_TRACE_WAKE, 0);
         /* XXX: not true, See mill_task_timedout() in task.c.
-         mill_assert(!mill_slist_empty(&mill->ready)); */
+         mill_assert(mill->ready_mask); */
         mill->counter = 0;
     }
 }
 
+static void mill_resume_remote(struct mill_cr *cr, int result);
+
 void mill_resume(struct mill_cr *cr, int result) {
+    if(mill_slow(cr->owner != mill)) {
+        mill_resume_remote(cr, result);
+        return;
+    }
     mill_assert(cr->state != MILL_READY);
     cr->result = result;
     cr->state = MILL_READY;
-    mill_slist_push_back(&mill->ready, &cr->ready);
+    mill_stats_ready(cr);
+    mill_trace(mill_trace_id(cr), MILL_TRACE_READY, 0);
+    int prio = cr->prio;
+    mill_slist_push_back(&mill->ready[prio], &cr->ready);
+    mill->ready_mask |= 1u << prio;
 }
 
-void *mill_allocstack(void) {
-    if(!mill_slist_empty(&mill->cached_stacks)) {
-        --mill->num_cached_stacks;
-        return (void*)(mill_slist_pop(&mill->cached_stacks) + 1);
+static inline void *mill_allocstackcls(int cls) {
+    struct mill_stackcache *sc = &mill->stacks[cls];
+    ++sc->spawns;
+    if(mill_fast(!mill_slist_empty(&sc->hot))) {
+        --sc->num_hot;
+        return (void*)(mill_slist_pop(&sc->hot) + 1);
     }
-    return mill_allocstackmem();
+    return mill_allocstackmem(cls);
 }
 
-sigjmp_buf *mill_getctx(void) {
+void *mill_allocstack(void) {
+    return mill_allocstackcls(0);
+}
+
+mill_ctx *mill_getctx(void) {
     return &mill->running->ctx;
 }
 
@@ -114,34 +202,62 @@ void *mill_go_prologue(void *stackmem) {
     mill_assert(mill != NULL);
     /* Allocate and initialise new stack. */
     struct mill_cr *cr = stackmem;
+    int cls = 0;
     if(!cr) {
-        cr = mill_allocstack();
+        cls = mill->spawn_class;
+        cr = mill_allocstackcls(cls);
         if(!cr)
             mill_panic("not enough memory to allocate coroutine stack");
     }
+    mill->spawn_class = 0;
     cr = cr - 1;
+    cr->stack_class = cls;
     mill_list_insert(&mill->all_crs, &cr->item, NULL);
     cr->cls = NULL;
+    cr->bigvalbuf = NULL;
+    cr->bigvalbuf_size = 0;
     cr->resume_hook = NULL;
     cr->suspend_hook = NULL;
     cr->wg = NULL;
     cr->state = 0;
     memset(&cr->timer, '\0', sizeof (struct mill_timer));
     cr->mfd = NULL;
+    cr->owner = mill;
+    cr->prio = mill->spawn_prio >= 0 ? mill->spawn_prio : mill->running->prio;
+    mill->spawn_prio = -1;
     mill_slist_set_detached(&cr->ready);
     mill_list_set_detached(&cr->wgitem);
     mill->num_cr++;
+    /* Stacks supplied by the user are of unknown size. */
+    mill_stackprof_paint(cr, ((char*)cr) - mill->valbuf_size,
+        stackmem ? NULL : __builtin_return_address(0));
     /* Suspend the parent coroutine and make the new one running. */
     if(mill_slow(mill->running->suspend_hook))
         mill->running->suspend_hook(mill->running->cls, 0);
     mill_resume(mill->running, 0);
+    mill_stats_stop(mill->running);
+    mill_trace_setid(cr);
+    mill_trace(mill_trace_id(cr), MILL_TRACE_GO,
+        mill_trace_id(mill->running));
     mill->running = cr;
+    mill_stats_start(cr);
     /* Return pointer to the top of the stack. There's valbuf interposed
        between the mill_cr structure and the stack itself. */
     return (void*)(((char*)cr) - mill->valbuf_size);
 }
 
 /* The final part of go(). Cleans up after the coroutine is finished. */
+void mill_waitall_check(void) {
+    if(mill_slow(mill->do_waitall && mill->num_cr == 0)) {
+        struct mill_cr *cr = &mill->main;
+        mill_assert(mill->num_tasks == 0);
+        mill->do_waitall = 0;
+        if(mill_timer_enabled(&cr->timer))
+            mill_timer_rm(&cr->timer);
+        mill_resume(cr, 0);
+    }
+}
+
 void mill_go_epilogue(void) {
     struct mill_cr *mill_running = mill->running;
     if(mill_running->suspend_hook)
@@ -155,23 +271,41 @@ void mill_go_epilogue(void) {
     /* Make sure coroutine timer isn't in the min-heap */
     mill_timer_cancel(&mill_running->timer);
 
-    mill_freestack(mill_running + 1);
+    mill_stats_stop(mill_running);
+    mill_trace(mill_trace_id(mill_running), MILL_TRACE_EXIT, 0);
+    mill_stackprof_record(mill_running);
+    mill_freevalbuf(mill_running);
+    mill_freestack(mill_running + 1, mill_running->stack_class);
     mill->num_cr--;
     mill->running = NULL;
-    if(mill_slow(mill->do_waitall && mill->num_cr == 0)) {
-        struct mill_cr *cr = &mill->main;
-        mill_assert(mill->num_tasks == 0);
-        mill->do_waitall = 0;
-        if(mill_timer_enabled(&cr->timer))
-            mill_timer_rm(&cr->timer);
-        mill_resume(cr, 0);
-    }
+    mill_waitall_check();
 
     /* Given that there's no running coroutine at this point
        this call will never return. */
     mill_suspend();
 }
 
+int mill_setprio(int prio) {
+    mill_assert(prio >= 0 && prio < MILL_PRIO_COUNT);
+    int old = mill->running->prio;
+    mill->running->prio = prio;
+    return old;
+}
+
+int mill_getprio(void) {
+    return mill->running->prio;
+}
+
+void mill_setspawnstack(int cls) {
+    mill_assert(cls >= 0 && cls < MILL_STACK_CLASSES);
+    mill->spawn_class = cls;
+}
+
+void mill_setspawnprio(int prio) {
+    mill_assert(prio >= -1 && prio < MILL_PRIO_COUNT);
+    mill->spawn_prio = prio;
+}
+
 void mill_yield(void) {
     /* This looks fishy, but yes, we can resume the coroutine even before
        suspending it. */
@@ -184,10 +318,6 @@ int iscrmain(void) {
     return (mill->running == &mill->main);
 }
 
-void *mill_valbuf(struct mill_cr *cr, size_t size) {
-    assert(size <= 128);
-    return mill_getvalbuf(cr);
-}
 
 void mill_sethook(void *data,
         void (*resume_hook)(void *), void (*suspend_hook)(void *, int)) {
@@ -196,6 +326,128 @@ void mill_sethook(void *data,
     mill->running->suspend_hook = suspend_hook;
 }
 
+/* The resuming thread only links the coroutine into the owner's inbox.
+   The owner itself makes it ready once it gets to run the inbox coroutine,
+   i.e. not before the coroutine being resumed is fully suspended. */
+static void mill_resume_remote(struct mill_cr *cr, int result) {
+    struct mill_s *owner = cr->owner;
+    struct mill_cr *head;
+    mill_assert(owner->inbox_fd[1] >= 0);
+    cr->result = result;
+    do {
+        head = owner->inbox;
+        cr->rnext = head;
+    } while(!mill_atomic_set(&owner->inbox, head, cr));
+    if(head)
+        return;
+    /* The inbox was empty, wake up the owner. */
+    uint64_t one = 1;
+    while(1) {
+        ssize_t n = write(owner->inbox_fd[1], &one, sizeof(one));
+        if(mill_fast(n == sizeof(one)))
+            break;
+        mill_assert(n < 0);
+        if(errno == EINTR)
+            continue;
+        /* The pipe is full, there's a pending wakeup anyway. */
+        mill_assert(errno == EAGAIN);
+        break;
+    }
+}
+
+coroutine static void mill_inbox_wait(int fd) {
+    uint64_t buf;
+    struct mill_fd_s *mfd = mill_open(fd);
+    mill_assert(mfd);
+
+    /* Adjust counter to exclude this coroutine. */
+    mill->num_cr--;
+
+    while(!mill->inbox_closing) {
+        ssize_t n = read(fd, &buf, sizeof(buf));
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            mill_assert(errno == EAGAIN);
+            mill_fdwait(mfd, FDW_IN, -1);
+            continue;
+        }
+        /* Take the whole list at once. It is in LIFO order. */
+        struct mill_cr *cr = __sync_lock_test_and_set(&mill->inbox, NULL);
+        struct mill_cr *fifo = NULL;
+        while(cr) {
+            struct mill_cr *next = cr->rnext;
+            cr->rnext = fifo;
+            fifo = cr;
+            cr = next;
+        }
+        while(fifo) {
+            cr = fifo;
+            fifo = cr->rnext;
+            mill_resume(cr, cr->result);
+        }
+    }
+    mill_close(mfd, 0);
+}
+
+int mill_inbox_open(void) {
+    int fd[2];
+    if(mill_fast(mill->inbox_fd[0] >= 0))
+        return 0;
+#if defined __linux__
+    fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK);
+    if(fd[0] == -1)
+        return -1;
+#else
+    if(-1 == pipe(fd))
+        return -1;
+    int flag = fcntl(fd[1], F_GETFL);
+    if(flag == -1)
+        flag = 0;
+    if(-1 == fcntl(fd[1], F_SETFL, flag|O_NONBLOCK)) {
+        int err = errno;
+        close(fd[0]);
+        close(fd[1]);
+        errno = err;
+        return -1;
+    }
+#endif
+    void *ptr = mill_allocstack();
+    if(!ptr) {
+        close(fd[0]);
+        if(fd[1] != fd[0])
+            close(fd[1]);
+        errno = ENOMEM;
+        return -1;
+    }
+    mill->inbox_fd[0] = fd[0];
+    mill->inbox_fd[1] = fd[1];
+    mill->inbox_closing = 0;
+    /* Wakeups from other threads shouldn't queue behind local work. */
+    mill_setspawnprio(MILL_PRIO_HIGH);
+    mill_go(mill_inbox_wait(fd[0]), ptr);
+    return 0;
+}
+
+void mill_inbox_close(void) {
+    if(mill->inbox_fd[0] < 0)
+        return;
+    mill->inbox_closing = 1;
+    uint64_t one = 1;
+    ssize_t n = write(mill->inbox_fd[1], &one, sizeof(one));
+    mill_assert(n == sizeof(one) || errno == EAGAIN);
+    /* Wait for the inbox coroutine to exit. The counter was decremented
+       in mill_inbox_wait(). */
+    mill->num_cr++;
+    mill_waitall(-1);
+    /* Anything resumed from now on would be lost. */
+    mill_assert(mill->inbox == NULL);
+    close(mill->inbox_fd[0]);
+    if(mill->inbox_fd[1] != mill->inbox_fd[0])
+        close(mill->inbox_fd[1]);
+    mill->inbox_fd[0] = mill->inbox_fd[1] = -1;
+}
+
 /* default stack size */
 #define MILL_STACK_SIZE (64 * 1024)
 
@@ -207,6 +459,7 @@ mill_t *mill_init__p(int stacksize) {
     }
     memset(mill, '\0', sizeof (mill_t));
     mill->task_fd[0] = mill->task_fd[1] = -1;   /* not used in worker threads */
+    mill->inbox_fd[0] = mill->inbox_fd[1] = -1;
 
     if(-1 == mill_timers_init()) {
         mill_free(mill);
@@ -216,7 +469,17 @@ mill_t *mill_init__p(int stacksize) {
     memset(&mill_main->timer, '\0', sizeof (struct mill_timer));
     mill_main->mfd = NULL;
     mill_main->state = 0;
+    mill_main->owner = mill;
+    mill_main->prio = MILL_PRIO_NORMAL;
+    mill_stats_start(mill_main);
+    mill->spawn_prio = -1;
+    mill->rand_state = (uint32_t)(uintptr_t)mill ^ (uint32_t)now();
+    if(!mill->rand_state)
+        mill->rand_state = 1;
     mill->valbuf_size = 128;
+    mill->poll_budget = MILL_POLL_BUDGET;
+    mill->poll_budget_min = MILL_POLL_BUDGET_MIN;
+    mill->poll_budget_max = MILL_POLL_BUDGET_MAX;
     mill->all_crs.first = &mill_main->item;
     mill->all_crs.last = &mill_main->item;
     mill->running = mill_main;
@@ -230,6 +493,7 @@ mill_t *mill_init__p(int stacksize) {
     if(stacksize < 0)
         stacksize = MILL_STACK_SIZE;
     mill->stack_size = mill_get_stack_size(stacksize);
+    mill_initstacks();
     return mill;
 }
 
@@ -243,9 +507,13 @@ void mill_fini(void) {
     if(mill) {
         mill_waitall(-1);
         close_task_fds();
+        mill_inbox_close();
         mill_poller_fini();
         mill_purgestacks();
+        mill_purgechsegs();
         mill_timers_fini();
+        mill_trace_fini();
+        mill_freevalbuf(&mill->main);
         mill_free(mill);
         mill = NULL;
     }
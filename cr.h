@@ -35,6 +35,11 @@
 #include "timer.h"
 #include "utils.h"
 #include "fd.h"
+#include "libpill.h"
+#include "stack.h"
+#include "stackprof.h"
+#include "stats.h"
+#include "trace.h"
 
 enum mill_state {
     MILL_READY = 1,
@@ -48,6 +53,7 @@ enum mill_state {
 
 struct mill_wgroup_s;
 struct mill_task_s;
+struct mill_s;
 
 /* The coroutine. The memory layout looks like this:
 
@@ -56,7 +62,9 @@ struct mill_task_s;
    +----------------------------------------------------+--------+---------+
 
    - mill_cr contains generic book-keeping info about the coroutine
-   - valbuf is a buffer for temporarily storing values received from channels
+   - valbuf is a buffer for temporarily storing values received from channels;
+     values that don't fit into it are stored in a buffer allocated
+     on the heap instead (see mill_valbuf())
    - stack is a standard C stack; it grows downwards (at the moment libmill
      doesn't support microarchitectures where stack grows upwards)
 
@@ -85,7 +93,7 @@ struct mill_cr {
     struct mill_choosedata choosedata;
 
     /* Stored coroutine context while it is not executing. */
-    sigjmp_buf ctx;
+    mill_ctx ctx;
 
     struct mill_list_item wgitem;
 
@@ -100,8 +108,41 @@ struct mill_cr {
     /* Coroutine-local storage. */
     void *cls;
 
+    /* Heap-allocated buffer for values larger than the valbuf, NULL if
+       there was no such value yet. It's freed when the coroutine exits. */
+    void *bigvalbuf;
+    size_t bigvalbuf_size;
+
     /* List of all coroutines */
     struct mill_list_item item;
+
+    /* The thread the coroutine belongs to. */
+    struct mill_s *owner;
+
+    /* Scheduling priority, one of MILL_PRIO_*. Selects the ready queue. */
+    int prio;
+
+    /* Size class of the stack, one of MILL_STACK_*. */
+    int stack_class;
+
+#if defined MILL_STATS
+    struct mill_crstats_s stats;
+#endif
+
+#if defined MILL_STACKPROF
+    /* The go() that launched the coroutine and the top of its stack.
+       See stackprof.c. */
+    void *spawnsite;
+    void *stacktop;
+#endif
+
+#if defined MILL_TRACE
+    /* Identifies the coroutine in the trace. The main coroutine is 0. */
+    uint32_t id;
+#endif
+
+    /* Next coroutine in the owner's inbox. See mill_resume(). */
+    struct mill_cr *rnext;
 };
 
 /* Suspend running coroutine. Move to executing different coroutines. Once
@@ -109,13 +150,26 @@ struct mill_cr {
    of that function will be returned. */
 int mill_suspend(void);
 
+/* Schedule the coroutine for execution. If the coroutine belongs to
+   a different thread it is handed over to that thread's inbox, which must
+   have been opened beforehand using mill_inbox_open(). */
 void mill_resume(struct mill_cr *cr, int result);
 
+/* Resumes the main coroutine waiting in mill_waitall() if there are no
+   coroutines left to wait for. Called once a coroutine stops counting
+   in num_cr. */
+void mill_waitall_check(void);
+
+/* Make coroutines of the calling thread resumable from other threads. */
+int mill_inbox_open(void);
+void mill_inbox_close(void);
+
 /* Returns pointer to the value buffer. The returned buffer is guaranteed
-   to be at least 'size' bytes long. */
+   to be at least 'size' bytes long. Asking for the same size again returns
+   the same buffer. */
 void *mill_valbuf(struct mill_cr *cr, size_t size);
 
-typedef struct {
+typedef struct mill_s {
     /* Fake coroutine corresponding to the main thread of execution. */
     struct mill_cr main;
 
@@ -129,38 +183,97 @@ typedef struct {
     /* list of all coroutines */
     struct mill_list all_crs;
 
+    /* Channels registered with chname(), see chstats.c. */
+    struct mill_list chans;
+
+    /* Number of context switches since the last poll for external events.
+       The poll is done once it reaches poll_budget, which adapts to the
+       number of events returned within [poll_budget_min, poll_budget_max].
+       See mill_wait(). */
     int counter;
+    int poll_budget;
+    int poll_budget_min;
+    int poll_budget_max;
+
     int choose_seqnum;
 
+    /* State of the generator used to pick among the available clauses,
+       see mill_xorshift(). */
+    uint32_t rand_state;
+
     int do_waitall;
 
-    /* Queue of coroutines scheduled for execution. */
-    struct mill_slist ready;
+    /* Queues of coroutines scheduled for execution, one per priority.
+       Bit N of ready_mask is set if ready[N] is non-empty. */
+    struct mill_slist ready[MILL_PRIO_COUNT];
+    unsigned ready_mask;
+
+    /* Number of times each priority level was passed over while non-empty.
+       See mill_suspend(). */
+    int ready_skips[MILL_PRIO_COUNT];
+
+    /* Priority of the coroutine created by the next go(), -1 to inherit
+       the priority of the parent. */
+    int spawn_prio;
+
+    /* Caches of unused stacks, one for each size class. */
+    struct mill_stackcache stacks[MILL_STACK_CLASSES];
+
+    /* Size class of the stack of the coroutine created by the next go(). */
+    int spawn_class;
+
+    /* Region the stacks are carved from, see mill_stackarena(). Unused
+       stacks from the arena are kept in arena_stacks. */
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+    int arena_flags;
+    struct mill_slist arena_stacks;
 
-    /* A stack of unused coroutine stacks. This allows for extra-fast allocation
-       of a new stack. The FIFO nature of this structure minimises cache misses.
-       When the stack is cached its mill_slist_item is placed on its top rather
-       then on the bottom. That way we minimise page misses. */
-    int num_cached_stacks;
-    struct mill_slist cached_stacks;
+    /* Unused segments of unbounded channels, see mill_allocchseg(). */
+    int num_chsegs;
+    struct mill_slist chsegs;
 
     /* Global list of all timers. */
     struct mill_timers_s timers;
 
+    /* The time in microseconds as of the last look at the clock by the
+       scheduler, see now_cached(). */
+    int64_t now;
+
     /* Poller used to wait for file descriptors. */
     struct mill_poller *poller;
 
     /* Pipe for notification of finished tasks. */
     int task_fd[2];
 
-    /* Number of pending jobs summitted to the threadpool */
+    /* Number of pending jobs summitted to the threadpool a coroutine
+       is blocked on. */
     int num_tasks;
 
+    /* Coroutines resumed by other threads. The list is pushed to lock-free
+       by the resuming thread and drained by the inbox coroutine. The fd is
+       signalled only when the list changes from empty to non-empty. */
+    struct mill_cr *volatile inbox;
+    int inbox_fd[2];
+    int inbox_closing;
+
     /* Size of the buffer for temporary storage of values received from channels.
        It should be properly aligned and never change if there are any stacks
        allocated at the moment. */
     size_t valbuf_size;    /* = 128 */
 
+#if defined MILL_STATS
+    /* Histograms of the intervals of all the coroutines. */
+    struct mill_schedstats stats;
+#endif
+
+#if defined MILL_TRACE
+    /* The trace ring, NULL if tracing is off. */
+    struct mill_trace_s *trace;
+    uint32_t trace_lastid;
+#endif
+
     /* Valbuf for tha main coroutine. */
     char main_valbuf[128];
 } mill_t;
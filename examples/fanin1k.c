@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "libpill.h"
+
+/*
+Fan-in from 1000 producers, each with its own channel. A choose statement
+can't wait on a varying number of channels, so the usual way is to have
+a coroutine per channel forward the values to a single channel. A select
+set waits on all the channels directly.
+*/
+
+#define NPRODUCERS 1000
+
+/* send 'count' values, then the end marker */
+coroutine void produce(chan ch, int id, int count) {
+    int i;
+    for (i = 0; i != count; i++)
+        chs(ch, int, id);
+    chs(ch, int, -1);
+    chclose(ch);
+}
+
+/* receive values from a channel and send them to the shared channel */
+coroutine void forward(chan from, chan to) {
+    while (1) {
+        int k = chr(from, int);
+        chs(to, int, k);
+        if (k < 0)
+            break;
+    }
+    chclose(from);
+    chclose(to);
+}
+
+static long report(const char *name, int64_t start, long total) {
+    long ms = (long)(now() - start);
+    printf("%-10s %ld values in %ld ms, %ld ns per value\n",
+        name, total, ms, ms * 1000000 / total);
+    return ms;
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    long total = (long)NPRODUCERS * count;
+    chan ch[NPRODUCERS];
+    int j;
+    mill_init(-1, 0);
+
+    /* forwarding coroutines */
+    int64_t start = now();
+    chan merged = chmake(int, 0);
+    for (j = 0; j < NPRODUCERS; j++) {
+        ch[j] = chmake(int, 0);
+        go(produce(chdup(ch[j]), j, count));
+        go(forward(ch[j], chdup(merged)));
+    }
+    long n = 0;
+    int left = NPRODUCERS;
+    while (left) {
+        if (chr(merged, int) < 0)
+            left--;
+        else
+            n++;
+    }
+    assert(n == total);
+    report("forward", start, total);
+    chclose(merged);
+
+    /* select set */
+    start = now();
+    chset s = chsetmake();
+    for (j = 0; j < NPRODUCERS; j++) {
+        ch[j] = chmake(int, 0);
+        chsetadd(s, ch[j], j);
+        go(produce(chdup(ch[j]), j, count));
+    }
+    n = 0;
+    left = NPRODUCERS;
+    while (left) {
+        int val;
+        int idx = chsetwait(s, &val, -1);
+        assert(val == idx || val < 0);
+        if (val < 0) {
+            chclose(ch[idx]);
+            left--;
+        }
+        else
+            n++;
+    }
+    assert(n == total);
+    report("chset", start, total);
+    chsetclose(s);
+
+    mill_fini();
+    return 0;
+}
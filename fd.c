@@ -36,6 +36,7 @@
 #include "utils.h"
 #include "slist.h"
 #include "fd.h"
+#include "timer.h"
 
 #ifdef MSG_NOSIGNAL
 #define MILL_NOSIGPIPE MSG_NOSIGNAL
@@ -283,9 +284,13 @@ int mill_read(struct mill_fd_s *mfd, void *buf, int len,
 }
 
 int mill_fdevent(int fd, int events, int64_t deadline) {
+    return mill_fdevent_us(fd, events, mill_mstous(deadline));
+}
+
+int mill_fdevent_us(int fd, int events, int64_t deadline) {
     struct mill_fd_s mfd;
     mill_fdinit(&mfd, fd);
-    int rc = mill_fdwait(&mfd, events, deadline);
+    int rc = mill_fdwait_us(&mfd, events, deadline);
     mill_fdclean(&mfd);
     return rc;
 }
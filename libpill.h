@@ -87,6 +87,29 @@ MILL_EXPORT extern void *(*mill_realloc_func)(void *ptr, size_t size);
 
 MILL_EXPORT void *mill_init(int stacksize, int nworkers);
 MILL_EXPORT void mill_fini(void);
+
+/* Selects the timer implementation of the threads calling mill_init()
+   from now on. The binary heap is the default. The hierarchical timing
+   wheel adds and removes timers in constant time, which pays off with lots
+   of deadlines re-armed all the time, e.g. per message on each of many
+   connections. */
+#define MILL_TIMERS_HEAP 0
+#define MILL_TIMERS_WHEEL 1
+
+MILL_EXPORT void mill_settimers(int backend);
+
+/* Reserves a single region for 'nstacks' coroutine stacks of the calling
+   thread. Stacks are then sliced from it instead of being mapped one by
+   one and are never unmapped until mill_fini(). When the arena is
+   exhausted, stacks are allocated separately again. Each stack gets a guard
+   page unless MILL_ARENA_NOGUARD is set. MILL_ARENA_HUGEPAGE asks for
+   transparent huge pages, which can only be used if there are no guard
+   pages breaking up the region: it fails with EINVAL unless combined with
+   MILL_ARENA_NOGUARD. */
+#define MILL_ARENA_HUGEPAGE 1
+#define MILL_ARENA_NOGUARD 2
+
+MILL_EXPORT int mill_stackarena(size_t nstacks, int flags);
 MILL_EXPORT void mill_sethook(void *data,
         void (*resume_hook)(void *),
         void (*suspend_hook)(void *, int));
@@ -99,7 +122,19 @@ MILL_EXPORT int taskcount(void);
 /*  Helpers                                                                   */
 /******************************************************************************/
 
+/* Returns the time in milliseconds. The clock is monotonic, it doesn't
+   follow the changes of the system time. now_cached() returns the time
+   the scheduler read last, which it does each time the coroutines are
+   waiting for the file descriptors or the timers. It costs next to
+   nothing, but lags behind by the time the coroutines have been running
+   since, which is fine for most deadlines. */
 MILL_EXPORT int64_t now(void);
+MILL_EXPORT int64_t now_cached(void);
+
+/* Returns the time of the same clock in microseconds. The functions with
+   the _us suffix take the deadline in these units and are woken up with
+   the precision the poller is capable of, rather than a millisecond. */
+MILL_EXPORT int64_t now_us(void);
 
 /******************************************************************************/
 /*  Coroutines                                                                */
@@ -108,11 +143,151 @@ MILL_EXPORT int64_t now(void);
 MILL_EXPORT extern volatile MILL_THREAD int mill_unoptimisable1;
 MILL_EXPORT extern volatile MILL_THREAD void *mill_unoptimisable2;
 
-/* Allocates new stack. Returns pointer to the *top* of the stack.
-   For now we assume that the stack grows downwards. */
+/* Allocates new stack of the default size class. Returns pointer to the *top*
+   of the stack. For now we assume that the stack grows downwards. */
 MILL_EXPORT void *mill_allocstack(void);
 
-MILL_EXPORT sigjmp_buf *mill_getctx(void);
+/* A cooperative context switch only needs to preserve the callee-saved
+   registers, the stack pointer and the address to continue at. On x86-64
+   and aarch64 this is done by the inline assembly below. Elsewhere, or if
+   MILL_NO_ASM_CTX is defined (see --disable-asm-ctx), sigsetjmp() and
+   siglongjmp() are used instead. The library and the code using it must
+   agree on the choice; mill_getctx() is renamed so that a mismatch fails
+   to link rather than crash. */
+#if !defined MILL_NO_ASM_CTX && (defined __GNUC__ || defined __clang__) && \
+      (defined __x86_64__ || defined __aarch64__)
+#define MILL_ASM_CTX 1
+#endif
+
+#if defined MILL_ASM_CTX && defined __CET__
+#define MILL_ENDBR "endbr64\n\t"
+#else
+#define MILL_ENDBR ""
+#endif
+
+#if defined MILL_ASM_CTX && defined __x86_64__
+
+/* rbx, rbp, r12, rsp, r13, r14, r15, rip */
+typedef struct {void *regs[8];} mill_ctx;
+
+#define mill_setjmp(ctx) ({\
+    mill_ctx *mill_ctx_ = (ctx);\
+    int mill_ret_;\
+    __asm__ volatile(\
+        "leaq    1f(%%rip), %%rcx\n\t"\
+        "movq    %%rbx, (%%rdx)\n\t"\
+        "movq    %%rbp, 8(%%rdx)\n\t"\
+        "movq    %%r12, 16(%%rdx)\n\t"\
+        "movq    %%rsp, 24(%%rdx)\n\t"\
+        "movq    %%r13, 32(%%rdx)\n\t"\
+        "movq    %%r14, 40(%%rdx)\n\t"\
+        "movq    %%r15, 48(%%rdx)\n\t"\
+        "movq    %%rcx, 56(%%rdx)\n\t"\
+        "xorl    %%eax, %%eax\n\t"\
+        "1:\n\t"\
+        MILL_ENDBR\
+        : "=a" (mill_ret_), "+d" (mill_ctx_)\
+        :\
+        : "memory", "cc", "rcx", "rsi", "rdi",\
+          "r8", "r9", "r10", "r11",\
+          "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",\
+          "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14",\
+          "xmm15");\
+    mill_ret_;\
+})
+
+#define mill_longjmp(ctx) \
+    do {\
+        __asm__ volatile(\
+            "movq    56(%%rdx), %%rcx\n\t"\
+            "movq    48(%%rdx), %%r15\n\t"\
+            "movq    40(%%rdx), %%r14\n\t"\
+            "movq    32(%%rdx), %%r13\n\t"\
+            "movq    24(%%rdx), %%rsp\n\t"\
+            "movq    16(%%rdx), %%r12\n\t"\
+            "movq    8(%%rdx), %%rbp\n\t"\
+            "movq    (%%rdx), %%rbx\n\t"\
+            "jmpq    *%%rcx\n\t"\
+            : : "d" (ctx), "a" (1) : "memory");\
+        __builtin_unreachable();\
+    } while(0)
+
+#elif defined MILL_ASM_CTX && defined __aarch64__
+
+/* x19-x28, x29, sp, pc, padding, q8-q15 */
+typedef struct {uint64_t regs[30];} mill_ctx;
+
+#if defined __APPLE__
+#define MILL_X18 /* x18 is reserved for the platform. */
+#else
+#define MILL_X18 "x18",
+#endif
+
+#define mill_setjmp(ctx) ({\
+    register mill_ctx *mill_ctx_ __asm__("x1") = (ctx);\
+    register long mill_ret_ __asm__("x0");\
+    __asm__ volatile(\
+        "stp     x19, x20, [x1, #0]\n\t"\
+        "stp     x21, x22, [x1, #16]\n\t"\
+        "stp     x23, x24, [x1, #32]\n\t"\
+        "stp     x25, x26, [x1, #48]\n\t"\
+        "stp     x27, x28, [x1, #64]\n\t"\
+        "mov     x2, sp\n\t"\
+        "stp     x29, x2, [x1, #80]\n\t"\
+        "adr     x2, 1f\n\t"\
+        "str     x2, [x1, #96]\n\t"\
+        "stp     q8, q9, [x1, #112]\n\t"\
+        "stp     q10, q11, [x1, #144]\n\t"\
+        "stp     q12, q13, [x1, #176]\n\t"\
+        "stp     q14, q15, [x1, #208]\n\t"\
+        "mov     x0, #0\n\t"\
+        "1:\n\t"\
+        : "=r" (mill_ret_), "+r" (mill_ctx_)\
+        :\
+        : "memory", "cc", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9",\
+          "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17", MILL_X18\
+          "x30", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",\
+          "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",\
+          "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31");\
+    (int) mill_ret_;\
+})
+
+#define mill_longjmp(ctx) \
+    do {\
+        register mill_ctx *mill_ctx_ __asm__("x1") = (ctx);\
+        __asm__ volatile(\
+            "ldp     x19, x20, [x1, #0]\n\t"\
+            "ldp     x21, x22, [x1, #16]\n\t"\
+            "ldp     x23, x24, [x1, #32]\n\t"\
+            "ldp     x25, x26, [x1, #48]\n\t"\
+            "ldp     x27, x28, [x1, #64]\n\t"\
+            "ldp     x29, x2, [x1, #80]\n\t"\
+            "mov     sp, x2\n\t"\
+            "ldr     x2, [x1, #96]\n\t"\
+            "ldp     q8, q9, [x1, #112]\n\t"\
+            "ldp     q10, q11, [x1, #144]\n\t"\
+            "ldp     q12, q13, [x1, #176]\n\t"\
+            "ldp     q14, q15, [x1, #208]\n\t"\
+            "mov     x0, #1\n\t"\
+            "br      x2\n\t"\
+            : : "r" (mill_ctx_) : "memory");\
+        __builtin_unreachable();\
+    } while(0)
+
+#else
+
+typedef sigjmp_buf mill_ctx;
+
+#define mill_setjmp(ctx) sigsetjmp(*(ctx), 0)
+#define mill_longjmp(ctx) siglongjmp(*(ctx), 1)
+
+#endif
+
+#if defined MILL_ASM_CTX
+#define mill_getctx mill_getctx_asm
+#endif
+
+MILL_EXPORT mill_ctx *mill_getctx(void);
 MILL_EXPORT void *mill_go_prologue(void *stackmem);
 MILL_EXPORT void mill_go_epilogue(void);
 
@@ -128,7 +303,7 @@ MILL_EXPORT void mill_go_epilogue(void);
 #define mill_go(fn, mem) \
     do {\
         void *mill_sp;\
-        if(!sigsetjmp(*mill_getctx(), 0)) {\
+        if(!mill_setjmp(mill_getctx())) {\
             mill_sp = mill_go_prologue(mem);\
             int mill_anchor[mill_unoptimisable1];\
             mill_unoptimisable2 = &mill_anchor;\
@@ -141,11 +316,120 @@ MILL_EXPORT void mill_go_epilogue(void);
 
 #define go(fn) mill_go(fn, NULL)
 
+/* Stack size classes. MILL_STACK_DEFAULT is the size passed to mill_init(),
+   the others are fixed. Each class has its own cache of unused stacks. */
+#define MILL_STACK_DEFAULT 0
+#define MILL_STACK_8K 1
+#define MILL_STACK_16K 2
+#define MILL_STACK_64K 3
+#define MILL_STACK_256K 4
+
+/* Launch a coroutine on a stack of the given size class. */
+#define gostack(fn, cls) \
+    do {\
+        mill_setspawnstack(cls);\
+        mill_go(fn, NULL);\
+    } while(0)
+
+MILL_EXPORT void mill_setspawnstack(int cls);
+
+/* Scheduling priorities. A ready coroutine of a lower priority runs only
+   when there's no ready coroutine of a higher priority, except that
+   a starved lower priority gets a turn once in a while. New coroutines
+   inherit the priority of the parent. */
+#define MILL_PRIO_HIGH 0
+#define MILL_PRIO_NORMAL 1
+#define MILL_PRIO_LOW 2
+#define MILL_PRIO_COUNT 3
+
+/* Launch a coroutine with the given priority. */
+#define goprio(fn, prio) \
+    do {\
+        mill_setspawnprio(prio);\
+        mill_go(fn, NULL);\
+    } while(0)
+
+/* Set the priority of the running coroutine. Returns the old one. */
+MILL_EXPORT int mill_setprio(int prio);
+MILL_EXPORT int mill_getprio(void);
+MILL_EXPORT void mill_setspawnprio(int prio);
+
+/* Scheduling statistics. These are available only if the library was
+   configured with --enable-stats, otherwise the functions fail with
+   ENOTSUP. All times are in nanoseconds. */
+struct mill_crstats {
+    /* Time spent running, waiting in the ready queue and blocked. */
+    int64_t running;
+    int64_t ready;
+    int64_t blocked;
+    /* Number of times the coroutine was switched out. */
+    uint64_t switches;
+};
+
+/* Bucket N counts the intervals of [2^N, 2^(N+1)) ns. The last bucket
+   counts everything longer. */
+#define MILL_STATS_BUCKETS 32
+
+struct mill_schedstats {
+    uint64_t running[MILL_STATS_BUCKETS];
+    uint64_t ready[MILL_STATS_BUCKETS];
+    uint64_t blocked[MILL_STATS_BUCKETS];
+    uint64_t switches;
+};
+
+/* Statistics of the running coroutine. */
+MILL_EXPORT int mill_crstats(struct mill_crstats *stats);
+/* Histograms of all the coroutines of the calling thread. If 'reset' is
+   set, the histograms are cleared after being copied. */
+MILL_EXPORT int mill_schedstats(struct mill_schedstats *stats, int reset);
+
+/* Records the state transitions of the coroutines of the calling thread
+   into a ring buffer of 'size' records. The records can be dumped using
+   mill_trace_write() and converted to the Chrome trace format using
+   tools/trace2json. Available only if the library was configured with
+   --enable-trace, otherwise the functions fail with ENOTSUP. */
+MILL_EXPORT int mill_trace_start(size_t size);
+MILL_EXPORT void mill_trace_stop(void);
+MILL_EXPORT int mill_trace_write(int fd);
+
+/* Stack usage per spawn site, i.e. per go() statement. The stacks of new
+   coroutines are painted with a pattern and checked for how deep they went
+   once the coroutines exit. Coroutines launched on user-supplied stacks
+   are not included. Available only if the library was configured with
+   --enable-stackprof, otherwise the function fails with ENOTSUP. Such
+   a build also prints the results to stderr at exit. */
+struct mill_stackprof {
+    /* Return address of the go() statement. */
+    void *site;
+    /* Number of the coroutines that have exited. */
+    uint64_t count;
+    /* Usable size of the stack and the deepest and average use, in bytes. */
+    size_t stack_size;
+    size_t max_depth;
+    size_t avg_depth;
+};
+
+/* Fills in up to 'nsites' spawn sites. Returns the number of all the spawn
+   sites recorded, which may be larger than 'nsites'. */
+MILL_EXPORT int mill_stackprof(struct mill_stackprof *sites, int nsites);
+
 #define yield() mill_yield()
 
 MILL_EXPORT void mill_yield(void);
 
 MILL_EXPORT void mill_sleep(int64_t deadline);
+MILL_EXPORT void mill_sleep_us(int64_t deadline);
+
+/* External events are polled for once in a number of context switches.
+   The number adapts to the load; this limits it to [min, max] for the
+   calling thread. Setting min equal to max makes it fixed. */
+MILL_EXPORT int mill_setpollinterval(int min, int max);
+
+/* Lets the timers of the calling thread fire up to 'slack' microseconds
+   late, never early. The thread then wakes up at multiples of the slack
+   only, and fires all the timers due by then at once. Mostly idle threads
+   with many staggered deadlines wake up a lot less. 0 turns it off. */
+MILL_EXPORT int mill_settimerslack(int64_t slack);
 
 /******************************************************************************/
 /*  Channels                                                                  */
@@ -156,7 +440,12 @@ typedef struct mill_chan *chan;
 MILL_EXPORT void mill_panic(const char *text);
 
 #define MILL_CLAUSELEN (sizeof(struct{void *f1; void *f2; void *f3; void *f4; \
-    void *f5; void *f6; int f7; int f8; int f9;}))
+    void *f5; void *f6; int f7; int f8; int f9; int f10;}))
+
+/* Passed as 'bufsz' to chmake(), makes the buffer grow as needed, so that
+   sending never blocks. The memory is allocated in fixed-size segments,
+   which are given back as the buffer drains. */
+#define MILL_UNBOUNDED ((size_t)-1)
 
 #define chmake(type, bufsz) mill_chmake(sizeof(type), bufsz)
 
@@ -172,6 +461,32 @@ MILL_EXPORT void mill_panic(const char *text);
 #define chr(channel, type) \
     (*(type*)mill_chr((channel)))
 
+/* Receive a value into the variable pointed to by 'ptr'. Unlike chr(),
+   the value is copied straight from the sender, which pays off for
+   large values. */
+#define chrecv(channel, ptr) mill_chrecv((channel), (ptr))
+
+/* Send the value pointed to by 'ptr', or receive into it, waiting until
+   the deadline at most. Return 0 on success, or -1 and set errno to
+   ETIMEDOUT if the deadline expired, or to EPIPE when sending to
+   a done-with channel. */
+#define chsd(channel, ptr, deadline) mill_chsd((channel), (ptr), (deadline))
+#define chrd(channel, ptr, deadline) mill_chrd((channel), (ptr), (deadline))
+
+/* Batch operations on an array of 'n' values. They move as many values as
+   possible in one go, waking up all the peers involved, and return the
+   number of values moved. chs_many() blocks only if no value can be
+   sent, chr_many() only if no value is available and not beyond the
+   deadline. chtrysend() and chtryrecv() never block and return 0 instead.
+   On a done-with channel the receiving functions return the done-with
+   value once per call. On error -1 is returned and errno is set as
+   in chsd() and chrd(). */
+#define chs_many(channel, vals, n) mill_chs_many((channel), (vals), (n))
+#define chr_many(channel, vals, n, deadline) \
+    mill_chr_many((channel), (vals), (n), (deadline))
+#define chtrysend(channel, vals, n) mill_chtrysend((channel), (vals), (n))
+#define chtryrecv(channel, vals, n) mill_chtryrecv((channel), (vals), (n))
+
 #define chdone(channel, type, value) \
     do {\
         type val_ = (value);\
@@ -185,9 +500,72 @@ MILL_EXPORT chan mill_chmake(size_t sz, size_t bufsz);
 MILL_EXPORT chan mill_chdup(chan ch);
 MILL_EXPORT int mill_chs(chan ch, void *val);
 MILL_EXPORT void *mill_chr(chan ch);
+MILL_EXPORT void mill_chrecv(chan ch, void *val);
+MILL_EXPORT int mill_chsd(chan ch, void *val, int64_t deadline);
+MILL_EXPORT int mill_chrd(chan ch, void *val, int64_t deadline);
+MILL_EXPORT int mill_chs_many(chan ch, void *vals, int n);
+MILL_EXPORT int mill_chr_many(chan ch, void *vals, int n, int64_t deadline);
+MILL_EXPORT int mill_chtrysend(chan ch, void *vals, int n);
+MILL_EXPORT int mill_chtryrecv(chan ch, void *vals, int n);
 MILL_EXPORT int mill_chdone(chan ch, void *val);
 MILL_EXPORT int mill_chclose(chan ch);
 
+/* Lets an unbounded channel keep roughly 'limit' bytes of the buffered
+   values in memory at most. The values beyond that are written to a file
+   created at 'path', which is unlinked straight away, and read back in
+   order as the receivers catch up. The file is accessed by the worker
+   threads, so neither the senders nor the receivers ever wait for it.
+   Fails with EINVAL if the channel isn't unbounded or spills already.
+   If writing to the file fails, the channel keeps the rest of the values
+   in memory and stops spilling; if reading it back fails, the values still
+   in the file are lost. chspillerr() returns the errno of the first such
+   failure, 0 if there was none, or -1 with EINVAL if the channel doesn't
+   spill. */
+#define chspill(channel, path, limit) \
+    mill_chspill((channel), (path), (limit))
+#define chspillerr(channel) mill_chspillerr((channel))
+
+MILL_EXPORT int mill_chspill(chan ch, const char *path, size_t limit);
+MILL_EXPORT int mill_chspillerr(chan ch);
+
+/* Channel statistics. chname() registers the channel with the calling
+   thread under a copy of 'name' and starts collecting its statistics;
+   calling it again renames the channel. The channel leaves the registry
+   when it's deallocated. chlist() stores up to 'n' of the registered
+   channels into 'chs' and returns the number of all of them. chstats()
+   fails with ENOENT for channels not registered. If 'reset' is set, the
+   counters start anew after being copied. Values passed through the rings
+   of cross-thread channels aren't counted. */
+struct mill_chstats {
+    const char *name;
+    /* Number of values that got into and out of the channel. */
+    uint64_t sent;
+    uint64_t received;
+    /* Number of times a sending or receiving clause had to wait, and the
+       peak numbers of clauses waiting at the same time. */
+    uint64_t sendblocks;
+    uint64_t recvblocks;
+    int maxsenders;
+    int maxreceivers;
+    /* Numbers of the clauses and values waiting at the moment. */
+    int senders;
+    int receivers;
+    size_t items;
+    /* Time-weighted average number of values in the buffer over the last
+       'elapsed' ns. */
+    double occupancy;
+    int64_t elapsed;
+};
+
+#define chname(channel, name) mill_chname((channel), (name))
+#define chstats(channel, stats, reset) \
+    mill_chstats((channel), (stats), (reset))
+#define chlist(chs, n) mill_chlist((chs), (n))
+
+MILL_EXPORT int mill_chname(chan ch, const char *name);
+MILL_EXPORT int mill_chstats(chan ch, struct mill_chstats *stats, int reset);
+MILL_EXPORT int mill_chlist(chan *chs, int n);
+
 /* define MILL_CHOOSE before including libmill.h if using 'choose' */
 
 #ifdef MILL_CHOOSE
@@ -269,21 +647,154 @@ MILL_EXPORT int mill_chclose(chan ch);
 
 #define otherwise mill_otherwise(__COUNTER__)
 
+/* Fires when the file descriptor is ready for any of 'events', FDW_IN
+   and/or FDW_OUT. 'revents' is set to the events that fired, as returned
+   by mill_fdwait(). */
+#define mill_fdw(mfd, events, revents, idx) \
+                    break;\
+                }\
+                goto mill_concat(mill_label, idx);\
+            }\
+            char mill_concat(mill_clause, idx)[MILL_CLAUSELEN];\
+            mill_choose_fd(\
+                &mill_concat(mill_clause, idx)[0],\
+                (mfd),\
+                (events),\
+                idx);\
+            if(0) {\
+                int revents;\
+                mill_concat(mill_label, idx):\
+                if(mill_idx == idx) {\
+                    revents = *(int*)mill_choose_val(sizeof(int));\
+                    goto mill_concat(mill_dummylabel, idx);\
+                    mill_concat(mill_dummylabel, idx)
+
+#define fdw(mfd, events, revents) \
+    mill_fdw((mfd), (events), revents, __COUNTER__)
+
+/* Fires when the task started by task_submit() finishes. 'rc' is set to
+   its result as returned by task_join() and the task is released. */
+#define mill_taskdone(t, rc, idx) \
+                    break;\
+                }\
+                goto mill_concat(mill_label, idx);\
+            }\
+            char mill_concat(mill_clause, idx)[MILL_CLAUSELEN];\
+            mill_choose_task(\
+                &mill_concat(mill_clause, idx)[0],\
+                (t),\
+                idx);\
+            if(0) {\
+                int rc;\
+                mill_concat(mill_label, idx):\
+                if(mill_idx == idx) {\
+                    rc = mill_choose_taskres();\
+                    goto mill_concat(mill_dummylabel, idx);\
+                    mill_concat(mill_dummylabel, idx)
+
+#define taskdone(t, rc) mill_taskdone((t), rc, __COUNTER__)
+
 #define end \
                     break;\
                 }\
             }\
             mill_idx = mill_choose_wait();\
+            if(mill_idx == -2)\
+                mill_choose_init();\
         }
 #endif
 
+struct mill_fd_s;
+struct mill_task_s;
+
 MILL_EXPORT void mill_choose_init(void);
 MILL_EXPORT void mill_choose_in(void *clause, chan ch, int idx);
 MILL_EXPORT int mill_choose_out(void *clause, chan ch, void *val, int idx);
+MILL_EXPORT void mill_choose_fd(void *clause, struct mill_fd_s *mfd,
+    int events, int idx);
+MILL_EXPORT void mill_choose_task(void *clause, struct mill_task_s *t,
+    int idx);
 MILL_EXPORT int mill_choose_deadline(int64_t ddline);
 MILL_EXPORT int mill_choose_otherwise(void);
 MILL_EXPORT int mill_choose_wait(void);
 MILL_EXPORT void *mill_choose_val(size_t sz);
+MILL_EXPORT int mill_choose_taskres(void);
+
+/* Select set. Receives from whichever of the channels added to it has
+   a value available, like a choose statement with an in clause for each
+   of them, but the channels stay registered between the waits. This makes
+   waiting on hundreds of channels as cheap as on a few. chsetwait()
+   stores the value into 'val', which has to be big enough for the values
+   of any of the channels, and returns the 'idx' passed to chsetadd() for
+   the channel it came from. On timeout it returns -1 and sets errno to
+   ETIMEDOUT. A channel can be in one set at most and is removed from it
+   automatically when it is deallocated. Cross-thread channels are not
+   supported. */
+typedef struct mill_chset_s *chset;
+
+#define chsetmake() mill_chsetmake()
+#define chsetadd(set, channel, idx) mill_chsetadd((set), (channel), (idx))
+#define chsetrm(set, channel) mill_chsetrm((set), (channel))
+#define chsetwait(set, val, deadline) \
+    mill_chsetwait((set), (val), (deadline))
+#define chsetclose(set) mill_chsetclose((set))
+
+MILL_EXPORT chset mill_chsetmake(void);
+MILL_EXPORT int mill_chsetadd(chset s, chan ch, int idx);
+MILL_EXPORT int mill_chsetrm(chset s, chan ch);
+MILL_EXPORT int mill_chsetwait(chset s, void *val, int64_t deadline);
+MILL_EXPORT int mill_chsetclose(chset s);
+
+/* Broadcast channel. Every value sent is received by all the subscribers.
+   It's copied into a shared ring of 'bufsz' values, rounded up to a power
+   of two, once regardless of the number of subscribers, each of which
+   reads the ring at its own pace. A subscriber receives the values sent
+   after it subscribed. When a subscriber falls behind by the whole ring,
+   the MILL_BCAST_BLOCK policy makes the sender wait for it, while with
+   MILL_BCAST_DROP the oldest values are overwritten. bcrecv() returns
+   the number of values the subscriber missed since the previous call,
+   0 if none. Both bcsend() and bcrecv() return -1 and set errno to
+   ETIMEDOUT if the deadline expires, and to EPIPE once bcdone() was
+   called and, for bcrecv(), all the values were received. The channel
+   is deallocated when it's closed and all the subscribers are gone. */
+typedef struct mill_bcast_s *bcast;
+typedef struct mill_bsub_s *bsub;
+
+#define MILL_BCAST_BLOCK 0
+#define MILL_BCAST_DROP 1
+
+#define bcmake(type, bufsz, policy) \
+    mill_bcmake(sizeof(type), (bufsz), (policy))
+#define bcsubscribe(bc) mill_bcsubscribe((bc))
+#define bcunsubscribe(sub) mill_bcunsubscribe((sub))
+#define bcsend(bc, ptr, deadline) mill_bcsend((bc), (ptr), (deadline))
+#define bcrecv(sub, ptr, deadline) mill_bcrecv((sub), (ptr), (deadline))
+#define bcdone(bc) mill_bcdone((bc))
+#define bcclose(bc) mill_bcclose((bc))
+
+MILL_EXPORT bcast mill_bcmake(size_t sz, size_t bufsz, int policy);
+MILL_EXPORT bsub mill_bcsubscribe(bcast bc);
+MILL_EXPORT void mill_bcunsubscribe(bsub s);
+MILL_EXPORT int mill_bcsend(bcast bc, void *val, int64_t deadline);
+MILL_EXPORT int mill_bcrecv(bsub s, void *val, int64_t deadline);
+MILL_EXPORT int mill_bcdone(bcast bc);
+MILL_EXPORT int mill_bcclose(bcast bc);
+
+/* Channel which can be shared between threads. The values are passed
+   through a ring of 'bufsz' elements, rounded up to a power of two
+   and to two elements at least.
+   A thread uses the channel through an ordinary channel attached to it,
+   which works with chs(), chr(), choose and the rest, and is closed with
+   chclose(). The attached channels of one thread shouldn't be used from
+   other threads. */
+typedef struct mill_xchan_s *xchan;
+
+#define xchmake(type, bufsz) mill_xchmake(sizeof(type), bufsz)
+
+MILL_EXPORT xchan mill_xchmake(size_t sz, size_t bufsz);
+MILL_EXPORT xchan mill_xchdup(xchan xch);
+MILL_EXPORT void mill_xchclose(xchan xch);
+MILL_EXPORT chan mill_xchattach(xchan xch);
 
 typedef struct mill_pipe_s *mill_pipe;
 
@@ -329,10 +840,34 @@ MILL_EXPORT int task_run(mill_worker w,
 MILL_EXPORT int task_go(mill_worker w,
         taskfunc tf, void *data, int64_t deadline);
 
+/* Runs the function in a worker without waiting for it to finish. The task
+   is waited for either by task_join() or by the taskdone clause of choose,
+   which return the result of the function and release the task. If the
+   deadline expires, task_join() fails with ETIMEDOUT and the task can be
+   waited for again. At most one coroutine can wait for a task at a time. */
+typedef struct mill_task_s *mill_task;
+MILL_EXPORT mill_task task_submit(mill_worker w, taskfunc tf, void *data);
+MILL_EXPORT int task_join(mill_task t, int64_t deadline);
+
 MILL_EXPORT mill_worker mill_worker_create(void);
 MILL_EXPORT void mill_worker_delete(mill_worker w);
 MILL_EXPORT int mill_worker_await(mill_worker w, int64_t deadline);
 MILL_EXPORT int mill_isself(mill_worker w);
+
+/******************************************************************************/
+/*  Scheduler threads                                                         */
+/******************************************************************************/
+
+/* A group of threads, each running its own scheduler. Functions submitted
+   to the group are executed as coroutines in whichever thread gets to them
+   first; idle threads steal queued work from the busy ones. A coroutine
+   doesn't move to another thread once started. */
+typedef struct mill_sched_s *mill_sched;
+
+MILL_EXPORT mill_sched mill_sched_create(int nthreads, int stacksize);
+MILL_EXPORT void mill_sched_delete(mill_sched s);
+MILL_EXPORT int mill_sched_go(mill_sched s, taskfunc fn, void *data);
+MILL_EXPORT int mill_sched_run(mill_sched s, taskfunc fn, void *data);
 /******************************************************************************/
 /*  Mutex library                                                               */
 /******************************************************************************/
@@ -385,6 +920,8 @@ MILL_EXPORT int mill_write(mill_fd mfd, const void *buf, int count,
 
 MILL_EXPORT int mill_fdevent(int fd, int events, int64_t deadline);
 MILL_EXPORT int mill_fdwait(mill_fd mfd, int events, int64_t deadline);
+MILL_EXPORT int mill_fdevent_us(int fd, int events, int64_t deadline);
+MILL_EXPORT int mill_fdwait_us(mill_fd mfd, int events, int64_t deadline);
 MILL_EXPORT void mill_fdclean(mill_fd mfd);
 MILL_EXPORT void mill_fdclose(mill_fd mfd);
 
@@ -0,0 +1,86 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../libpill.h"
+
+/* Spawning lots of concurrently living coroutines and switching between
+   them, with and without a stack arena. */
+
+static coroutine void worker(chan start, int rounds) {
+    chr(start, int);
+    int i;
+    for(i = 0; i != rounds; ++i)
+        yield();
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        printf("usage: arena <thousands-of-coroutines> "
+            "none|guard|noguard|huge\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000;
+    int flags = -1;
+    if(strcmp(argv[2], "guard") == 0)
+        flags = 0;
+    else if(strcmp(argv[2], "noguard") == 0)
+        flags = MILL_ARENA_NOGUARD;
+    else if(strcmp(argv[2], "huge") == 0)
+        flags = MILL_ARENA_NOGUARD | MILL_ARENA_HUGEPAGE;
+
+    mill_init(16 * 1024, 0);
+    if(flags >= 0) {
+        int rc = mill_stackarena(count, flags);
+        assert(rc == 0);
+    }
+
+    int rounds = 10;
+    chan ch = chmake(int, 0);
+    int64_t start = now();
+    long i;
+    for(i = 0; i != count; ++i)
+        go(worker(ch, rounds));
+    int64_t spawned = now();
+    /* Each yield switches to the next coroutine, in a different stack. */
+    chdone(ch, int, 0);
+    mill_waitall(-1);
+    int64_t stop = now();
+    chclose(ch);
+
+    long spawn = (long)(spawned - start);
+    long run = (long)(stop - spawned);
+    printf("spawned %ldk coroutines in %ld ms (%ld ns each)\n",
+        count / 1000, spawn, spawn * 1000000 / count);
+    printf("%ld context switches in %ld ms (%ld ns each)\n",
+        count * rounds, run, run * 1000000 / (count * rounds));
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../libpill.h"
+
+/* Ticks fanned out to many subscribers, through a broadcast channel and
+   through one ordinary channel per subscriber. */
+
+struct tick {
+    int64_t time;
+    double bid;
+    double ask;
+    char symbol[16];
+};
+
+static long count;
+
+static coroutine void bcast_subscriber(bsub s) {
+    struct tick t;
+    while(bcrecv(s, &t, -1) >= 0)
+        ;
+    bcunsubscribe(s);
+}
+
+static coroutine void chan_subscriber(chan ch) {
+    while(1) {
+        struct tick t = chr(ch, struct tick);
+        if(t.time < 0)
+            break;
+    }
+    chclose(ch);
+}
+
+static void report(const char *name, int nsubs, int64_t start) {
+    int64_t duration = now() - start;
+    if(duration == 0)
+        duration = 1;
+    printf("%-6s %4d subscribers: %ld ns per tick\n", name, nsubs,
+        (long)(duration * 1000000 / count));
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        printf("usage: bcast <thousands-of-ticks> <subscribers>\n");
+        return 1;
+    }
+    count = atol(argv[1]) * 1000;
+    int nsubs = atoi(argv[2]);
+    mill_init(-1, 0);
+
+    struct tick t = {0, 1.0, 1.1, "XYZ"};
+    bcast bc = bcmake(struct tick, 64, MILL_BCAST_BLOCK);
+    int i;
+    for(i = 0; i != nsubs; ++i)
+        go(bcast_subscriber(bcsubscribe(bc)));
+    int64_t start = now();
+    long j;
+    for(j = 0; j != count; ++j) {
+        t.time = j;
+        int rc = bcsend(bc, &t, -1);
+        assert(rc == 0);
+    }
+    bcdone(bc);
+    report("bcast", nsubs, start);
+    bcclose(bc);
+
+    chan *chs = malloc(nsubs * sizeof(chan));
+    assert(chs);
+    for(i = 0; i != nsubs; ++i) {
+        chs[i] = chmake(struct tick, 64);
+        go(chan_subscriber(chdup(chs[i])));
+    }
+    start = now();
+    for(j = 0; j != count; ++j) {
+        t.time = j;
+        for(i = 0; i != nsubs; ++i)
+            chs(chs[i], struct tick, t);
+    }
+    t.time = -1;
+    for(i = 0; i != nsubs; ++i)
+        chdone(chs[i], struct tick, t);
+    report("chan", nsubs, start);
+    for(i = 0; i != nsubs; ++i)
+        chclose(chs[i]);
+    free(chs);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../libpill.h"
+
+/* Moves records between two pipeline stages, received either with chr()
+   or straight into the destination with chrecv(). */
+
+struct record {
+    char data[4096];
+};
+
+static coroutine void producer(chan ch, long count) {
+    struct record r;
+    memset(&r, 'x', sizeof(r));
+    long i;
+    for(i = 0; i != count; ++i) {
+        int rc = mill_chs(ch, &r);
+        assert(rc == 0);
+    }
+}
+
+static void report(const char *name, long count, int64_t start) {
+    int64_t duration = now() - start;
+    printf("%-6s %ld ns per %zu-byte record\n", name,
+        (long)(duration * 1000000 / count), sizeof(struct record));
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: bigval <thousands-of-records>\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000;
+
+    mill_init(-1, 0);
+    static struct record dst;
+    chan ch = chmake(struct record, 0);
+
+    go(producer(ch, count));
+    int64_t start = now();
+    long i;
+    for(i = 0; i != count; ++i)
+        dst = chr(ch, struct record);
+    report("chr", count, start);
+
+    go(producer(ch, count));
+    start = now();
+    for(i = 0; i != count; ++i)
+        chrecv(ch, &dst);
+    report("chrecv", count, start);
+
+    chclose(ch);
+    mill_fini();
+    return 0;
+}
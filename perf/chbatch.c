@@ -0,0 +1,78 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../libpill.h"
+
+/* Small records passed through a buffered channel between two pipeline
+   stages, one by one and in batches. */
+
+#define BATCH 64
+
+static coroutine void producer(chan ch, long count, int batch) {
+    int vals[BATCH] = {0};
+    long i = 0;
+    while(i != count) {
+        int n = count - i < batch ? (int)(count - i) : batch;
+        int rc = chs_many(ch, vals, n);
+        assert(rc > 0);
+        i += rc;
+    }
+}
+
+static void run(long count, int batch) {
+    chan ch = chmake(int, 1024);
+    int vals[BATCH];
+    int64_t start = now();
+    go(producer(ch, count, batch));
+    long i = 0;
+    while(i != count) {
+        int rc = chr_many(ch, vals, batch, -1);
+        assert(rc > 0);
+        i += rc;
+    }
+    int64_t duration = now() - start;
+    printf("batch %2d: %ld ns per record\n", batch,
+        (long)(duration * 1000000 / count));
+    chclose(ch);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: chbatch <millions-of-records>\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000000;
+
+    mill_init(-1, 0);
+    run(count, 1);
+    run(count, 8);
+    run(count, BATCH);
+    mill_fini();
+    return 0;
+}
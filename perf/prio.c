@@ -0,0 +1,124 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../libpill.h"
+
+/* Scheduling latency of a latency-critical coroutine while the thread is
+   saturated by CPU-bound coroutines, with and without priorities. */
+
+static volatile long spin;
+static volatile int stop;
+
+static int64_t nowns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void burn(void) {
+    int i;
+    for(i = 0; i != 200; ++i)
+        spin++;
+}
+
+static coroutine void bulk(void) {
+    while(!stop) {
+        burn();
+        yield();
+    }
+}
+
+/* Timestamps the messages just before handing them over. */
+static coroutine void producer(chan ch, long count) {
+    long i;
+    for(i = 0; i != count; ++i) {
+        int j;
+        for(j = 0; j != 10; ++j) {
+            burn();
+            yield();
+        }
+        chs(ch, int64_t, nowns());
+    }
+}
+
+static coroutine void consumer(chan ch, chan done, long count,
+      int64_t *lat) {
+    long i;
+    for(i = 0; i != count; ++i) {
+        int64_t sent = chr(ch, int64_t);
+        lat[i] = nowns() - sent;
+    }
+    chs(done, int, 0);
+}
+
+static int cmp(const void *a, const void *b) {
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(long nbulk, long count, int prio) {
+    int64_t *lat = malloc(count * sizeof(int64_t));
+    assert(lat);
+    chan ch = chmake(int64_t, 0);
+    chan done = chmake(int, 0);
+    stop = 0;
+    long i;
+    for(i = 0; i != nbulk; ++i)
+        goprio(bulk(), MILL_PRIO_NORMAL);
+    goprio(consumer(ch, done, count, lat), prio);
+    goprio(producer(ch, count), MILL_PRIO_NORMAL);
+    chr(done, int);
+    stop = 1;
+    mill_waitall(-1);
+    chclose(done);
+    chclose(ch);
+
+    qsort(lat, count, sizeof(int64_t), cmp);
+    printf("%-6s  p50: %8ld us  p99: %8ld us  max: %8ld us\n",
+        prio == MILL_PRIO_HIGH ? "high" : "normal",
+        (long)(lat[count / 2] / 1000), (long)(lat[count * 99 / 100] / 1000),
+        (long)(lat[count - 1] / 1000));
+    free(lat);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        printf("usage: prio <number-of-bulk-coroutines> <number-of-samples>\n");
+        return 1;
+    }
+    long nbulk = atol(argv[1]);
+    long count = atol(argv[2]);
+
+    mill_init(-1, 0);
+    run(nbulk, count, MILL_PRIO_NORMAL);
+    run(nbulk, count, MILL_PRIO_HIGH);
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,100 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "../libpill.h"
+
+/* Coroutines per second and cross-thread round-trip latency as a function
+   of the number of scheduler threads. */
+
+static volatile long spin;
+
+static int worker(void *arg) {
+    long i, n = (long) arg;
+    /* A bit of CPU work interleaved with context switches. */
+    for(i = 0; i != n; ++i) {
+        spin++;
+        if(i % 64 == 0)
+            yield();
+    }
+    return 0;
+}
+
+static int noop(void *arg) {
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2 || argc > 3) {
+        printf("usage: sched <thousands-of-coroutines> [max-threads]\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000;
+    int maxthreads = argc == 3 ? atoi(argv[2]) : 0;
+    if(maxthreads <= 0)
+        maxthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    mill_init(-1, 0);
+
+    int nthreads;
+    for(nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+        mill_sched s = mill_sched_create(nthreads, -1);
+        assert(s);
+
+        /* Spawn rate. mill_sched_delete() waits for all of them to finish. */
+        int64_t start = now();
+        long i;
+        for(i = 0; i != count; ++i) {
+            int rc = mill_sched_go(s, worker, (void*) 1000);
+            assert(rc == 0);
+        }
+
+        /* Round-trip to a scheduler thread and back while it is busy. */
+        long rounds = 10000;
+        int64_t pstart = now();
+        for(i = 0; i != rounds; ++i) {
+            int rc = mill_sched_run(s, noop, NULL);
+            assert(rc == 0);
+        }
+        int64_t pstop = now();
+
+        mill_sched_delete(s);
+        int64_t stop = now();
+        long duration = (long)(stop - start);
+        if(duration == 0)
+            duration = 1;
+        printf("threads: %2d  coroutines per second: %8.3fM  "
+            "round-trip: %ld ns\n", nthreads,
+            ((float) count / duration) / 1000,
+            (long)((pstop - pstart) * 1000000 / rounds));
+    }
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libpill.h"
+
+/* Resident memory before, during and after a spike of coroutines, e.g.
+   a burst of connections each served by its own coroutine. */
+
+static long rss_kb(void) {
+    long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f)
+        return -1;
+    int rc = fscanf(f, "%ld %ld", &size, &resident);
+    fclose(f);
+    if(rc != 2)
+        return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static coroutine void conn(chan start, chan done) {
+    /* Use some of the stack, as a real connection handler would. */
+    volatile char buf[16 * 1024];
+    memset((char*)buf, 'x', sizeof(buf));
+    chr(start, int);
+    chs(done, int, buf[0]);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: spike <number-of-coroutines>\n");
+        return 1;
+    }
+    long count = atol(argv[1]);
+
+    mill_init(-1, 0);
+    printf("baseline: %ld kB\n", rss_kb());
+
+    chan start = chmake(int, 0);
+    chan done = chmake(int, count);
+    int64_t t0 = now();
+    long i;
+    for(i = 0; i != count; ++i)
+        go(conn(start, done));
+    printf("spike:    %ld kB\n", rss_kb());
+    chdone(start, int, 0);
+    for(i = 0; i != count; ++i)
+        chr(done, int);
+    mill_waitall(-1);
+    int64_t t1 = now();
+    printf("after:    %ld kB (%ld ms)\n", rss_kb(), (long)(t1 - t0));
+
+    /* A second, smaller burst reuses the cached stacks. */
+    for(i = 0; i != count / 10; ++i)
+        go(conn(start, done));
+    for(i = 0; i != count / 10; ++i)
+        chr(done, int);
+    mill_waitall(-1);
+    printf("rebound:  %ld kB\n", rss_kb());
+
+    chclose(done);
+    chclose(start);
+    mill_fini();
+    return 0;
+}
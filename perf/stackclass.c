@@ -0,0 +1,79 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libpill.h"
+
+/* Memory per blocked coroutine for each stack size class, e.g. a socket
+   pump parked in fdwait(). */
+
+static void mem_kb(long *vsz, long *rss) {
+    long size, resident;
+    FILE *f = fopen("/proc/self/statm", "r");
+    assert(f);
+    int rc = fscanf(f, "%ld %ld", &size, &resident);
+    assert(rc == 2);
+    fclose(f);
+    *vsz = size * (sysconf(_SC_PAGESIZE) / 1024);
+    *rss = resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static coroutine void pump(chan start) {
+    volatile char buf[2 * 1024];
+    memset((char*)buf, 'x', sizeof(buf));
+    chr(start, int);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: stackclass <number-of-coroutines>\n");
+        return 1;
+    }
+    long count = atol(argv[1]);
+    static const char *names[] = {"default", "8K", "16K", "64K", "256K"};
+
+    mill_init(-1, 0);
+    int cls;
+    for(cls = MILL_STACK_DEFAULT; cls <= MILL_STACK_256K; ++cls) {
+        chan start = chmake(int, 0);
+        long vsz0, rss0, vsz1, rss1;
+        mem_kb(&vsz0, &rss0);
+        long i;
+        for(i = 0; i != count; ++i)
+            gostack(pump(start), cls);
+        mem_kb(&vsz1, &rss1);
+        printf("%-8s VSZ %6.1f kB  RSS %5.1f kB per coroutine\n", names[cls],
+            (double)(vsz1 - vsz0) / count, (double)(rss1 - rss0) / count);
+        chdone(start, int, 0);
+        mill_waitall(-1);
+        chclose(start);
+    }
+    mill_fini();
+    return 0;
+}
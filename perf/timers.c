@@ -0,0 +1,121 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../libpill.h"
+#include "../timer.h"
+
+/* Drives the timers of the calling thread directly, so it has to be
+   linked with the static library, the timer functions aren't exported. */
+
+static long fired = 0;
+
+static void callback(struct mill_timer *timer) {
+    ++fired;
+}
+
+static int64_t deadline(int64_t base) {
+    return base + 1000 + random() % 60000;
+}
+
+static void report(const char *name, int64_t start, long count) {
+    int64_t duration = now() - start;
+    printf("%-8s %ld ns per operation\n", name,
+        (long)(duration * 1000000 / count));
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3 || (strcmp(argv[1], "heap") && strcmp(argv[1], "wheel"))) {
+        printf("usage: timers heap|wheel <thousands-of-timers>\n");
+        return 1;
+    }
+    long count = atol(argv[2]) * 1000;
+    mill_settimers(strcmp(argv[1], "wheel") ? MILL_TIMERS_HEAP :
+        MILL_TIMERS_WHEEL);
+    mill_init(-1, 0);
+    struct mill_timer *timers = calloc(count, sizeof(struct mill_timer));
+    int64_t base = now();
+    long i;
+
+    /* Arm all the timers. */
+    int64_t start = now();
+    for(i = 0; i != count; ++i)
+        mill_timer_add(&timers[i], deadline(base), callback);
+    report("arm", start, count);
+
+    /* Push each deadline further, the way a per-message deadline does. */
+    start = now();
+    for(i = 0; i != count; ++i) {
+        mill_timer_rm(&timers[i]);
+        mill_timer_add(&timers[i], deadline(base + 1000), callback);
+    }
+    report("re-arm", start, count);
+
+    /* Random mix of arming, re-arming and cancelling. */
+    start = now();
+    for(i = 0; i != count; ++i) {
+        struct mill_timer *tm = &timers[random() % count];
+        if(!mill_timer_enabled(tm)) {
+            mill_timer_add(tm, deadline(base), callback);
+        }
+        else if(random() % 2) {
+            mill_timer_rm(tm);
+            mill_timer_add(tm, deadline(base + 1000), callback);
+        }
+        else {
+            mill_timer_rm(tm);
+            mill_timer_cancel(tm);
+        }
+    }
+    report("churn", start, count);
+
+    /* Cancel all of them. */
+    start = now();
+    for(i = 0; i != count; ++i) {
+        mill_timer_rm(&timers[i]);
+        mill_timer_cancel(&timers[i]);
+    }
+    report("cancel", start, count);
+
+    /* Expire all of them. */
+    base = now();
+    for(i = 0; i != count; ++i)
+        mill_timer_add(&timers[i], base - 1 - random() % 1000, callback);
+    start = now();
+    mill_clock_refresh();
+    mill_timer_fire();
+    report("fire", start, count);
+    if(fired != count) {
+        printf("%ld timers out of %ld fired\n", fired, count);
+        return 1;
+    }
+
+    free(timers);
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../libpill.h"
+
+/* Messages sent from another thread, through a cross-thread channel and
+   through mill_pipe. */
+
+static long count;
+
+static void *xchan_producer(void *arg) {
+    mill_init(-1, 0);
+    chan ch = mill_xchattach(arg);
+    long i;
+    for(i = 0; i != count; ++i)
+        chs(ch, int, 0);
+    chclose(ch);
+    mill_fini();
+    return NULL;
+}
+
+static void *pipe_producer(void *arg) {
+    mill_init(-1, 0);
+    mill_pipe mp = arg;
+    int val = 0;
+    long i;
+    for(i = 0; i != count; ++i) {
+        int rc = mill_pipesend(mp, &val);
+        assert(rc != -1);
+    }
+    mill_fini();
+    return NULL;
+}
+
+static void report(const char *name, int64_t start) {
+    int64_t duration = now() - start;
+    if(duration == 0)
+        duration = 1;
+    printf("%-6s %ld messages per second\n", name,
+        (long)(count * 1000 / duration));
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: xchan <thousands-of-messages>\n");
+        return 1;
+    }
+    count = atol(argv[1]) * 1000;
+    mill_init(-1, 0);
+
+    xchan xch = xchmake(int, 1024);
+    chan ch = mill_xchattach(xch);
+    pthread_t th;
+    int64_t start = now();
+    int rc = pthread_create(&th, NULL, xchan_producer, xch);
+    assert(rc == 0);
+    long i;
+    for(i = 0; i != count; ++i)
+        chr(ch, int);
+    report("xchan", start);
+    pthread_join(th, NULL);
+    chclose(ch);
+    mill_xchclose(xch);
+
+    mill_pipe mp = mill_pipemake(sizeof(int));
+    start = now();
+    rc = pthread_create(&th, NULL, pipe_producer, mp);
+    assert(rc == 0);
+    for(i = 0; i != count; ++i) {
+        int done;
+        mill_piperecv(mp, &done);
+        assert(!done);
+    }
+    report("pipe", start);
+    pthread_join(th, NULL);
+    mill_pipefree(mp);
+
+    mill_fini();
+    return 0;
+}
@@ -22,6 +22,11 @@
 
 */
 
+#if defined HAVE_PPOLL && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
 #include <stdint.h>
 #include <sys/param.h>
 
@@ -36,11 +41,36 @@
 static int mill_poller_add(struct mill_fd_s *mfd, int events);
 static void mill_poller_rm(struct mill_cr *cr);
 static void mill_poller_clean(struct mill_fd_s *mfd);
-static int mill_poller_wait(int timeout);
+static int mill_poller_wait(int64_t timeout);
+
+/* The poller waits for 'timeout' microseconds at most, -1 meaning forever.
+   Where the system call takes milliseconds, the timeout is rounded up so
+   that the wait doesn't end before the deadline. */
+static inline int mill_poller_ms(int64_t timeout) {
+    if(timeout <= 0)
+        return (int)timeout;
+    if(timeout >= (int64_t)INT_MAX * 1000)
+        return INT_MAX;
+    return (int)((timeout + 999) / 1000);
+}
+
+/* Resumes the coroutine waiting for the file descriptor. The caller
+   unregisters it from 'mfd'. */
+static void mill_poller_resume(struct mill_cr *cr, struct mill_fd_s *mfd,
+      int events) {
+    if(cr->state == MILL_CHOOSE)
+        mill_choose_fdready(cr, mfd, events);
+    else
+        mill_resume(cr, events);
+}
 
 /* Pause current coroutine for a specified time interval. */
 void mill_sleep(int64_t deadline) {
-    mill_fdwait(NULL, 0, deadline);
+    mill_fdwait_us(NULL, 0, mill_mstous(deadline));
+}
+
+void mill_sleep_us(int64_t deadline) {
+    mill_fdwait_us(NULL, 0, deadline);
 }
 
 static void mill_poller_callback(struct mill_timer *timer) {
@@ -51,11 +81,16 @@ static void mill_poller_callback(struct mill_timer *timer) {
 }
 
 int mill_fdwait(struct mill_fd_s *mfd, int events, int64_t deadline) {
+    return mill_fdwait_us(mfd, events, mill_mstous(deadline));
+}
+
+int mill_fdwait_us(struct mill_fd_s *mfd, int events, int64_t deadline) {
     mill_assert(mill != NULL);
     /* If required, start waiting for the timeout. */
     struct mill_cr *mill_running = mill->running;
     if(deadline >= 0)
-        mill_timer_add(&mill_running->timer, deadline, mill_poller_callback);
+        mill_timer_add_us(&mill_running->timer, deadline,
+            mill_poller_callback);
     /* If required, start waiting for the file descriptor. */
     if(mfd) {
         int rc = mill_poller_add(mfd, events);
@@ -74,6 +109,8 @@ int mill_fdwait(struct mill_fd_s *mfd, int events, int64_t deadline) {
     }
 
     /* Do actual waiting. */
+    mill_trace(mill_trace_id(mill_running), MILL_TRACE_FDWAIT,
+        mfd ? mfd->fd : 0xffffff);
     mill_running->state = mfd == NULL ? MILL_MSLEEP : MILL_FDWAIT;
     mill_running->mfd = mfd;
 #ifdef MILLDEBUG
@@ -82,28 +119,73 @@ int mill_fdwait(struct mill_fd_s *mfd, int events, int64_t deadline) {
     return mill_suspend();
 }
 
+int mill_fdregister(struct mill_fd_s *mfd, int events) {
+    return mill_poller_add(mfd, events);
+}
+
+void mill_fdunregister(struct mill_fd_s *mfd, struct mill_cr *cr) {
+    cr->mfd = mfd;
+    mill_poller_rm(cr);
+    cr->mfd = NULL;
+}
+
 void mill_fdclean(struct mill_fd_s *mfd) {
     if(mill_fast(mill))
         mill_poller_clean(mfd);
 }
 
-void mill_wait(int block) {
+int mill_wait(int block) {
+    /* The clock is read once per iteration of the scheduler rather than
+       by each timer operation. */
+    mill_clock_refresh();
     while(1) {
         /* Compute timeout for the subsequent poll. */
-        int timeout = block ? mill_timer_next() : 0;
+        int64_t timeout = block ? mill_timer_next() : 0;
         /* Wait for events. */
         int fd_fired = mill_poller_wait(timeout);
+        /* Unless the poll returned straight away, the time moved on. */
+        if(timeout != 0)
+            mill_clock_refresh();
         /* Fire all expired timers. */
         int timer_fired = mill_timer_fire();
-        /* Never retry the poll in non-blocking mode. */
-        if(!block || fd_fired || timer_fired)
-            break;
+        /* Never retry the poll in non-blocking mode. Adjust the number of
+           context switches till the next one instead: back off while there
+           is nothing to do and poll more often under the load. */
+        if(!block) {
+            if(fd_fired == 0) {
+                mill->poll_budget *= 2;
+                if(mill->poll_budget > mill->poll_budget_max)
+                    mill->poll_budget = mill->poll_budget_max;
+            }
+            else if(fd_fired >= MILL_POLL_BATCH) {
+                mill->poll_budget /= 2;
+                if(mill->poll_budget < mill->poll_budget_min)
+                    mill->poll_budget = mill->poll_budget_min;
+            }
+            return fd_fired;
+        }
+        if(fd_fired || timer_fired)
+            return fd_fired;
         /* If timeout was hit but there were no expired timers do the poll
            again. This should not happen in theory but let's be ready for the
            case when the system timers are not precise. */
     }
 }
 
+int mill_setpollinterval(int min, int max) {
+    if(min < 1 || max < min) {
+        errno = EINVAL;
+        return -1;
+    }
+    mill->poll_budget_min = min;
+    mill->poll_budget_max = max;
+    if(mill->poll_budget < min)
+        mill->poll_budget = min;
+    if(mill->poll_budget > max)
+        mill->poll_budget = max;
+    return 0;
+}
+
 /* Include the poll-mechanism-specific stuff. */
 #if 0
         /* FIXME -- kqueue.inc */
@@ -31,10 +31,29 @@ void mill_poller_fini(void);
 /* poller.c also implements mill_wait() and mill_fdwait() declared
    in libmill.h. */
 
+struct mill_cr;
+struct mill_fd_s;
+
+/* Register the running coroutine, or unregister the given one, as waiting
+   for the file descriptor outside of fdwait(), i.e. in choose. */
+int mill_fdregister(struct mill_fd_s *mfd, int events);
+void mill_fdunregister(struct mill_fd_s *mfd, struct mill_cr *cr);
+
 /* Wait till at least one coroutine is resumed. If block is set to 0 the
    function will poll for events and return immediately. If it is set to 1
-   it will block until there's at least one event to process. */
-void mill_wait(int block);
+   it will block until there's at least one event to process. Returns
+   the number of file descriptor events. */
+int mill_wait(int block);
+
+/* Number of context switches between non-blocking polls. The budget is
+   doubled each time such a poll comes back empty and halved each time
+   it returns a full batch of events. */
+#define MILL_POLL_BUDGET 128
+#define MILL_POLL_BUDGET_MIN 16
+#define MILL_POLL_BUDGET_MAX 2048
+
+/* Maximum number of events returned by a single poll. */
+#define MILL_POLL_BATCH 128
 
 #endif
 
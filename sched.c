@@ -0,0 +1,390 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "libpill.h"
+#include "cr.h"
+#include "utils.h"
+
+/*
+ * Scheduler threads (M:N mode).
+ *
+ * Each scheduler thread runs its own mill and owns a local queue of work
+ * items submitted with mill_sched_go()/mill_sched_run(). A thread that runs
+ * out of local work steals half of the queue of another thread before
+ * parking its main coroutine. Every work item is executed in a coroutine of
+ * its own in the thread which dequeued it.
+ *
+ * Coroutines do not migrate once started: channels, timers and file
+ * descriptors belong to the thread that created them. Load is balanced at
+ * spawn time instead, which is where the accept-and-serve pattern creates
+ * it anyway.
+ */
+
+struct mill_work_s {
+    taskfunc fn;
+    void *data;
+    /* Coroutine waiting for the result (mill_sched_run), NULL otherwise. */
+    struct mill_cr *waiter;
+    int result;
+    int errcode;
+};
+
+struct mill_sthread_s {
+    pthread_t pth;
+    struct mill_sched_s *s;
+    int stacksize;
+
+    /* Local run queue; a growable ring buffer protected by a spinlock. */
+    int lock;
+    unsigned head;
+    unsigned tail;
+    unsigned cap;   /* power of 2 */
+    struct mill_work_s **q;
+
+    /* 1 if the main coroutine is parked waiting for work. */
+    volatile int parked;
+    /* The main coroutine of the thread. */
+    struct mill_cr *main;
+
+    int sfd;    /* thread initialization status written to this fd */
+};
+
+struct mill_sched_s {
+    int nthreads;
+    /* Number of threads actually started. */
+    int nstarted;
+    struct mill_sthread_s *threads;
+    /* Number of threads with the main coroutine parked. */
+    volatile int nparked;
+    volatile int stopping;
+    /* Round-robin counter for the submissions from outside threads. */
+    unsigned next;
+};
+
+/* Scheduler thread the calling thread is running, if any. */
+static __thread struct mill_sthread_s *mill_sthread = NULL;
+
+#define MILL_SCHED_QSIZE 256
+
+static void mill_sched_lock(struct mill_sthread_s *t) {
+    while(!mill_atomic_set(&t->lock, 0, 1))
+        sched_yield();
+}
+
+static void mill_sched_unlock(struct mill_sthread_s *t) {
+    int ret = mill_atomic_set(&t->lock, 1, 0);
+    mill_assert(ret);
+}
+
+static int mill_sched_push(struct mill_sthread_s *t, struct mill_work_s *w) {
+    mill_sched_lock(t);
+    if(t->tail - t->head == t->cap) {
+        /* Grow the ring buffer, keeping the order of items. */
+        unsigned i, n = t->tail - t->head;
+        struct mill_work_s **q = mill_malloc(2 * t->cap * sizeof(*q));
+        if(!q) {
+            mill_sched_unlock(t);
+            errno = ENOMEM;
+            return -1;
+        }
+        for(i = 0; i != n; ++i)
+            q[i] = t->q[(t->head + i) & (t->cap - 1)];
+        mill_free(t->q);
+        t->q = q;
+        t->cap *= 2;
+        t->head = 0;
+        t->tail = n;
+    }
+    t->q[t->tail++ & (t->cap - 1)] = w;
+    mill_sched_unlock(t);
+    return 0;
+}
+
+static struct mill_work_s *mill_sched_pop(struct mill_sthread_s *t) {
+    struct mill_work_s *w = NULL;
+    if(t->tail == t->head)
+        return NULL;
+    mill_sched_lock(t);
+    if(t->tail != t->head)
+        w = t->q[t->head++ & (t->cap - 1)];
+    mill_sched_unlock(t);
+    return w;
+}
+
+/* Move half of the victim's queue to the local queue of 't' and return one
+   of the stolen items. Victims are tried in order, starting at a random
+   one. All the queues exist before the first thread starts, so it's safe
+   to look at the threads which are not running yet. */
+static struct mill_work_s *mill_sched_steal(struct mill_sthread_s *t) {
+    struct mill_sched_s *s = t->s;
+    int i, start = (int)(mill_xorshift(&mill->rand_state) % s->nthreads);
+    for(i = 0; i != s->nthreads; ++i) {
+        struct mill_sthread_s *v = &s->threads[(start + i) % s->nthreads];
+        if(v == t || v->tail == v->head)
+            continue;
+        if(!mill_atomic_set(&v->lock, 0, 1))
+            continue;
+        unsigned n = v->tail - v->head;
+        if(!n) {
+            mill_sched_unlock(v);
+            continue;
+        }
+        n = (n + 1) / 2;
+        struct mill_work_s *w = v->q[v->head++ & (v->cap - 1)];
+        struct mill_work_s *stolen[MILL_SCHED_QSIZE];
+        unsigned k = 0;
+        while(--n && k < MILL_SCHED_QSIZE)
+            stolen[k++] = v->q[v->head++ & (v->cap - 1)];
+        mill_sched_unlock(v);
+        unsigned j;
+        for(j = 0; j != k; ++j) {
+            if(mill_sched_push(t, stolen[j]) == -1)
+                mill_panic("not enough memory to queue the stolen work");
+        }
+        return w;
+    }
+    return NULL;
+}
+
+/* Resume the parked main coroutine of the scheduler thread, if it is
+   parked. Returns 1 if the thread was woken up. */
+static int mill_sched_wake(struct mill_sthread_s *t) {
+    if(!t->parked || !mill_atomic_set(&t->parked, 1, 0))
+        return 0;
+    mill_atomic_sub(&t->s->nparked, 1);
+    mill_resume(t->main, 0);
+    return 1;
+}
+
+/* Wake up some parked thread so that it can steal the work just queued. */
+static void mill_sched_kick(struct mill_sched_s *s) {
+    int i;
+    if(!s->nparked)
+        return;
+    for(i = 0; i != s->nstarted; ++i) {
+        if(mill_sched_wake(&s->threads[i]))
+            return;
+    }
+}
+
+static coroutine void mill_sched_exec(struct mill_work_s *w) {
+    int rc = w->fn(w->data);
+    if(w->waiter) {
+        w->result = rc;
+        w->errcode = rc == -1 ? errno : 0;
+        mill_resume(w->waiter, 1);
+    }
+    else
+        mill_free(w);
+}
+
+/* Park the main coroutine until there's more work to do. */
+static void mill_sched_park(struct mill_sthread_s *t) {
+    struct mill_sched_s *s = t->s;
+    t->parked = 1;
+    mill_atomic_add(&s->nparked, 1);
+    /* Re-check for the work queued while we were parking. */
+    if(t->tail != t->head || s->stopping) {
+        if(mill_atomic_set(&t->parked, 1, 0)) {
+            mill_atomic_sub(&s->nparked, 1);
+            return;
+        }
+        /* Someone has already woken us up. Consume the wakeup. */
+    }
+    mill_suspend();
+}
+
+static void *mill_sched_func(void *p) {
+    struct mill_sthread_s *t = p;
+    struct mill_sched_s *s = t->s;
+    mill_t *millptr = mill_init__p(t->stacksize);
+    int status = millptr && mill_inbox_open() == 0;
+    int rc = (int) write(t->sfd, &status, sizeof(status));
+    mill_assert(rc == sizeof(status));
+    if(mill_slow(status == 0)) {
+        if(millptr)
+            mill_fini();
+        return NULL;
+    }
+    mill_sthread = t;
+    t->main = mill->running;
+
+    while(1) {
+        struct mill_work_s *w = mill_sched_pop(t);
+        if(!w)
+            w = mill_sched_steal(t);
+        if(w) {
+            /* Let the others steal from what's left in our queue. */
+            if(t->tail != t->head)
+                mill_sched_kick(s);
+            go(mill_sched_exec(w));
+            continue;
+        }
+        if(s->stopping)
+            break;
+        mill_sched_park(t);
+    }
+    mill_sthread = NULL;
+    mill_fini();
+    return NULL;
+}
+
+struct mill_sched_s *mill_sched_create(int nthreads, int stacksize) {
+    mill_assert(mill);
+    if(nthreads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? (int) n : 1;
+    }
+    struct mill_sched_s *s = mill_malloc(sizeof(struct mill_sched_s));
+    if(!s) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(s, '\0', sizeof(struct mill_sched_s));
+    s->threads = mill_malloc(nthreads * sizeof(struct mill_sthread_s));
+    if(!s->threads) {
+        mill_free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(s->threads, '\0', nthreads * sizeof(struct mill_sthread_s));
+    s->nthreads = nthreads;
+    int i;
+    for(i = 0; i != nthreads; ++i) {
+        struct mill_sthread_s *t = &s->threads[i];
+        t->s = s;
+        t->stacksize = stacksize;
+        t->cap = MILL_SCHED_QSIZE;
+        t->q = mill_malloc(t->cap * sizeof(struct mill_work_s *));
+        if(!t->q)
+            goto er;
+    }
+    /* Queues must be in place before any thread starts stealing. */
+    for(i = 0; i != nthreads; ++i) {
+        struct mill_sthread_s *t = &s->threads[i];
+        int fd[2];
+        if(-1 == pipe(fd))
+            goto er;
+        t->sfd = fd[1];
+        int rc = pthread_create(&t->pth, NULL, mill_sched_func, t);
+        if(rc != 0) {
+            close(fd[0]);
+            close(fd[1]);
+            errno = rc;
+            goto er;
+        }
+        int status = 0;
+        rc = (int) read(fd[0], &status, sizeof(status));
+        close(fd[0]);
+        close(fd[1]);
+        if(rc != sizeof(status) || status <= 0) {
+            (void) pthread_join(t->pth, NULL);
+            errno = EAGAIN;
+            goto er;
+        }
+        s->nstarted++;
+    }
+    return s;
+er:
+    {
+        int err = errno;
+        mill_sched_delete(s);
+        errno = err;
+    }
+    return NULL;
+}
+
+void mill_sched_delete(struct mill_sched_s *s) {
+    int i;
+    mill_assert(!mill_sthread);
+    s->stopping = 1;
+    __sync_synchronize();
+    /* Threads finish the queued work before they exit. */
+    for(i = 0; i != s->nstarted; ++i)
+        mill_sched_wake(&s->threads[i]);
+    for(i = 0; i != s->nstarted; ++i) {
+        int rc = pthread_join(s->threads[i].pth, NULL);
+        mill_assert(rc == 0);
+    }
+    for(i = 0; i != s->nthreads; ++i) {
+        if(s->threads[i].q)
+            mill_free(s->threads[i].q);
+    }
+    mill_free(s->threads);
+    mill_free(s);
+}
+
+static int mill_sched_submit(struct mill_sched_s *s, struct mill_work_s *w) {
+    struct mill_sthread_s *t = mill_sthread;
+    if(!t || t->s != s) {
+        unsigned n = __sync_fetch_and_add(&s->next, 1);
+        t = &s->threads[n % s->nstarted];
+    }
+    if(mill_sched_push(t, w) == -1)
+        return -1;
+    if(!mill_sched_wake(t))
+        mill_sched_kick(s);
+    return 0;
+}
+
+int mill_sched_go(struct mill_sched_s *s, taskfunc fn, void *data) {
+    mill_assert(!s->stopping);
+    struct mill_work_s *w = mill_malloc(sizeof(struct mill_work_s));
+    if(!w) {
+        errno = ENOMEM;
+        return -1;
+    }
+    w->fn = fn;
+    w->data = data;
+    w->waiter = NULL;
+    if(mill_sched_submit(s, w) == -1) {
+        mill_free(w);
+        return -1;
+    }
+    return 0;
+}
+
+int mill_sched_run(struct mill_sched_s *s, taskfunc fn, void *data) {
+    mill_assert(mill);
+    mill_assert(!s->stopping);
+    if(mill_inbox_open() == -1)
+        return -1;
+    struct mill_work_s w;
+    w.fn = fn;
+    w.data = data;
+    w.waiter = mill->running;
+    if(mill_sched_submit(s, &w) == -1)
+        return -1;
+    int rc = mill_suspend();
+    mill_assert(rc == 1);
+    errno = w.errcode;
+    return w.result;
+}
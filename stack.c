@@ -46,8 +46,15 @@ static size_t mill_page_size(void) {
     return (size_t)pgsz;
 }
 
+/* Stacks get a guard page at the bottom if the memory can be page-aligned
+   and protected. With mmap() they are also returned to the kernel on
+   deallocation rather than to the heap. */
+#if defined HAVE_MPROTECT && (defined HAVE_MMAP || defined HAVE_POSIX_MEMALIGN)
+#define MILL_STACK_GUARD 1
+#endif
+
 size_t mill_get_stack_size(size_t req_size) {
-#if defined HAVE_POSIX_MEMALIGN && HAVE_MPROTECT
+#if defined MILL_STACK_GUARD
     if(mill_fast(mill->stack_size > 0))
         return mill->stack_size;
     if (req_size < mill_page_size())
@@ -63,19 +70,166 @@ size_t mill_get_stack_size(size_t req_size) {
 #endif
 }
 
-/* Maximum number of unused cached stacks. Keep in mind that we can't
-   deallocate the stack you are running on. Thus we need at least one cached
-   stack. */
-static int mill_max_cached_stacks = 64;
+/* Usable sizes of the fixed size classes, see MILL_STACK_* in libpill.h. */
+static const size_t mill_stack_classes[MILL_STACK_CLASSES] = {
+    0, 8 * 1024, 16 * 1024, 64 * 1024, 256 * 1024
+};
+
+/* Unused stacks are cached to make the allocation fast, separately for each
+   size class. Up to MILL_STACK_HOT most recently used ones are kept as they
+   are. Beyond that the memory of a cached stack, except for the top page
+   which holds the list item, is given back to the kernel. The cold stacks
+   are still cheaper to reuse than new ones as there's no need to map them
+   and set up the guard page. The total number of cached stacks follows
+   the rate of spawning coroutines, averaged over MILL_STACK_WINDOW ms
+   windows with exponential decay. All of this is done in the slow paths
+   only. */
+#define MILL_STACK_HOT 64
+#define MILL_STACK_CACHE_MAX 4096
+#define MILL_STACK_WINDOW 100
+
+void mill_initstacks(void) {
+    int i;
+    for(i = 0; i != MILL_STACK_CLASSES; ++i) {
+        struct mill_stackcache *sc = &mill->stacks[i];
+        memset(sc, 0, sizeof(struct mill_stackcache));
+        mill_slist_init(&sc->hot);
+        mill_slist_init(&sc->cold);
+        sc->max_cached = MILL_STACK_HOT;
+    }
+    mill->stacks[0].size = mill->stack_size;
+    for(i = 1; i != MILL_STACK_CLASSES; ++i) {
+#if defined MILL_STACK_GUARD
+        mill->stacks[i].size = mill_stack_classes[i] + mill_page_size();
+#else
+        mill->stacks[i].size = mill_stack_classes[i];
+#endif
+    }
+}
+
+/* Update the spawn rate and the limit on the number of cached stacks. */
+static void mill_stack_adjust(struct mill_stackcache *sc) {
+    int64_t nw = mill->now / 1000;
+    int64_t elapsed = nw - sc->stamp;
+    if(elapsed < MILL_STACK_WINDOW)
+        return;
+    int64_t windows = elapsed / MILL_STACK_WINDOW;
+    int64_t sample = sc->spawns / windows;
+    /* Each window moves the average 1/8 of the way to the sample. */
+    int i;
+    for(i = 0; i != windows && i != 64; ++i)
+        sc->rate += (sample - sc->rate) / 8;
+    if(windows > 64)
+        sc->rate = sample;
+    sc->spawns = 0;
+    sc->stamp = nw;
+    /* Keep enough stacks for a window's worth of spawns. */
+    int64_t limit = sc->rate;
+    if(limit < MILL_STACK_HOT)
+        limit = MILL_STACK_HOT;
+    if(limit > MILL_STACK_CACHE_MAX)
+        limit = MILL_STACK_CACHE_MAX;
+    sc->max_cached = (int)limit;
+}
+
+static void *mill_stack_bottom(struct mill_slist_item *item, size_t size) {
+    return ((char*)(item + 1)) - size;
+}
+
+static int mill_stack_inarena(struct mill_slist_item *item) {
+    char *ptr = (char*)item;
+    return ptr > mill->arena && ptr <= mill->arena + mill->arena_size;
+}
+
+static void mill_stack_unmap(struct mill_slist_item *item, size_t size) {
+    /* Stacks from the arena are never unmapped individually. */
+    if(mill_stack_inarena(item)) {
+        mill_slist_push(&mill->arena_stacks, item);
+        return;
+    }
+    void *ptr = mill_stack_bottom(item, size);
+#if defined MILL_STACK_GUARD && defined HAVE_MMAP
+    int rc = munmap(ptr, size);
+    mill_assert(rc == 0);
+#elif defined MILL_STACK_GUARD
+    int rc = mprotect(ptr, mill_page_size(), PROT_READ|PROT_WRITE);
+    mill_assert(rc == 0);
+    free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/* Give the memory of an unused stack back to the kernel. */
+static void mill_stack_release(struct mill_slist_item *item, size_t size) {
+#if defined MILL_STACK_GUARD && defined HAVE_MMAP && defined MADV_DONTNEED
+    char *ptr = ((char*)mill_stack_bottom(item, size)) + mill_page_size();
+    if(size > 2 * mill_page_size()) {
+        int rc = madvise(ptr, size - 2 * mill_page_size(), MADV_DONTNEED);
+        mill_assert(rc == 0);
+    }
+#endif
+}
 
-void *mill_allocstackmem(void) {
+void *mill_allocstackmem(int cls) {
     void *ptr;
 
     mill_assert(mill);
+    mill_assert(cls >= 0 && cls < MILL_STACK_CLASSES);
+    struct mill_stackcache *sc = &mill->stacks[cls];
+    size_t size = sc->size;
+    /* The cache of hot stacks is checked by the caller. */
+    mill_stack_adjust(sc);
 
-#if defined HAVE_POSIX_MEMALIGN && HAVE_MPROTECT
+    /* Stacks from the arena come first. The arena is for the default
+       size class only. */
+    if(mill->arena && cls == 0) {
+        if(!mill_slist_empty(&mill->arena_stacks))
+            return (void*)(mill_slist_pop(&mill->arena_stacks) + 1);
+        if(mill->arena_used < mill->arena_size) {
+            ptr = mill->arena + mill->arena_used;
+#if defined MILL_STACK_GUARD
+            if(!(mill->arena_flags & MILL_ARENA_NOGUARD)) {
+                int rc = mprotect(ptr, mill_page_size(), PROT_NONE);
+                if(mill_slow(rc != 0))
+                    return NULL;
+            }
+#endif
+            mill->arena_used += size;
+            return (void*)(((char*)ptr) + size);
+        }
+        /* The arena is exhausted, fall back to separate allocations. */
+    }
+
+    /* Reuse a stack which was given back to the kernel. */
+    if(!mill_slist_empty(&sc->cold)) {
+        --sc->num_cold;
+        return (void*)(mill_slist_pop(&sc->cold) + 1);
+    }
+
+#if defined MILL_STACK_GUARD && defined HAVE_MMAP
+    /* Memory is committed only when it's touched. */
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(mill_slow(ptr == MAP_FAILED)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* The bottom page is used as a stack guard. This way stack overflow will
+       cause segfault rather than randomly overwrite the heap. */
+    int rc = mprotect(ptr, mill_page_size(), PROT_NONE);
+    if(mill_slow(rc != 0)) {
+        int err = errno;
+        munmap(ptr, size);
+        errno = err;
+        return NULL;
+    }
+#elif defined MILL_STACK_GUARD
     /* Allocate the stack so that it's memory-page-aligned. */
-    int rc = posix_memalign(&ptr, mill_page_size(), mill->stack_size);
+    int rc = posix_memalign(&ptr, mill_page_size(), size);
     if(mill_slow(rc != 0)) {
         errno = rc;
         return NULL;
@@ -90,59 +244,133 @@ void *mill_allocstackmem(void) {
         return NULL;
     }
 #else
-    ptr = malloc(mill->stack_size);
+    ptr = malloc(size);
     if(mill_slow(!ptr)) {
         errno = ENOMEM;
         return NULL;
     }
 #endif
-    return (void*)(((char*)ptr) + mill->stack_size);
+    return (void*)(((char*)ptr) + size);
 }
 
-void mill_freestack(void *stack) {
-#if 0
-    if (mill->num_cached_stacks > 0) {
-        struct mill_slist_item *li = mill->cached_stacks.last;
-        void *ptr = ((char*)(li + 1)) - mill->stack_size;
-        memset(ptr+mill_page_size(), '\0',
-                mill->stack_size
-                - mill_page_size() /* guard page */
-                - sizeof(struct mill_slist_item));
-    }
-#endif
+void mill_freestack(void *stack, int cls) {
+    struct mill_stackcache *sc = &mill->stacks[cls];
     /* Put the stack to the list of cached stacks. */
     struct mill_slist_item *item = ((struct mill_slist_item*)stack) - 1;
-    mill_slist_push_back(&mill->cached_stacks, item);
-    if(mill->num_cached_stacks < mill_max_cached_stacks) {
-        ++mill->num_cached_stacks;
+    mill_slist_push_back(&sc->hot, item);
+    if(mill_fast(sc->num_hot < MILL_STACK_HOT)) {
+        ++sc->num_hot;
         return;
     }
     /* We can't deallocate the stack we are running on at the moment.
        Standard C free() is not required to work when it deallocates its
        own stack from underneath itself. Instead, we'll deallocate one of
-       the unused cached stacks. */
-    item = mill_slist_pop(&mill->cached_stacks);
-    void *ptr = ((char*)(item + 1)) - mill->stack_size;
-#if HAVE_POSIX_MEMALIGN && HAVE_MPROTECT
-    int rc = mprotect(ptr, mill_page_size(), PROT_READ|PROT_WRITE);
-    mill_assert(rc == 0);
+       the unused cached stacks. The same applies to madvise(). */
+    item = mill_slist_pop(&sc->hot);
+    /* The number of stacks in the arena is fixed, no need to limit it.
+       Releasing the memory would break up huge pages. */
+    if(mill_stack_inarena(item)) {
+        if(!(mill->arena_flags & MILL_ARENA_HUGEPAGE))
+            mill_stack_release(item, sc->size);
+        mill_slist_push(&mill->arena_stacks, item);
+        return;
+    }
+    mill_stack_adjust(sc);
+    /* Trim the cold stacks if the spawn rate went down. */
+    while(sc->num_cold > 0 &&
+          MILL_STACK_HOT + sc->num_cold >= sc->max_cached) {
+        mill_stack_unmap(mill_slist_pop(&sc->cold), sc->size);
+        --sc->num_cold;
+    }
+    if(MILL_STACK_HOT + sc->num_cold >= sc->max_cached) {
+        mill_stack_unmap(item, sc->size);
+        return;
+    }
+    mill_stack_release(item, sc->size);
+    mill_slist_push(&sc->cold, item);
+    ++sc->num_cold;
+}
+
+void *mill_stacklimit(void *stack, int cls) {
+    char *ptr = ((char*)stack) - mill->stacks[cls].size;
+#if defined MILL_STACK_GUARD
+    ptr += mill_page_size();
 #endif
-    free(ptr);
+    return ptr;
 }
 
 void mill_purgestacks(void) {
-    struct mill_slist *sl = &mill->cached_stacks;
-    while (1) {
-        struct mill_slist_item *item = mill_slist_pop(sl);
-        if (!item)
-            break;
-        void *ptr = (void *) (((char*)(item + 1)) - mill->stack_size);
-#if HAVE_POSIX_MEMALIGN && HAVE_MPROTECT
-        int rc = mprotect(ptr, mill_page_size(), PROT_READ|PROT_WRITE);
+    int i;
+    for(i = 0; i != MILL_STACK_CLASSES; ++i) {
+        struct mill_stackcache *sc = &mill->stacks[i];
+        struct mill_slist_item *item;
+        while((item = mill_slist_pop(&sc->hot)))
+            mill_stack_unmap(item, sc->size);
+        while((item = mill_slist_pop(&sc->cold)))
+            mill_stack_unmap(item, sc->size);
+        sc->num_hot = 0;
+        sc->num_cold = 0;
+    }
+#if defined HAVE_MMAP
+    if(mill->arena) {
+        int rc = munmap(mill->arena, mill->arena_size);
         mill_assert(rc == 0);
-#endif
-        free(ptr);
+        mill->arena = NULL;
+        mill_slist_init(&mill->arena_stacks);
     }
-    mill->num_cached_stacks = 0;
+#endif
 }
 
+#define MILL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+int mill_stackarena(size_t nstacks, int flags) {
+    mill_assert(mill);
+#if defined HAVE_MMAP
+    if(mill->arena) {
+        errno = EBUSY;
+        return -1;
+    }
+    if(nstacks == 0 || nstacks > SIZE_MAX / mill->stack_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Guard pages would split the huge pages. */
+    if((flags & MILL_ARENA_HUGEPAGE) && !(flags & MILL_ARENA_NOGUARD)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t size = nstacks * mill->stack_size;
+    /* Huge pages need the region to be aligned to their size. */
+    size_t align = flags & MILL_ARENA_HUGEPAGE ?
+        MILL_HUGEPAGE_SIZE : mill_page_size();
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined MAP_NORESERVE
+    mflags |= MAP_NORESERVE;
+#endif
+    char *ptr = mmap(NULL, size + align, PROT_READ | PROT_WRITE, mflags,
+        -1, 0);
+    if(ptr == MAP_FAILED) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *start = (char*)(((uintptr_t)ptr + align - 1) & ~(align - 1));
+    if(start > ptr)
+        munmap(ptr, start - ptr);
+    if(start + size < ptr + size + align)
+        munmap(start + size, ptr + size + align - (start + size));
+#if defined MADV_HUGEPAGE
+    /* This is only a hint. It fails if THP are not supported. */
+    if(flags & MILL_ARENA_HUGEPAGE)
+        madvise(start, size, MADV_HUGEPAGE);
+#endif
+    mill->arena = start;
+    mill->arena_size = size;
+    mill->arena_used = 0;
+    mill->arena_flags = flags;
+    mill_slist_init(&mill->arena_stacks);
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
@@ -26,12 +26,47 @@
 #define MILL_STACK_INCLUDED
 
 #include <stddef.h>
+#include <stdint.h>
 #include "slist.h"
 
-void *mill_allocstackmem(void);
+/* Size class 0 is the default stack size of the thread, the others are
+   the fixed sizes listed in libpill.h (MILL_STACK_*). */
+#define MILL_STACK_CLASSES 5
+
+/* Unused stacks of a single size class. See stack.c. */
+struct mill_stackcache {
+    /* Size of the stacks including the guard page. */
+    size_t size;
+    /* A stack of unused coroutine stacks. This allows for extra-fast
+       allocation of a new stack. When the stack is cached its
+       mill_slist_item is placed on its top rather then on the bottom.
+       That way we minimise page misses. */
+    int num_hot;
+    struct mill_slist hot;
+    /* Cached stacks whose memory was given back to the kernel. The number
+       of all cached stacks is limited by max_cached, which follows
+       the spawn rate. */
+    int num_cold;
+    struct mill_slist cold;
+    int max_cached;
+    int spawns;
+    int64_t rate;
+    int64_t stamp;
+};
+
+/* Initialise the caches once mill->stack_size is known. */
+void mill_initstacks(void);
+
+/* Allocates a stack of the given size class when there's no hot cached
+   one (see mill_allocstack()). Returns pointer to the top of the stack. */
+void *mill_allocstackmem(int cls);
 
 /* Deallocates a stack. The argument is pointer to the top of the stack. */
-void mill_freestack(void *stack);
+void mill_freestack(void *stack, int cls);
+
+/* Returns the lowest usable address of a stack, i.e. the one right above
+   the guard page. The argument is pointer to the top of the stack. */
+void *mill_stacklimit(void *stack, int cls);
 
 void mill_purgestacks(void);
 
@@ -0,0 +1,192 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#if defined MILL_STACKPROF && defined HAVE_DLADDR
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cr.h"
+#include "libpill.h"
+#include "stack.h"
+#include "stackprof.h"
+#include "utils.h"
+
+#if defined MILL_STACKPROF
+
+/* Stacks are painted with this byte. The lowest word that doesn't match
+   the pattern marks the deepest point the coroutine has reached. */
+#define MILL_STACKPROF_PATTERN 0xa5
+#define MILL_STACKPROF_WORD 0xa5a5a5a5a5a5a5a5ULL
+
+/* The spawn sites of all the threads share a single open-addressing hash
+   table. Sites beyond its capacity are not recorded. */
+#define MILL_STACKPROF_SITES 1024
+
+struct mill_stackprof_site {
+    void *site;
+    size_t stack_size;
+    size_t max_depth;
+    uint64_t total_depth;
+    uint64_t count;
+};
+
+static struct mill_stackprof_site mill_stackprof_sites[MILL_STACKPROF_SITES];
+static int mill_stackprof_nsites = 0;
+static int mill_stackprof_lock = 0;
+static int mill_stackprof_reported = 0;
+
+static void mill_stackprof_report(void);
+
+void mill_stackprof_paint(struct mill_cr *cr, void *top, void *site) {
+    cr->spawnsite = site;
+    cr->stacktop = top;
+    if(!site)
+        return;
+    /* This runs on the stack of the parent, so the whole stack of the new
+       coroutine can be painted. It also commits all of its memory. */
+    char *limit = mill_stacklimit(cr + 1, cr->stack_class);
+    memset(limit, MILL_STACKPROF_PATTERN, (char*)top - limit);
+}
+
+void mill_stackprof_record(struct mill_cr *cr) {
+    if(!cr->spawnsite)
+        return;
+    char *limit = mill_stacklimit(cr + 1, cr->stack_class);
+    uint64_t *word = (uint64_t*)limit;
+    while((char*)word < (char*)cr->stacktop &&
+          *word == MILL_STACKPROF_WORD)
+        ++word;
+    size_t depth = (char*)cr->stacktop - (char*)word;
+    size_t stack_size = (char*)cr->stacktop - limit;
+
+    while(!mill_atomic_set(&mill_stackprof_lock, 0, 1))
+        sched_yield();
+    size_t i = ((uintptr_t)cr->spawnsite >> 2) % MILL_STACKPROF_SITES;
+    size_t n;
+    for(n = 0; n != MILL_STACKPROF_SITES; ++n) {
+        struct mill_stackprof_site *s = &mill_stackprof_sites[i];
+        if(!s->site) {
+            s->site = cr->spawnsite;
+            ++mill_stackprof_nsites;
+            if(!mill_stackprof_reported) {
+                atexit(mill_stackprof_report);
+                mill_stackprof_reported = 1;
+            }
+        }
+        if(s->site == cr->spawnsite) {
+            s->stack_size = stack_size;
+            if(depth > s->max_depth)
+                s->max_depth = depth;
+            s->total_depth += depth;
+            ++s->count;
+            break;
+        }
+        i = (i + 1) % MILL_STACKPROF_SITES;
+    }
+    int rc = mill_atomic_set(&mill_stackprof_lock, 1, 0);
+    mill_assert(rc);
+}
+
+int mill_stackprof(struct mill_stackprof *sites, int nsites) {
+    if(nsites < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while(!mill_atomic_set(&mill_stackprof_lock, 0, 1))
+        sched_yield();
+    int i, n = 0;
+    for(i = 0; i != MILL_STACKPROF_SITES && n < nsites; ++i) {
+        struct mill_stackprof_site *s = &mill_stackprof_sites[i];
+        if(!s->site)
+            continue;
+        sites[n].site = s->site;
+        sites[n].count = s->count;
+        sites[n].stack_size = s->stack_size;
+        sites[n].max_depth = s->max_depth;
+        sites[n].avg_depth = (size_t)(s->total_depth / s->count);
+        ++n;
+    }
+    int total = mill_stackprof_nsites;
+    int rc = mill_atomic_set(&mill_stackprof_lock, 1, 0);
+    mill_assert(rc);
+    return total;
+}
+
+static int mill_stackprof_cmp(const void *a, const void *b) {
+    const struct mill_stackprof *sa = a, *sb = b;
+    return sa->max_depth < sb->max_depth ? 1 :
+        sa->max_depth > sb->max_depth ? -1 : 0;
+}
+
+/* Prints the spawn sites to stderr, the ones with the deepest stacks
+   first. */
+static void mill_stackprof_report(void) {
+    static struct mill_stackprof sites[MILL_STACKPROF_SITES];
+    int n = mill_stackprof(sites, MILL_STACKPROF_SITES);
+    if(n <= 0)
+        return;
+    if(n > MILL_STACKPROF_SITES)
+        n = MILL_STACKPROF_SITES;
+    qsort(sites, n, sizeof(struct mill_stackprof), mill_stackprof_cmp);
+    fprintf(stderr, "libmill stack usage per spawn site (bytes):\n");
+    fprintf(stderr, "%18s %10s %10s %10s %10s  %s\n", "site", "count",
+        "stack", "max", "avg", "symbol");
+    int i;
+    for(i = 0; i != n; ++i) {
+        fprintf(stderr, "%18p %10llu %10zu %10zu %10zu  ", sites[i].site,
+            (unsigned long long)sites[i].count, sites[i].stack_size,
+            sites[i].max_depth, sites[i].avg_depth);
+#if defined HAVE_DLADDR
+        Dl_info info;
+        if(dladdr(sites[i].site, &info) && info.dli_sname) {
+            fprintf(stderr, "%s+%#lx\n", info.dli_sname,
+                (unsigned long)((char*)sites[i].site - (char*)info.dli_saddr));
+            continue;
+        }
+        if(dladdr(sites[i].site, &info) && info.dli_fname) {
+            fprintf(stderr, "%s+%#lx\n", info.dli_fname,
+                (unsigned long)((char*)sites[i].site - (char*)info.dli_fbase));
+            continue;
+        }
+#endif
+        fprintf(stderr, "?\n");
+    }
+}
+
+#else
+
+int mill_stackprof(struct mill_stackprof *sites, int nsites) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
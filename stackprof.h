@@ -0,0 +1,47 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_STACKPROF_INCLUDED
+#define MILL_STACKPROF_INCLUDED
+
+struct mill_cr;
+
+#if defined MILL_STACKPROF
+
+/* Fills the unused part of the stack of a new coroutine with a pattern.
+   'top' is the top of the stack as used by the coroutine and 'site'
+   identifies the go() that launched it, NULL if not to be profiled. */
+void mill_stackprof_paint(struct mill_cr *cr, void *top, void *site);
+
+/* Finds how much of the stack the exiting coroutine used. */
+void mill_stackprof_record(struct mill_cr *cr);
+
+#else
+
+#define mill_stackprof_paint(cr, top, site) ((void)0)
+#define mill_stackprof_record(cr) ((void)0)
+
+#endif
+
+#endif
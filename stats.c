@@ -0,0 +1,116 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "cr.h"
+#include "libpill.h"
+#include "stats.h"
+#include "utils.h"
+
+#if defined MILL_STATS
+
+static int64_t mill_stats_now(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    mill_assert(rc == 0);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Adds the interval to the log2 histogram. */
+static void mill_stats_hist(uint64_t *hist, int64_t ns) {
+    int bucket = ns > 1 ? 63 - __builtin_clzll((uint64_t)ns) : 0;
+    if(bucket >= MILL_STATS_BUCKETS)
+        bucket = MILL_STATS_BUCKETS - 1;
+    hist[bucket]++;
+}
+
+void mill_stats_start(struct mill_cr *cr) {
+    memset(&cr->stats, 0, sizeof(cr->stats));
+    cr->stats.stamp = mill_stats_now();
+    cr->stats.running = 1;
+}
+
+void mill_stats_stop(struct mill_cr *cr) {
+    int64_t nw = mill_stats_now();
+    int64_t ns = nw - cr->stats.stamp;
+    cr->stats.totals.running += ns;
+    cr->stats.totals.switches++;
+    mill_stats_hist(mill->stats.running, ns);
+    mill->stats.switches++;
+    cr->stats.stamp = nw;
+    cr->stats.running = 0;
+}
+
+void mill_stats_ready(struct mill_cr *cr) {
+    /* The running coroutine (yield, go) starts waiting in the ready queue
+       once it is switched out. */
+    if(cr->stats.running)
+        return;
+    int64_t nw = mill_stats_now();
+    int64_t ns = nw - cr->stats.stamp;
+    cr->stats.totals.blocked += ns;
+    mill_stats_hist(mill->stats.blocked, ns);
+    cr->stats.stamp = nw;
+}
+
+void mill_stats_run(struct mill_cr *cr) {
+    int64_t nw = mill_stats_now();
+    int64_t ns = nw - cr->stats.stamp;
+    cr->stats.totals.ready += ns;
+    mill_stats_hist(mill->stats.ready, ns);
+    cr->stats.stamp = nw;
+    cr->stats.running = 1;
+}
+
+int mill_crstats(struct mill_crstats *stats) {
+    struct mill_cr *cr = mill->running;
+    *stats = cr->stats.totals;
+    /* Include the current run. */
+    stats->running += mill_stats_now() - cr->stats.stamp;
+    return 0;
+}
+
+int mill_schedstats(struct mill_schedstats *stats, int reset) {
+    *stats = mill->stats;
+    if(reset)
+        memset(&mill->stats, 0, sizeof(mill->stats));
+    return 0;
+}
+
+#else
+
+int mill_crstats(struct mill_crstats *stats) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int mill_schedstats(struct mill_schedstats *stats, int reset) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
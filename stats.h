@@ -0,0 +1,59 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_STATS_INCLUDED
+#define MILL_STATS_INCLUDED
+
+#include <stdint.h>
+
+#include "libpill.h"
+
+struct mill_cr;
+
+#if defined MILL_STATS
+
+/* Per-coroutine accounting. 'stamp' is the time of the last transition
+   between the running, ready and blocked states. */
+struct mill_crstats_s {
+    int64_t stamp;
+    int running;
+    struct mill_crstats totals;
+};
+
+/* Called on state transitions of the coroutine. */
+void mill_stats_start(struct mill_cr *cr);
+void mill_stats_stop(struct mill_cr *cr);
+void mill_stats_ready(struct mill_cr *cr);
+void mill_stats_run(struct mill_cr *cr);
+
+#else
+
+#define mill_stats_start(cr) ((void)0)
+#define mill_stats_stop(cr) ((void)0)
+#define mill_stats_ready(cr) ((void)0)
+#define mill_stats_run(cr) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,158 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libpill.h"
+
+#define NSUBS 50
+#define COUNT 100
+
+static coroutine void subscriber(bsub s, chan result) {
+    int expected = 0;
+    while(1) {
+        int val;
+        int rc = bcrecv(s, &val, -1);
+        if(rc == -1) {
+            assert(errno == EPIPE);
+            break;
+        }
+        assert(rc == 0);
+        assert(val == expected);
+        ++expected;
+    }
+    bcunsubscribe(s);
+    chs(result, int, expected);
+    chclose(result);
+}
+
+static coroutine void publisher(bcast bc, int count) {
+    int i;
+    for(i = 0; i != count; ++i) {
+        int rc = bcsend(bc, &i, -1);
+        assert(rc == 0);
+    }
+    int rc = bcdone(bc);
+    assert(rc == 0);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    bcast bc = bcmake(int, 0, MILL_BCAST_BLOCK);
+    assert(!bc && errno == EINVAL);
+    bc = bcmake(int, 4, 7);
+    assert(!bc && errno == EINVAL);
+
+    /* Every subscriber gets every value, the sender blocking on the slowest
+       one as the ring is much smaller than the stream. */
+    bc = bcmake(int, 4, MILL_BCAST_BLOCK);
+    assert(bc);
+    chan result = chmake(int, NSUBS);
+    int i;
+    for(i = 0; i != NSUBS; ++i) {
+        bsub s = bcsubscribe(bc);
+        assert(s);
+        go(subscriber(s, chdup(result)));
+    }
+    go(publisher(bc, COUNT));
+    for(i = 0; i != NSUBS; ++i)
+        assert(chr(result, int) == COUNT);
+    int val = 0;
+    int rc = bcsend(bc, &val, -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = bcdone(bc);
+    assert(rc == -1 && errno == EPIPE);
+    rc = bcclose(bc);
+    assert(rc == 0);
+
+    /* A blocked sender times out, an idle subscriber unblocks it by
+       leaving. */
+    bc = bcmake(int, 2, MILL_BCAST_BLOCK);
+    bsub s = bcsubscribe(bc);
+    for(val = 0; val != 2; ++val) {
+        rc = bcsend(bc, &val, -1);
+        assert(rc == 0);
+    }
+    int64_t deadline = now() + 30;
+    rc = bcsend(bc, &val, deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now() >= deadline);
+    rc = bcrecv(s, &val, -1);
+    assert(rc == 0 && val == 0);
+    val = 2;
+    rc = bcsend(bc, &val, now() + 1000);
+    assert(rc == 0);
+    bcunsubscribe(s);
+    rc = bcsend(bc, &val, now() + 1000);
+    assert(rc == 0);
+
+    /* Values sent before subscribing aren't received. */
+    s = bcsubscribe(bc);
+    deadline = now() + 30;
+    rc = bcrecv(s, &val, deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now() >= deadline);
+    bcunsubscribe(s);
+    rc = bcclose(bc);
+    assert(rc == 0);
+
+    /* A slow subscriber loses the oldest values and is told how many. */
+    bc = bcmake(int, 4, MILL_BCAST_DROP);
+    bsub slow = bcsubscribe(bc);
+    bsub fast = bcsubscribe(bc);
+    for(val = 0; val != 10; ++val) {
+        rc = bcsend(bc, &val, -1);
+        assert(rc == 0);
+        int got;
+        rc = bcrecv(fast, &got, -1);
+        assert(rc == 0 && got == val);
+    }
+    rc = bcrecv(slow, &val, -1);
+    assert(rc == 6 && val == 6);
+    rc = bcrecv(slow, &val, -1);
+    assert(rc == 0 && val == 7);
+
+    /* Remaining values are received after bcdone(). The channel outlives
+       bcclose() until the last subscriber is gone. */
+    rc = bcdone(bc);
+    assert(rc == 0);
+    rc = bcclose(bc);
+    assert(rc == 0);
+    for(i = 8; i != 10; ++i) {
+        rc = bcrecv(slow, &val, -1);
+        assert(rc == 0 && val == i);
+    }
+    rc = bcrecv(slow, &val, -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = bcrecv(fast, &val, -1);
+    assert(rc == -1 && errno == EPIPE);
+    bcunsubscribe(slow);
+    bcunsubscribe(fast);
+
+    chclose(result);
+    mill_fini();
+    return 0;
+}
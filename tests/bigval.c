@@ -0,0 +1,113 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+
+#include "../libpill.h"
+
+/* Too large for the valbuf of the coroutine. */
+struct bar {
+    int data[1024];
+};
+
+static void fillbar(struct bar *b, int val) {
+    int i;
+    for(i = 0; i != 1024; ++i)
+        b->data[i] = val + i;
+}
+
+static void checkbar(struct bar *b, int val) {
+    int i;
+    for(i = 0; i != 1024; ++i)
+        assert(b->data[i] == val + i);
+}
+
+coroutine static void barsender(chan ch, int doyield, int val) {
+    struct bar b;
+    fillbar(&b, val);
+    if(doyield)
+        yield();
+    int rc = mill_chs(ch, &b);
+    assert(rc == 0);
+    chclose(ch);
+}
+
+coroutine static void sender(chan ch, int doyield, int val) {
+    if(doyield)
+        yield();
+    chs(ch, int, val);
+    chclose(ch);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* Values larger than the valbuf. */
+    chan ch1 = chmake(struct bar, 1);
+    go(barsender(chdup(ch1), 1, 10));
+    checkbar(mill_chr(ch1), 10);
+    go(barsender(chdup(ch1), 0, 20));
+    go(barsender(chdup(ch1), 0, 30));
+    checkbar(mill_chr(ch1), 20);
+    checkbar(mill_chr(ch1), 30);
+
+    /* Receiving straight into the destination. */
+    struct bar bar1;
+    go(barsender(chdup(ch1), 1, 40));
+    chrecv(ch1, &bar1);
+    checkbar(&bar1, 40);
+    go(barsender(chdup(ch1), 0, 50));
+    go(barsender(chdup(ch1), 0, 60));
+    chrecv(ch1, &bar1);
+    checkbar(&bar1, 50);
+    chrecv(ch1, &bar1);
+    checkbar(&bar1, 60);
+
+    /* The done value of a large channel. */
+    fillbar(&bar1, 70);
+    int rc = mill_chdone(ch1, &bar1);
+    assert(rc == 0);
+    struct bar bar2;
+    chrecv(ch1, &bar2);
+    checkbar(&bar2, 70);
+    checkbar(mill_chr(ch1), 70);
+    chclose(ch1);
+
+    /* Small values received into the destination. */
+    int val;
+    chan ch2 = chmake(int, 0);
+    go(sender(chdup(ch2), 1, 777));
+    chrecv(ch2, &val);
+    assert(val == 777);
+    go(sender(chdup(ch2), 0, 778));
+    chrecv(ch2, &val);
+    assert(val == 778);
+    chdone(ch2, int, 888);
+    chrecv(ch2, &val);
+    assert(val == 888);
+    chclose(ch2);
+
+    mill_fini();
+    return 0;
+}
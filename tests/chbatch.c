@@ -0,0 +1,124 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libpill.h"
+
+coroutine static void sender(chan ch, int doyield, int val) {
+    if(doyield)
+        yield();
+    chs(ch, int, val);
+    chclose(ch);
+}
+
+coroutine static void receiver(chan ch, int expected, chan back) {
+    int val = chr(ch, int);
+    assert(val == expected);
+    chclose(ch);
+    chs(back, int, 0);
+    chclose(back);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* Buffered channel. */
+    int vals[10];
+    int i, rc;
+    chan ch1 = chmake(int, 6);
+    for(i = 0; i != 10; ++i)
+        vals[i] = i;
+    rc = chtryrecv(ch1, vals, 10);
+    assert(rc == 0);
+    rc = chs_many(ch1, vals, 4);
+    assert(rc == 4);
+    rc = chtrysend(ch1, vals + 4, 6);
+    assert(rc == 2);
+    rc = chtrysend(ch1, vals, 1);
+    assert(rc == 0);
+    rc = chr_many(ch1, vals, 10, -1);
+    assert(rc == 6);
+    for(i = 0; i != 6; ++i)
+        assert(vals[i] == i);
+    go(sender(chdup(ch1), 1, 55));
+    go(sender(chdup(ch1), 1, 66));
+    rc = chr_many(ch1, vals, 10, now() + 1000);
+    assert(rc == 1 && vals[0] == 55);
+    rc = chr_many(ch1, vals, 10, now() + 10);
+    assert(rc == 1 && vals[0] == 66);
+    rc = chr_many(ch1, vals, 10, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    chdone(ch1, int, 77);
+    rc = chtryrecv(ch1, vals, 10);
+    assert(rc == 1 && vals[0] == 77);
+    rc = chs_many(ch1, vals, 1);
+    assert(rc == -1 && errno == EPIPE);
+    chclose(ch1);
+
+    /* The buffer wraps around. */
+    chan ch2 = chmake(int, 5);
+    int next = 0, expected = 0;
+    for(i = 0; i != 20; ++i) {
+        int j, n = i % 4 + 1;
+        for(j = 0; j != n; ++j)
+            vals[j] = next + j;
+        rc = chtrysend(ch2, vals, n);
+        assert(rc >= 0 && rc <= n);
+        next += rc;
+        rc = chtryrecv(ch2, vals, 3);
+        for(j = 0; j != rc; ++j)
+            assert(vals[j] == expected++);
+    }
+    rc = chtryrecv(ch2, vals, 10);
+    for(i = 0; i != rc; ++i)
+        assert(vals[i] == expected++);
+    assert(expected == next);
+    chclose(ch2);
+
+    /* Batch operations on an unbuffered channel wake up all the peers. */
+    chan ch3 = chmake(int, 0);
+    chan ch4 = chmake(int, 0);
+    for(i = 0; i != 3; ++i)
+        go(receiver(chdup(ch3), 88, chdup(ch4)));
+    yield();
+    for(i = 0; i != 5; ++i)
+        vals[i] = 88;
+    rc = chs_many(ch3, vals, 5);
+    assert(rc == 3);
+    for(i = 0; i != 3; ++i)
+        chr(ch4, int);
+    for(i = 0; i != 2; ++i)
+        go(sender(chdup(ch3), 0, 99));
+    rc = chr_many(ch3, vals, 5, -1);
+    assert(rc == 2 && vals[0] == 99 && vals[1] == 99);
+    rc = chtryrecv(ch3, vals, 5);
+    assert(rc == 0);
+    chclose(ch4);
+    chclose(ch3);
+
+    mill_fini();
+    return 0;
+}
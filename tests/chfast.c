@@ -0,0 +1,125 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "../libpill.h"
+
+coroutine static void sender(chan ch, int doyield, int val) {
+    if(doyield)
+        yield();
+    chs(ch, int, val);
+    chclose(ch);
+}
+
+coroutine static void receiver(chan ch, int expected, chan back) {
+    int val = chr(ch, int);
+    assert(val == expected);
+    chclose(ch);
+    chs(back, int, val);
+    chclose(back);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* Unbuffered channel, the peer is already waiting. */
+    int val;
+    chan ch1 = chmake(int, 0);
+    chan back = chmake(int, 0);
+    go(receiver(chdup(ch1), 111, chdup(back)));
+    chs(ch1, int, 111);
+    assert(chr(back, int) == 111);
+    go(sender(chdup(ch1), 0, 222));
+    assert(chr(ch1, int) == 222);
+
+    /* Unbuffered channel, the peer comes later. */
+    go(sender(chdup(ch1), 1, 333));
+    assert(chr(ch1, int) == 333);
+    go(receiver(chdup(ch1), 444, chdup(back)));
+    yield();
+    chs(ch1, int, 444);
+    assert(chr(back, int) == 444);
+
+    /* Buffered channel, in order. The sender blocks once it's full. */
+    chan ch2 = chmake(int, 2);
+    chs(ch2, int, 1);
+    chs(ch2, int, 2);
+    go(sender(chdup(ch2), 0, 3));
+    assert(chr(ch2, int) == 1);
+    assert(chr(ch2, int) == 2);
+    assert(chr(ch2, int) == 3);
+    go(sender(chdup(ch2), 1, 4));
+    assert(chr(ch2, int) == 4);
+
+    /* Done channel. */
+    chdone(ch1, int, 555);
+    assert(chr(ch1, int) == 555);
+    assert(chr(ch1, int) == 555);
+    int rc = chsd(ch1, &val, -1);
+    assert(rc == -1 && errno == EPIPE);
+    chclose(ch1);
+    chclose(back);
+    chclose(ch2);
+
+    /* Deadlines. The capacity isn't affected by the power-of-two buffer. */
+    chan ch3 = chmake(int, 3);
+    int64_t deadline = now() + 10;
+    rc = chrd(ch3, &val, deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now() >= deadline);
+    for(val = 0; val != 3; ++val) {
+        rc = chsd(ch3, &val, now() + 10);
+        assert(rc == 0);
+    }
+    rc = chsd(ch3, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    int i;
+    for(i = 0; i != 3; ++i) {
+        rc = chrd(ch3, &val, now() + 10);
+        assert(rc == 0 && val == i);
+    }
+    go(sender(chdup(ch3), 1, 999));
+    rc = chrd(ch3, &val, now() + 1000);
+    assert(rc == 0 && val == 999);
+
+    /* The buffer wraps around many times. */
+    for(i = 0; i != 100; ++i) {
+        rc = chsd(ch3, &i, -1);
+        assert(rc == 0);
+        if(i % 3 == 2) {
+            int j;
+            for(j = i - 2; j <= i; ++j) {
+                rc = chrd(ch3, &val, -1);
+                assert(rc == 0 && val == j);
+            }
+        }
+    }
+    chclose(ch3);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,252 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define MILL_CHOOSE
+#include "../libpill.h"
+
+static coroutine void delayed_write(int fd, int64_t deadline) {
+    mill_sleep(deadline);
+    ssize_t sz = write(fd, "A", 1);
+    assert(sz == 1);
+}
+
+static coroutine void delayed_send(chan ch, int val, int64_t deadline) {
+    mill_sleep(deadline);
+    chs(ch, int, val);
+}
+
+static coroutine void two_fds(mill_fd a, mill_fd b, chan result) {
+    int which = 0;
+    choose {
+    fdw(a, FDW_IN, ev):
+        assert(ev == FDW_IN);
+        which = 1;
+    fdw(b, FDW_IN, ev):
+        assert(ev == FDW_IN);
+        which = 2;
+    deadline(now() + 1000):
+        assert(0);
+    end
+    }
+    chs(result, int, which);
+}
+
+static int slow_task(void *arg) {
+    usleep(30000);
+    return *(int*)arg;
+}
+
+static coroutine void impatient_join(int *arg, mill_task *t) {
+    *t = task_submit(NULL, slow_task, arg);
+    assert(*t);
+    int rc = task_join(*t, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+}
+
+static int failing_task(void *arg) {
+    errno = ENOENT;
+    return -1;
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    int fds[2];
+    int rc = pipe(fds);
+    assert(rc == 0);
+    mill_fd in = mill_open(fds[0]);
+    mill_fd out = mill_open(fds[1]);
+    chan ch = chmake(int, 0);
+
+    /* Nothing happens. */
+    int64_t deadline = now() + 30;
+    choose {
+    fdw(in, FDW_IN, ev):
+        (void) ev;
+        assert(0);
+    in(ch, int, val):
+        (void) val;
+        assert(0);
+    deadline(deadline):
+        assert(now() >= deadline);
+    end
+    }
+
+    /* The file descriptor becomes readable while waiting. */
+    go(delayed_write(fds[1], now() + 20));
+    choose {
+    fdw(in, FDW_IN, ev):
+        assert(ev == FDW_IN);
+    in(ch, int, val):
+        (void) val;
+        assert(0);
+    deadline(now() + 1000):
+        assert(0);
+    end
+    }
+    char c;
+    ssize_t sz = read(fds[0], &c, 1);
+    assert(sz == 1 && c == 'A');
+
+    /* The channel fires first; the fd is unregistered and can be waited
+       for again. */
+    go(delayed_send(ch, 7, now() + 20));
+    choose {
+    fdw(in, FDW_IN, ev):
+        (void) ev;
+        assert(0);
+    in(ch, int, val):
+        assert(val == 7);
+    end
+    }
+    rc = mill_fdwait(in, FDW_IN, now() + 20);
+    assert(rc == 0);
+
+    /* Multiple file descriptors. */
+    choose {
+    fdw(in, FDW_IN, ev):
+        (void) ev;
+        assert(0);
+    fdw(out, FDW_OUT, ev):
+        assert(ev == FDW_OUT);
+    end
+    }
+
+    /* Both file descriptors become readable in the same poll, the other
+       one is unregistered while the events are being fired. */
+    int fds2[2];
+    rc = pipe(fds2);
+    assert(rc == 0);
+    mill_fd in2 = mill_open(fds2[0]);
+    go(two_fds(in, in2, ch));
+    yield();
+    sz = write(fds[1], "C", 1);
+    assert(sz == 1);
+    sz = write(fds2[1], "D", 1);
+    assert(sz == 1);
+    mill_sleep(now() + 20);
+    rc = chr(ch, int);
+    assert(rc == 1 || rc == 2);
+    rc = mill_fdwait(in, FDW_IN, now() + 1000);
+    assert(rc == FDW_IN);
+    rc = mill_fdwait(in2, FDW_IN, now() + 1000);
+    assert(rc == FDW_IN);
+    sz = read(fds[0], &c, 1);
+    assert(sz == 1 && c == 'C');
+    sz = read(fds2[0], &c, 1);
+    assert(sz == 1 && c == 'D');
+    mill_close(in2, 1);
+    close(fds2[1]);
+
+    /* With 'otherwise' the descriptors are polled immediately. */
+    choose {
+    fdw(in, FDW_IN, ev):
+        (void) ev;
+        assert(0);
+    otherwise:
+        ;
+    end
+    }
+    sz = write(fds[1], "B", 1);
+    assert(sz == 1);
+    choose {
+    fdw(in, FDW_IN, ev):
+        assert(ev == FDW_IN);
+    otherwise:
+        assert(0);
+    end
+    }
+    sz = read(fds[0], &c, 1);
+    assert(sz == 1 && c == 'B');
+
+    /* The other end closed. */
+    mill_close(out, 1);
+    choose {
+    fdw(in, FDW_IN, ev):
+        assert(ev & (FDW_IN | FDW_ERR));
+    deadline(now() + 1000):
+        assert(0);
+    end
+    }
+    mill_close(in, 1);
+
+    /* Task finishing while waiting. */
+    int arg = 42;
+    mill_task t = task_submit(NULL, slow_task, &arg);
+    assert(t);
+    choose {
+    taskdone(t, res):
+        assert(res == 42);
+    in(ch, int, val):
+        (void) val;
+        assert(0);
+    deadline(now() + 1000):
+        assert(0);
+    end
+    }
+
+    /* Task waited for again after a timeout. */
+    t = task_submit(NULL, slow_task, &arg);
+    assert(t);
+    rc = task_join(t, now() + 5);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    go(delayed_send(ch, 8, now() + 5));
+    choose {
+    taskdone(t, res):
+        (void) res;
+        assert(0);
+    in(ch, int, val):
+        assert(val == 8);
+    end
+    }
+    rc = task_join(t, -1);
+    assert(rc == 42);
+
+    /* Task finished before choosing and the error it reported. */
+    t = task_submit(NULL, failing_task, NULL);
+    assert(t);
+    mill_sleep(now() + 30);
+    choose {
+    taskdone(t, res):
+        assert(res == -1 && errno == ENOENT);
+    otherwise:
+        assert(0);
+    end
+    }
+
+    /* The task still running doesn't hold up mill_waitall(). */
+    go(impatient_join(&arg, &t));
+    rc = mill_waitall(-1);
+    assert(rc == 0);
+    rc = task_join(t, -1);
+    assert(rc == 42);
+
+    chclose(ch);
+    mill_fini();
+    return 0;
+}
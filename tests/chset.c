@@ -0,0 +1,149 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libpill.h"
+
+#define NCHANS 100
+#define COUNT 100
+
+static coroutine void sender(chan ch, int val, int count) {
+    int i;
+    for(i = 0; i != count; ++i)
+        chs(ch, int, val);
+    chclose(ch);
+}
+
+static coroutine void delayed(chan ch, int val, int64_t deadline) {
+    mill_sleep(deadline);
+    chs(ch, int, val);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* Many senders blocked on unbuffered channels. */
+    chset s = chsetmake();
+    assert(s);
+    chan chs[NCHANS];
+    int counts[NCHANS] = {0};
+    int i;
+    for(i = 0; i != NCHANS; ++i) {
+        chs[i] = chmake(int, 0);
+        assert(chs[i]);
+        int rc = chsetadd(s, chs[i], i);
+        assert(rc == 0);
+        go(sender(chdup(chs[i]), i * 10, COUNT));
+    }
+    int rc = chsetadd(s, chs[0], 0);
+    assert(rc == -1 && errno == EBUSY);
+    int total;
+    for(total = 0; total != NCHANS * COUNT; ++total) {
+        int val;
+        int idx = chsetwait(s, &val, -1);
+        assert(idx >= 0 && idx < NCHANS);
+        assert(val == idx * 10);
+        ++counts[idx];
+    }
+    for(i = 0; i != NCHANS; ++i)
+        assert(counts[i] == COUNT);
+
+    /* Nothing to receive. */
+    int val;
+    int64_t deadline = now() + 30;
+    rc = chsetwait(s, &val, deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now() >= deadline);
+
+    /* A value arriving while the set is waiting. */
+    go(delayed(chs[42], 7, now() + 30));
+    rc = chsetwait(s, &val, now() + 1000);
+    assert(rc == 42 && val == 7);
+
+    /* Buffered channels and values sent before the channel was added.
+       The channels with more values available don't starve the others. */
+    chan b1 = chmake(int, 8);
+    chan b2 = chmake(int, 8);
+    for(i = 0; i != 4; ++i) {
+        chs(b1, int, 1);
+        chs(b2, int, 2);
+    }
+    chs(b1, int, 1);
+    rc = chsetadd(s, b1, 1000);
+    assert(rc == 0);
+    rc = chsetadd(s, b2, 2000);
+    assert(rc == 0);
+    for(i = 0; i != 8; ++i) {
+        rc = chsetwait(s, &val, -1);
+        assert(rc == (i % 2 ? 2000 : 1000));
+        assert(val == rc / 1000);
+    }
+    rc = chsetwait(s, &val, -1);
+    assert(rc == 1000 && val == 1);
+
+    /* Done-with channel stays readable. */
+    chdone(b2, int, -1);
+    for(i = 0; i != 3; ++i) {
+        rc = chsetwait(s, &val, -1);
+        assert(rc == 2000 && val == -1);
+    }
+    rc = chsetrm(s, b2);
+    assert(rc == 0);
+    rc = chsetrm(s, b2);
+    assert(rc == -1 && errno == ENOENT);
+    rc = chsetwait(s, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* Channels receiving outside of the set. */
+    chs(b1, int, 5);
+    rc = chr(b1, int);
+    assert(rc == 5);
+    rc = chsetwait(s, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* A deallocated channel leaves the set. */
+    chs(b1, int, 3);
+    chclose(b1);
+    rc = chsetwait(s, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* Cross-thread channels can't be added. */
+    xchan xch = xchmake(int, 4);
+    chan xc = mill_xchattach(xch);
+    rc = chsetadd(s, xc, 1);
+    assert(rc == -1 && errno == ENOTSUP);
+    chclose(xc);
+    mill_xchclose(xch);
+
+    for(i = 0; i != NCHANS; ++i)
+        chclose(chs[i]);
+    chclose(b2);
+    rc = chsetclose(s);
+    assert(rc == 0);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../libpill.h"
+
+static coroutine void sender(chan ch, int val) {
+    chs(ch, int, val);
+}
+
+static coroutine void receiver(chan ch) {
+    chr(ch, int);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    chan ch = chmake(int, 4);
+    struct mill_chstats st;
+    int rc = chstats(ch, &st, 0);
+    assert(rc == -1 && errno == ENOENT);
+    chan chs[4];
+    rc = chlist(chs, 4);
+    assert(rc == 0);
+
+    rc = chname(ch, "buffered");
+    assert(rc == 0);
+    chan unb = chmake(int, 0);
+    rc = chname(unb, "unbuffered");
+    assert(rc == 0);
+    rc = chlist(chs, 1);
+    assert(rc == 2 && chs[0] == ch);
+    rc = chlist(chs, 4);
+    assert(rc == 2 && chs[0] == ch && chs[1] == unb);
+
+    /* The buffer holds two values for 20 ms. */
+    chs(ch, int, 1);
+    chs(ch, int, 2);
+    rc = chstats(ch, &st, 1);
+    assert(rc == 0);
+    assert(strcmp(st.name, "buffered") == 0);
+    assert(st.sent == 2 && st.received == 0 && st.items == 2);
+    mill_sleep(now() + 20);
+    chr(ch, int);
+    chr(ch, int);
+    rc = chstats(ch, &st, 0);
+    assert(rc == 0);
+    assert(st.sent == 0 && st.received == 2 && st.items == 0);
+    assert(st.elapsed >= 20000000);
+    assert(st.occupancy > 1.5 && st.occupancy <= 2.0);
+
+    /* Senders blocked on the full buffer. */
+    int vals[4] = {0, 1, 2, 3};
+    rc = chs_many(ch, vals, 4);
+    assert(rc == 4);
+    int i;
+    for(i = 0; i != 3; ++i)
+        go(sender(ch, i));
+    yield();
+    rc = chstats(ch, &st, 0);
+    assert(rc == 0);
+    assert(st.senders == 3 && st.maxsenders == 3 && st.sendblocks == 3);
+    int out[8];
+    rc = chtryrecv(ch, out, 8);
+    assert(rc == 7);
+    rc = chstats(ch, &st, 0);
+    assert(rc == 0);
+    assert(st.sent == 7 && st.received == 9 && st.senders == 0);
+
+    /* Receivers blocked on the unbuffered channel, served directly. */
+    for(i = 0; i != 5; ++i)
+        go(receiver(unb));
+    yield();
+    for(i = 0; i != 5; ++i)
+        chs(unb, int, i);
+    rc = chstats(unb, &st, 0);
+    assert(rc == 0);
+    assert(st.sent == 5 && st.received == 5);
+    assert(st.recvblocks == 5 && st.maxreceivers == 5);
+    assert(st.receivers == 0 && st.sendblocks == 0);
+    assert(st.occupancy == 0);
+
+    /* Renaming keeps the statistics, closing unregisters. */
+    rc = chname(unb, "renamed");
+    assert(rc == 0);
+    rc = chstats(unb, &st, 0);
+    assert(rc == 0);
+    assert(strcmp(st.name, "renamed") == 0 && st.sent == 5);
+    chclose(ch);
+    rc = chlist(chs, 4);
+    assert(rc == 1 && chs[0] == unb);
+    chclose(unb);
+    rc = chlist(chs, 4);
+    assert(rc == 0);
+
+    mill_fini();
+    return 0;
+}
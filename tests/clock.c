@@ -0,0 +1,66 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "../libpill.h"
+
+int main() {
+    mill_init(-1, 0);
+
+    /* The clock never goes back. */
+    int64_t last = now();
+    int i;
+    for(i = 0; i != 1000000; ++i) {
+        int64_t nw = now();
+        assert(nw >= last);
+        last = nw;
+    }
+
+    /* The cached time doesn't get ahead of the clock. */
+    assert(now_cached() <= now());
+
+    /* Once a deadline expires, the cached time has got past it. */
+    for(i = 0; i != 10; ++i) {
+        int64_t deadline = now() + 10;
+        mill_sleep(deadline);
+        assert(now_cached() >= deadline);
+        assert(now() >= deadline);
+        assert(now() - deadline < 20);
+    }
+
+    /* The time passes without the scheduler, the cached time lags. */
+    int64_t cached = now_cached();
+    int64_t start = now();
+    while(now() - start < 30)
+        ;
+    assert(now_cached() == cached);
+    yield();
+    mill_sleep(now() + 1);
+    assert(now_cached() - start >= 30);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "../libpill.h"
+
+static volatile int counter = 0;
+
+static int incr(void *arg) {
+    yield();
+    __sync_add_and_fetch(&counter, 1);
+    return 0;
+}
+
+static int echo(void *arg) {
+    long val = (long) arg;
+    if(val < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    mill_sleep(now() + 1);
+    return (int) val;
+}
+
+coroutine void caller(mill_sched s, int base, chan done) {
+    int i;
+    for(i = 0; i != 100; ++i) {
+        int rc = mill_sched_run(s, echo, (void*)(long)(base + i));
+        assert(rc == base + i);
+    }
+    chs(done, int, 0);
+}
+
+int main() {
+    mill_init(-1, 0);
+    mill_sched s = mill_sched_create(4, -1);
+    assert(s);
+
+    /* Fire-and-forget coroutines. */
+    int i;
+    for(i = 0; i != 10000; ++i) {
+        int rc = mill_sched_go(s, incr, NULL);
+        assert(rc == 0);
+    }
+
+    /* Synchronous calls, errno is passed back to the caller. */
+    int rc = mill_sched_run(s, echo, (void*) 42);
+    assert(rc == 42);
+    rc = mill_sched_run(s, echo, (void*) -1);
+    assert(rc == -1 && errno == EINVAL);
+
+    /* Multiple coroutines waiting for the results at the same time. */
+    chan done = chmake(int, 0);
+    for(i = 0; i != 10; ++i)
+        go(caller(s, i * 1000, done));
+    for(i = 0; i != 10; ++i)
+        chr(done, int);
+    chclose(done);
+
+    /* Deleting the scheduler waits for the queued work. */
+    mill_sched_delete(s);
+    assert(counter == 10000);
+
+    mill_fini();
+    return 0;
+}
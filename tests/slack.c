@@ -0,0 +1,90 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "../libpill.h"
+
+#define COUNT 50
+#define SLACK 10000
+
+static int64_t woken[COUNT];
+
+coroutine static void sleeper(int i, int64_t deadline) {
+    mill_sleep_us(deadline);
+    woken[i] = now_us();
+}
+
+/* Sleepers with deadlines 1 ms apart, returns the number of distinct
+   times they were woken up at. */
+static int run(int64_t slack) {
+    int rc = mill_settimerslack(slack);
+    assert(rc == 0);
+    int64_t start = now_us();
+    int i;
+    for(i = 0; i != COUNT; ++i)
+        go(sleeper(i, start + 1000 + i * 1000));
+    mill_sleep_us(start + 1000 + COUNT * 1000 + slack + 5000);
+    int batches = 0;
+    int64_t last = -1;
+    for(i = 0; i != COUNT; ++i) {
+        int64_t deadline = start + 1000 + i * 1000;
+        /* Never early, late by the slack at most, give or take the odd
+           hiccup of the machine. */
+        assert(woken[i] >= deadline);
+        assert(woken[i] - deadline < slack + 50000);
+        /* The ones woken up together were resumed one after another. */
+        if(woken[i] - last > 200)
+            ++batches;
+        last = woken[i];
+    }
+    return batches;
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    int rc = mill_settimerslack(-1);
+    assert(rc == -1 && errno == EINVAL);
+
+    /* No slack, each timer needs a wakeup of its own. */
+    int batches = run(0);
+    assert(batches > COUNT / 4);
+
+    /* The 50 ms worth of timers fire in about 5 batches. */
+    batches = run(SLACK);
+    assert(batches <= 7);
+
+    /* The wheel coalesces the same way. */
+    mill_fini();
+    mill_settimers(MILL_TIMERS_WHEEL);
+    mill_init(-1, 0);
+    batches = run(SLACK);
+    assert(batches <= 7);
+
+    mill_fini();
+    return 0;
+}
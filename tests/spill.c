@@ -0,0 +1,204 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define MILL_CHOOSE
+#include "../libpill.h"
+
+#define BURST 100000
+
+static coroutine void receiver(chan ch, chan result) {
+    int expected = 0;
+    while(1) {
+        int val = chr(ch, int);
+        if(val < 0)
+            break;
+        assert(val == expected);
+        ++expected;
+    }
+    chs(result, int, expected);
+    chclose(result);
+    chclose(ch);
+}
+
+static coroutine void producer(chan ch, int count) {
+    int i;
+    for(i = 0; i != count; ++i)
+        chs(ch, int, i);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mill-spill-%d", (int)getpid());
+
+    /* Only unbounded channels can spill. */
+    chan ch = chmake(int, 10);
+    int rc = chspill(ch, path, 8192);
+    assert(rc == -1 && errno == EINVAL);
+    chclose(ch);
+
+    /* A burst goes mostly to the file. */
+    ch = chmake(int, MILL_UNBOUNDED);
+    rc = chspill(ch, path, 8192);
+    assert(rc == 0);
+    rc = access(path, F_OK);
+    assert(rc == -1);
+    rc = chspill(ch, path, 8192);
+    assert(rc == -1 && errno == EINVAL);
+    rc = chname(ch, "spill");
+    assert(rc == 0);
+    int i;
+    for(i = 0; i != BURST; ++i) {
+        rc = chsd(ch, &i, 0);
+        assert(rc == 0);
+    }
+    struct mill_chstats st;
+    rc = chstats(ch, &st, 0);
+    assert(rc == 0);
+    assert(st.sent == BURST);
+    assert(st.items < 8192 / sizeof(int));
+    for(i = 0; i != BURST; ++i)
+        assert(chr(ch, int) == i);
+    int val;
+    rc = chrd(ch, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* Blocked receiver, interleaved with the sender. */
+    chan result = chmake(int, 0);
+    go(receiver(chdup(ch), chdup(result)));
+    for(i = 0; i != BURST; ++i) {
+        chs(ch, int, i);
+        if(i % 1000 == 0)
+            yield();
+    }
+    chs(ch, int, -1);
+    assert(chr(result, int) == BURST);
+    chclose(result);
+
+    /* Batch operations. */
+    int vals[5000];
+    for(i = 0; i != 5000; ++i)
+        vals[i] = i;
+    for(i = 0; i != 10; ++i) {
+        rc = chs_many(ch, vals, 5000);
+        assert(rc == 5000);
+    }
+    int out[3000];
+    int total = 0;
+    while(total != 50000) {
+        rc = chr_many(ch, out, 3000, -1);
+        assert(rc > 0);
+        int j;
+        for(j = 0; j != rc; ++j)
+            assert(out[j] == (total + j) % 5000);
+        total += rc;
+    }
+
+    /* The receivers waiting in choose get the values read back. */
+    for(i = 0; i != BURST; ++i)
+        chs(ch, int, i);
+    for(i = 0; i != BURST; ++i) {
+        choose {
+        in(ch, int, v):
+            assert(v == i);
+        deadline(now() + 1000):
+            assert(0);
+        end
+        }
+    }
+
+    /* Done-with value follows the spilled ones. */
+    for(i = 0; i != BURST; ++i)
+        chs(ch, int, i);
+    chdone(ch, int, -1);
+    rc = chsd(ch, &val, -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = mill_chdone(ch, &val);
+    assert(rc == -1 && errno == EPIPE);
+    for(i = 0; i != BURST; ++i)
+        assert(chr(ch, int) == i);
+    assert(chr(ch, int) == -1);
+    assert(chr(ch, int) == -1);
+    assert(chspillerr(ch) == 0);
+    chclose(ch);
+
+    /* mill_waitall() waits for the file to be written. */
+    ch = chmake(int, MILL_UNBOUNDED);
+    rc = chspill(ch, path, 16384);
+    assert(rc == 0);
+    go(producer(ch, 2 * BURST));
+    rc = mill_waitall(-1);
+    assert(rc == 0);
+    for(i = 0; i != 2 * BURST; ++i)
+        assert(chr(ch, int) == i);
+    chclose(ch);
+
+    /* The file can't grow, the values stay in memory. */
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit rl, oldrl;
+    rc = getrlimit(RLIMIT_FSIZE, &oldrl);
+    assert(rc == 0);
+    rl = oldrl;
+    rl.rlim_cur = 65536;
+    rc = setrlimit(RLIMIT_FSIZE, &rl);
+    assert(rc == 0);
+    ch = chmake(int, MILL_UNBOUNDED);
+    rc = chspill(ch, path, 8192);
+    assert(rc == 0);
+    for(i = 0; i != BURST; ++i)
+        chs(ch, int, i);
+    mill_sleep(now() + 50);
+    assert(chspillerr(ch) != 0);
+    for(i = 0; i != BURST; ++i)
+        assert(chr(ch, int) == i);
+    rc = chrd(ch, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    for(i = 0; i != BURST; ++i)
+        chs(ch, int, i);
+    for(i = 0; i != BURST; ++i)
+        assert(chr(ch, int) == i);
+    chclose(ch);
+    rc = setrlimit(RLIMIT_FSIZE, &oldrl);
+    assert(rc == 0);
+
+    /* Closing the channel drops the values still spilled. */
+    ch = chmake(int, MILL_UNBOUNDED);
+    rc = chspill(ch, path, 0);
+    assert(rc == 0);
+    for(i = 0; i != BURST; ++i)
+        chs(ch, int, i);
+    chclose(ch);
+    mill_sleep(now() + 50);
+
+    mill_fini();
+    return 0;
+}
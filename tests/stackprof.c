@@ -0,0 +1,82 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libpill.h"
+
+static coroutine void shallow(void) {
+}
+
+static coroutine void deep(void) {
+    volatile char buf[20000];
+    int i;
+    for(i = 0; i != sizeof(buf); ++i)
+        buf[i] = 0;
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    struct mill_stackprof sites[4];
+    int rc = mill_stackprof(sites, 4);
+    if(rc == -1) {
+        /* Built without --enable-stackprof. */
+        assert(errno == ENOTSUP);
+        mill_fini();
+        return 0;
+    }
+    assert(rc == 0);
+
+    int i;
+    for(i = 0; i != 3; ++i) {
+        go(shallow());
+        go(deep());
+        gostack(deep(), MILL_STACK_64K);
+    }
+    mill_waitall(-1);
+
+    rc = mill_stackprof(sites, 4);
+    assert(rc == 3);
+    int ndeep = 0;
+    for(i = 0; i != rc; ++i) {
+        assert(sites[i].count == 3);
+        assert(sites[i].max_depth <= sites[i].stack_size);
+        assert(sites[i].avg_depth <= sites[i].max_depth);
+        if(sites[i].max_depth >= 20000) {
+            ++ndeep;
+            continue;
+        }
+        assert(sites[i].max_depth < 4096);
+    }
+    assert(ndeep == 2);
+
+    /* Only the requested number of sites is filled in. */
+    rc = mill_stackprof(sites, 1);
+    assert(rc == 3);
+
+    mill_fini();
+    return 0;
+}
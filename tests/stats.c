@@ -0,0 +1,86 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libpill.h"
+
+static coroutine void worker(chan ch) {
+    int i;
+    for(i = 0; i != 100; ++i)
+        yield();
+    mill_sleep(now() + 10);
+    struct mill_crstats cs;
+    int rc = mill_crstats(&cs);
+    assert(rc == 0);
+    assert(cs.switches == 101);
+    assert(cs.blocked >= 10000000);
+    chs(ch, int, 0);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    struct mill_crstats cs;
+    int rc = mill_crstats(&cs);
+    if(rc == -1) {
+        /* Built without --enable-stats. */
+        assert(errno == ENOTSUP);
+        mill_fini();
+        return 0;
+    }
+
+    struct mill_schedstats ss;
+    rc = mill_schedstats(&ss, 1);
+    assert(rc == 0);
+
+    chan ch = chmake(int, 0);
+    go(worker(ch));
+    chr(ch, int);
+    chclose(ch);
+
+    rc = mill_crstats(&cs);
+    assert(rc == 0);
+    assert(cs.blocked >= 10000000);
+    assert(cs.running > 0);
+
+    rc = mill_schedstats(&ss, 1);
+    assert(rc == 0);
+    uint64_t nrunning = 0, nready = 0;
+    int i;
+    for(i = 0; i != MILL_STATS_BUCKETS; ++i) {
+        nrunning += ss.running[i];
+        nready += ss.ready[i];
+    }
+    assert(nrunning == ss.switches);
+    assert(nready >= 100);
+
+    rc = mill_schedstats(&ss, 0);
+    assert(rc == 0);
+    assert(ss.switches <= 1);
+
+    mill_fini();
+    return 0;
+}
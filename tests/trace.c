@@ -0,0 +1,133 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libpill.h"
+#include "../trace.h"
+
+static struct mill_trace_hdr hdr;
+static struct mill_trace_rec recs[1024];
+
+coroutine static void sleeper(void) {
+    mill_sleep(now() + 5);
+}
+
+/* Writes the trace to a file and reads it back into hdr and recs. */
+static void load(void) {
+    FILE *f = tmpfile();
+    assert(f);
+    int rc = mill_trace_write(fileno(f));
+    assert(rc == 0);
+    rewind(f);
+    size_t n = fread(&hdr, sizeof(hdr), 1, f);
+    assert(n == 1);
+    assert(memcmp(hdr.magic, MILL_TRACE_MAGIC, sizeof(hdr.magic)) == 0);
+    assert(hdr.version == 1);
+    assert(hdr.count <= 1024);
+    n = fread(recs, sizeof(struct mill_trace_rec), 1024, f);
+    assert(n == hdr.count);
+    fclose(f);
+}
+
+/* Index of the first record of the coroutine with the event at or after
+   'from', -1 if there's none. */
+static int find(int from, uint32_t cr, int ev) {
+    int i;
+    for(i = from; i < (int)hdr.count; ++i) {
+        if(recs[i].cr == cr && mill_trace_event(recs[i].ev) == ev)
+            return i;
+    }
+    return -1;
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    int rc = mill_trace_start(1024);
+    if(rc == -1 && errno == ENOTSUP) {
+        /* Built without --enable-trace. */
+        rc = mill_trace_write(1);
+        assert(rc == -1 && errno == ENOTSUP);
+        mill_fini();
+        return 0;
+    }
+    assert(rc == 0);
+
+    go(sleeper());
+    mill_sleep(now() + 20);
+    load();
+    assert(hdr.dropped == 0);
+    assert(hdr.ns1 >= hdr.ns0 && hdr.tsc1 >= hdr.tsc0);
+    int i;
+    for(i = 1; i < (int)hdr.count; ++i)
+        assert(recs[i].tsc >= recs[i - 1].tsc);
+
+    /* The main coroutine (0) launched the sleeper. */
+    for(i = 0; i < (int)hdr.count; ++i) {
+        if(mill_trace_event(recs[i].ev) == MILL_TRACE_GO)
+            break;
+    }
+    assert(i < (int)hdr.count && mill_trace_arg(recs[i].ev) == 0);
+    uint32_t cr = recs[i].cr;
+    assert(cr != 0);
+
+    /* The life of the sleeper, in order. */
+    i = find(i, cr, MILL_TRACE_FDWAIT);
+    assert(i > 0 && mill_trace_arg(recs[i].ev) == 0xffffff);
+    i = find(i, cr, MILL_TRACE_SUSPEND);
+    assert(i > 0);
+    /* The thread blocks till the timer expires. */
+    int idle = find(i, 0, MILL_TRACE_IDLE);
+    assert(idle > i);
+    int wake = find(idle, 0, MILL_TRACE_WAKE);
+    assert(wake > idle);
+    i = find(idle, cr, MILL_TRACE_READY);
+    assert(i > idle);
+    i = find(wake, cr, MILL_TRACE_RUN);
+    assert(i > wake);
+    i = find(i, cr, MILL_TRACE_EXIT);
+    assert(i > 0);
+
+    /* Once the ring is full, the oldest records are dropped. */
+    rc = mill_trace_start(4);
+    assert(rc == 0);
+    for(i = 0; i != 10; ++i)
+        yield();
+    load();
+    assert(hdr.count == 4 && hdr.dropped > 0);
+
+    mill_trace_stop();
+    rc = mill_trace_write(1);
+    assert(rc == -1 && errno == EINVAL);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#define MILL_CHOOSE
+#include "../libpill.h"
+
+#define BURST 1000000
+
+struct big {
+    char data[10000];
+};
+
+static coroutine void receiver(chan ch, chan result) {
+    int expected = 0;
+    while(1) {
+        int val = chr(ch, int);
+        if(val < 0)
+            break;
+        assert(val == expected);
+        ++expected;
+    }
+    chs(result, int, expected);
+    chclose(result);
+    chclose(ch);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* A burst is absorbed without blocking the sender. */
+    chan ch = chmake(int, MILL_UNBOUNDED);
+    assert(ch);
+    int i;
+    for(i = 0; i != BURST; ++i) {
+        int rc = chsd(ch, &i, 0);
+        assert(rc == 0);
+    }
+    for(i = 0; i != BURST; ++i)
+        assert(chr(ch, int) == i);
+    int val;
+    int rc = chrd(ch, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* Blocked receiver, interleaved with the sender. */
+    chan result = chmake(int, 0);
+    go(receiver(chdup(ch), chdup(result)));
+    for(i = 0; i != 10000; ++i) {
+        chs(ch, int, i);
+        if(i % 7 == 0)
+            yield();
+    }
+    chs(ch, int, -1);
+    assert(chr(result, int) == 10000);
+    chclose(result);
+
+    /* Batch operations across the segment boundaries. */
+    int vals[5000];
+    for(i = 0; i != 5000; ++i)
+        vals[i] = i;
+    for(i = 0; i != 10; ++i) {
+        rc = chs_many(ch, vals, 5000);
+        assert(rc == 5000);
+    }
+    int out[3000];
+    int total = 0;
+    while(total != 50000) {
+        rc = chtryrecv(ch, out, 3000);
+        assert(rc > 0);
+        int j;
+        for(j = 0; j != rc; ++j)
+            assert(out[j] == (total + j) % 5000);
+        total += rc;
+    }
+    rc = chtryrecv(ch, out, 3000);
+    assert(rc == 0);
+
+    /* The out clause is always available. */
+    choose {
+    out(ch, int, 42):
+    deadline(now() + 10):
+        assert(0);
+    end
+    }
+    choose {
+    in(ch, int, v):
+        assert(v == 42);
+    otherwise:
+        assert(0);
+    end
+    }
+
+    /* Done-with value follows the buffered ones. */
+    chs(ch, int, 1);
+    chs(ch, int, 2);
+    chdone(ch, int, -1);
+    assert(chr(ch, int) == 1);
+    assert(chr(ch, int) == 2);
+    assert(chr(ch, int) == -1);
+    assert(chr(ch, int) == -1);
+    rc = chsd(ch, &val, -1);
+    assert(rc == -1 && errno == EPIPE);
+    chclose(ch);
+
+    /* Values larger than a segment. */
+    chan bch = chmake(struct big, MILL_UNBOUNDED);
+    static struct big b;
+    for(i = 0; i != 10; ++i) {
+        memset(b.data, i, sizeof(b.data));
+        rc = chsd(bch, &b, -1);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 10; ++i) {
+        chrecv(bch, &b);
+        assert(b.data[0] == i && b.data[sizeof(b.data) - 1] == i);
+    }
+    /* Closing the channel frees the segments still in use. */
+    rc = chsd(bch, &b, -1);
+    assert(rc == 0);
+    chclose(bch);
+
+    mill_fini();
+    return 0;
+}
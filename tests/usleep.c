@@ -0,0 +1,105 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../libpill.h"
+
+#define COUNT 100
+
+static int64_t woken[3];
+
+coroutine static void sleeper(int i, int64_t deadline) {
+    mill_sleep_us(deadline);
+    woken[i] = now_us();
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* Both clocks are the same. */
+    int64_t ms = now();
+    int64_t us = now_us();
+    assert(us / 1000 >= ms && us / 1000 - ms < 5);
+
+    /* Sub-millisecond sleeps don't get rounded up to a millisecond. */
+    int64_t late = 0;
+    int i;
+    for(i = 0; i != COUNT; ++i) {
+        int64_t deadline = now_us() + 200;
+        mill_sleep_us(deadline);
+        int64_t diff = now_us() - deadline;
+        assert(diff >= 0);
+        late += diff;
+    }
+#if defined HAVE_EPOLL_PWAIT2 || defined HAVE_PPOLL
+    assert(late / COUNT < 500);
+#endif
+
+    /* Timers a fraction of a millisecond apart fire in order. */
+    int64_t start = now_us();
+    go(sleeper(2, start + 900));
+    go(sleeper(0, start + 300));
+    go(sleeper(1, start + 600));
+    mill_sleep_us(start + 2000);
+    assert(woken[0] >= start + 300);
+    assert(woken[1] >= start + 600 && woken[1] >= woken[0]);
+    assert(woken[2] >= start + 900 && woken[2] >= woken[1]);
+
+    /* Millisecond and microsecond deadlines mix. */
+    start = now_us();
+    go(sleeper(0, start + 2500));
+    mill_sleep(start / 1000 + 1);
+    assert(woken[0] < start + 2500);
+    mill_sleep(start / 1000 + 3);
+    assert(woken[0] >= start + 2500);
+
+    /* A millisecond deadline of now() + N lasts N ms at least. */
+    for(i = 0; i != COUNT; ++i) {
+        start = now_us();
+        mill_sleep(now() + 1);
+        assert(now_us() - start >= 1000);
+    }
+
+    /* Waiting for a file descriptor times out precisely. */
+    int fds[2];
+    int rc = pipe(fds);
+    assert(rc == 0);
+    int64_t deadline = now_us() + 300;
+    rc = mill_fdevent_us(fds[0], FDW_IN, deadline);
+    assert(rc == 0);
+    assert(now_us() >= deadline);
+    rc = write(fds[1], "A", 1);
+    assert(rc == 1);
+    rc = mill_fdevent_us(fds[0], FDW_IN, now_us() + 300);
+    assert(rc == FDW_IN);
+    close(fds[0]);
+    close(fds[1]);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../libpill.h"
+
+#define COUNT 1000
+
+static int64_t woken[COUNT];
+
+coroutine static void delay(int n, chan ch) {
+    mill_sleep(now() + n);
+    chs(ch, int, n);
+}
+
+coroutine static void sleeper(int i, int64_t deadline) {
+    mill_sleep(deadline);
+    woken[i] = now();
+}
+
+coroutine static void waiter(chan ch, int64_t deadline, chan result) {
+    int val;
+    int rc = chrd(ch, &val, deadline);
+    chs(result, int, rc == 0 ? val : -1);
+}
+
+int main() {
+    mill_settimers(MILL_TIMERS_WHEEL);
+    mill_init(-1, 0);
+
+    /* Sleep. */
+    int64_t deadline = now() + 100;
+    mill_sleep(deadline);
+    int64_t diff = now() - deadline;
+    assert(diff >= 0 && diff < 20);
+
+    /* Sleep-sort, across the boundaries of the level 0 slots. */
+    chan ch = chmake(int, 0);
+    go(delay(300, ch));
+    go(delay(40, ch));
+    go(delay(10, ch));
+    go(delay(260, ch));
+    go(delay(0, ch));
+    assert(chr(ch, int) == 0);
+    assert(chr(ch, int) == 10);
+    assert(chr(ch, int) == 40);
+    assert(chr(ch, int) == 260);
+    assert(chr(ch, int) == 300);
+
+    /* Many timers, none fires early. */
+    int64_t deadlines[COUNT];
+    int64_t start = now();
+    int i;
+    for(i = 0; i != COUNT; ++i) {
+        deadlines[i] = start + random() % 600;
+        woken[i] = -1;
+        go(sleeper(i, deadlines[i]));
+    }
+    mill_sleep(start + 650);
+    for(i = 0; i != COUNT; ++i) {
+        assert(woken[i] >= deadlines[i]);
+        assert(woken[i] - deadlines[i] < 50);
+    }
+
+    /* Re-armed deadlines, far ones included, which end up in the upper
+       levels and in the overflow list. */
+    chan result = chmake(int, 0);
+    int64_t far[] = {100, 70000, 20000000, 5000000000LL, 50000000000LL};
+    for(i = 0; i != sizeof(far) / sizeof(far[0]); ++i) {
+        go(waiter(ch, now() + far[i], result));
+        yield();
+        chs(ch, int, i);
+        assert(chr(result, int) == i);
+    }
+    go(waiter(ch, now() + 30, result));
+    assert(chr(result, int) == -1);
+    int val;
+    int rc = chrd(ch, &val, now() + 20);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    chclose(result);
+    chclose(ch);
+
+    mill_fini();
+    return 0;
+}
@@ -0,0 +1,240 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#define MILL_CHOOSE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../libpill.h"
+
+#define COUNT 100000
+
+static coroutine void producer(chan ch, int first, int step) {
+    int i;
+    for(i = first; i < COUNT; i += step)
+        chs(ch, int, i);
+}
+
+/* Sends the numbers to the main thread from two coroutines, then waits
+   for the acknowledgment and closes the channel. */
+static void *worker(void *arg) {
+    xchan xch = arg;
+    mill_init(-1, 0);
+    chan ch = mill_xchattach(xch);
+    assert(ch);
+    go(producer(ch, 0, 2));
+    go(producer(ch, 1, 2));
+    mill_waitall(-1);
+    chdone(ch, int, -1);
+    chclose(ch);
+    mill_fini();
+    return NULL;
+}
+
+static void *echo(void *arg) {
+    xchan *xchs = arg;
+    mill_init(-1, 0);
+    chan in = mill_xchattach(xchs[0]);
+    chan out = mill_xchattach(xchs[1]);
+    while(1) {
+        int val = chr(in, int);
+        chs(out, int, val);
+        if(val < 0)
+            break;
+    }
+    chclose(out);
+    chclose(in);
+    mill_fini();
+    return NULL;
+}
+
+/* Sends till the channel is done with, returns the number of values
+   sent. */
+static void *stuffer(void *arg) {
+    xchan xch = arg;
+    mill_init(-1, 0);
+    chan ch = mill_xchattach(xch);
+    assert(ch);
+    int val = 0;
+    while(chsd(ch, &val, -1) == 0)
+        ++val;
+    assert(errno == EPIPE);
+    chclose(ch);
+    mill_fini();
+    return (void*)(intptr_t)val;
+}
+
+/* Marks the channel as done with while the main thread is blocked. */
+static void *finisher(void *arg) {
+    xchan xch = arg;
+    mill_init(-1, 0);
+    chan ch = mill_xchattach(xch);
+    assert(ch);
+    mill_sleep(now() + 20);
+    chdone(ch, int, -1);
+    chclose(ch);
+    mill_fini();
+    return NULL;
+}
+
+static coroutine void delayed_send(chan ch, int val, int64_t deadline) {
+    mill_sleep(deadline);
+    chs(ch, int, val);
+}
+
+int main() {
+    mill_init(-1, 0);
+
+    /* Many values from another thread, received through choose along with
+       an ordinary channel. */
+    xchan xch = xchmake(int, 64);
+    assert(xch);
+    chan ch = mill_xchattach(xch);
+    assert(ch);
+    chan local = chmake(int, 0);
+    pthread_t th;
+    int rc = pthread_create(&th, NULL, worker, xch);
+    assert(rc == 0);
+    static char seen[COUNT];
+    long total = 0;
+    int done = 0;
+    while(!done) {
+        choose {
+        in(ch, int, val):
+            if(val == -1) {
+                done = 1;
+                break;
+            }
+            assert(val >= 0 && val < COUNT && !seen[val]);
+            seen[val] = 1;
+            ++total;
+        in(local, int, val):
+            (void) val;
+            assert(0);
+        end
+        }
+    }
+    assert(total == COUNT);
+    /* The done-with value is returned forever. */
+    assert(chr(ch, int) == -1);
+    rc = chsd(ch, &total, -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = pthread_join(th, NULL);
+    assert(rc == 0);
+    chclose(local);
+    chclose(ch);
+    mill_xchclose(xch);
+
+    /* Round trips, with the receivers blocked most of the time. */
+    xchan xchs[2] = {xchmake(int, 1), xchmake(int, 1)};
+    chan out = mill_xchattach(xchs[0]);
+    chan in = mill_xchattach(xchs[1]);
+    rc = pthread_create(&th, NULL, echo, xchs);
+    assert(rc == 0);
+    int i;
+    for(i = 0; i != 1000; ++i) {
+        chs(out, int, i);
+        assert(chr(in, int) == i);
+    }
+    int val;
+    rc = chrd(in, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    chs(out, int, -1);
+    assert(chr(in, int) == -1);
+    rc = pthread_join(th, NULL);
+    assert(rc == 0);
+    chclose(in);
+    chclose(out);
+    mill_xchclose(xchs[0]);
+    mill_xchclose(xchs[1]);
+
+    /* The sender blocked on the full ring fails once it's done with. */
+    xch = xchmake(int, 4);
+    ch = mill_xchattach(xch);
+    rc = pthread_create(&th, NULL, stuffer, xch);
+    assert(rc == 0);
+    mill_sleep(now() + 20);
+    chdone(ch, int, -1);
+    void *sent;
+    rc = pthread_join(th, &sent);
+    assert(rc == 0);
+    assert((intptr_t)sent >= 4);
+    for(i = 0; i != (int)(intptr_t)sent; ++i)
+        assert(chr(ch, int) == i);
+    assert(chr(ch, int) == -1);
+    chclose(ch);
+    mill_xchclose(xch);
+
+    /* The choose blocked sending to the full ring skips the clause once
+       it's done with, the other clauses keep working. */
+    for(i = 0; i != 5; ++i) {
+        xch = xchmake(int, 2);
+        ch = mill_xchattach(xch);
+        chs(ch, int, 0);
+        chs(ch, int, 1);
+        rc = pthread_create(&th, NULL, finisher, xch);
+        assert(rc == 0);
+        local = chmake(int, 0);
+        go(delayed_send(local, 5, now() + 50));
+        int64_t start = now();
+        choose {
+        in(local, int, v):
+            assert(v == 5);
+        out(ch, int, 2):
+            assert(0);
+        deadline(now() + 2000):
+            assert(0);
+        end
+        }
+        assert(now() - start < 1000);
+        rc = pthread_join(th, NULL);
+        assert(rc == 0);
+        assert(chr(ch, int) == 0);
+        assert(chr(ch, int) == 1);
+        assert(chr(ch, int) == -1);
+        chclose(local);
+        chclose(ch);
+        mill_xchclose(xch);
+    }
+
+    /* A ring of one element. */
+    xch = xchmake(int, 1);
+    ch = mill_xchattach(xch);
+    chs(ch, int, 0);
+    val = 1;
+    rc = chsd(ch, &val, now() + 10);
+    assert(rc == 0);
+    assert(chr(ch, int) == 0);
+    assert(chr(ch, int) == 1);
+    rc = chrd(ch, &val, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    chclose(ch);
+    mill_xchclose(xch);
+
+    mill_fini();
+    return 0;
+}
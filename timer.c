@@ -27,6 +27,11 @@
 #include <time.h>
 #include <string.h>
 
+#if defined MILL_TSC
+#include <cpuid.h>
+#include <pthread.h>
+#endif
+
 #if defined __APPLE__
 #include <mach/mach_time.h>
 static mach_timebase_info_data_t mill_mtid = {0};
@@ -37,124 +42,184 @@ static mach_timebase_info_data_t mill_mtid = {0};
 #include "timer.h"
 #include "utils.h"
 
-/* 1 millisecond expressed in CPU ticks. The value is chosen is such a way that
-   it works reasonably well for CPU frequencies above 500MHz. On significanly
-   slower machines you may wish to reconsider. */
-#define MILL_CLOCK_PRECISION 1000000
-
-/* Returns current time by querying the operating system. */
+/* Returns current time in microseconds by querying the operating system. */
 static int64_t mill_now(void) {
 #if defined __APPLE__
     if (mill_slow(!mill_mtid.denom))
         mach_timebase_info(&mill_mtid);
     uint64_t ticks = mach_absolute_time();
-    return (int64_t)(ticks * mill_mtid.numer / mill_mtid.denom / 1000000);
-#elif defined CLOCK_REALTIME
+    return (int64_t)(ticks * mill_mtid.numer / mill_mtid.denom / 1000);
+#elif defined CLOCK_MONOTONIC
     struct timespec ts;
-    int rc = clock_gettime(CLOCK_REALTIME, &ts);
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
     mill_assert (rc == 0);
-    return ((int64_t)ts.tv_sec) * 1000 + (((int64_t)ts.tv_nsec) / 1000000);
+    return ((int64_t)ts.tv_sec) * 1000000 + (((int64_t)ts.tv_nsec) / 1000);
 #else
     struct timeval tv;
     int rc = gettimeofday(&tv, NULL);
     mill_assert(rc == 0);
-    return ((int64_t)tv.tv_sec) * 1000 + (((int64_t)tv.tv_usec) / 1000);
+    return ((int64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
 #endif
 }
 
-int64_t now(void) {
-#if 0
-#if (defined __GNUC__ || defined __clang__) && \
-      (defined __i386__ || defined __x86_64__)
-    /* Get the timestamp counter. This is time since startup, expressed in CPU
-       cycles. Unlike gettimeofday() or similar function, it's extremely fast -
-       it takes only few CPU cycles to evaluate. */
-    uint32_t low;
-    uint32_t high;
-    __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
-    int64_t tsc = (int64_t)((uint64_t)high << 32 | low);
-    /* These global variables are used to hold the last seen timestamp counter
-       and last seen time measurement. We'll initilise them the first time
-       this function is called. */
-    static int64_t last_tsc = -1;
-    static int64_t last_now = -1;
-    if(mill_slow(last_tsc < 0)) {
-        last_tsc = tsc;
-        last_now = mill_now();
-    }   
-    /* If TSC haven't jumped back or progressed more than 1/2 ms, we can use
-       the cached time value. */
-    if(mill_fast(tsc - last_tsc <= (MILL_CLOCK_PRECISION / 2) &&
-          tsc >= last_tsc))
-        return last_now;
-    /* It's more than 1/2 ms since we've last measured the time.
-       We'll do a new measurement now. */
-    last_tsc = tsc;
-    last_now = mill_now();
-    return last_now;
-#else
-    return mill_now();
+#if defined MILL_TSC && (defined __GNUC__ || defined __clang__) && \
+      defined __x86_64__ && defined CLOCK_MONOTONIC
+#define MILL_HAVE_TSC
+
+/* 1 millisecond expressed in TSC ticks, 0 if the TSC can't be used. */
+static int64_t mill_tsc_ticks = 0;
+static pthread_once_t mill_tsc_once = PTHREAD_ONCE_INIT;
+
+/* The last seen timestamp counter and time measurement of the thread. */
+static __thread int64_t mill_last_tsc = 0;
+static __thread int64_t mill_last_now = -1;
+
+static int64_t mill_now_ns(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    mill_assert(rc == 0);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/* Measures the TSC against the system clock for a millisecond. Only
+   invariant TSC, which ticks at a constant rate in all power states, can
+   be relied on. */
+static void mill_tsc_calibrate(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+          !(edx & (1 << 8)))
+        return;
+    int64_t ns0 = mill_now_ns();
+    int64_t tsc0 = (int64_t)mill_rdtsc();
+    int64_t ns1;
+    do
+        ns1 = mill_now_ns();
+    while (ns1 - ns0 < 1000000);
+    int64_t tsc1 = (int64_t)mill_rdtsc();
+    if (tsc1 > tsc0)
+        mill_tsc_ticks = (tsc1 - tsc0) * 1000000 / (ns1 - ns0);
+}
 #endif
+
+int64_t now(void) {
+#if defined MILL_HAVE_TSC
+    if (mill_fast(mill_tsc_ticks)) {
+        /* If TSC haven't jumped back or progressed more than 1/2 ms, we can
+           use the cached time value. */
+        int64_t tsc = (int64_t)mill_rdtsc();
+        if (mill_fast(tsc - mill_last_tsc <= mill_tsc_ticks / 2 &&
+              tsc >= mill_last_tsc && mill_last_now >= 0))
+            return mill_last_now;
+        /* It's more than 1/2 ms since we've last measured the time.
+           We'll do a new measurement now. */
+        mill_last_tsc = tsc;
+        mill_last_now = mill_now() / 1000;
+        return mill_last_now;
+    }
 #endif
+    return mill_now() / 1000;
+}
+
+int64_t now_us(void) {
     return mill_now();
 }
 
-#define LEFT_CHILD(i) (2 * i + 1)
-#define RIGHT_CHILD(i) (2 * i + 2)
-#define PARENT(i) (i / 2)
+int64_t now_cached(void) {
+    return mill->now / 1000;
+}
 
-/* Initial size of the array. */
-#define MINHEAP_SIZE   1024
+void
+mill_clock_refresh(void) {
+    mill->now = mill_now();
+#if defined MILL_HAVE_TSC
+    /* The measurement is as good as any for now() to start from. */
+    if (mill_fast(mill_tsc_ticks)) {
+        mill_last_tsc = (int64_t)mill_rdtsc();
+        mill_last_now = mill->now / 1000;
+    }
+#endif
+}
 
-#define MILL_TIMER_CACHE_SIZE 256
+/* The timer implementation of the threads initialised from now on. */
+static int mill_timers_backend = MILL_TIMERS_HEAP;
 
-#define minheap_s mill_timers_s
-#define minheap_item_s mill_timer_item
+void
+mill_settimers(int backend) {
+    mill_timers_backend = backend;
+}
 
-#define ISLT(p1, p2) ((p1)->expiry < (p2)->expiry)
+/*
+ * 4-ary min-heap of the timers. The expiry is kept in the array alongside
+ * the pointer to the timer so that sifting doesn't have to touch the timers
+ * themselves, and the timer keeps its index in the array so that it can be
+ * removed or moved without a search. Compared to a binary heap, the tree
+ * is half as deep and the children of a node share a cache line.
+ */
+
+#define HEAP_ARITY 4
+#define PARENT(i) (((i) - 1) / HEAP_ARITY)
+#define FIRST_CHILD(i) (HEAP_ARITY * (i) + 1)
+
+/* Initial size of the array. */
+#define MINHEAP_SIZE   1024
 
 static int
-minheap_init(struct minheap_s *hp) {
+minheap_init(struct mill_timers_s *hp) {
     hp->size = MINHEAP_SIZE;
     hp->len = 0;
-    hp->items = mill_malloc(hp->size * sizeof (void *));
-    if (! hp->items)
-        goto er;
-    hp->cache = mill_malloc(MILL_TIMER_CACHE_SIZE * sizeof (void *));
-    if (!hp->cache) {
-        mill_free(hp->items);
-er:
+    hp->items = mill_malloc(hp->size * sizeof (struct mill_timer_entry));
+    if (! hp->items) {
         errno = ENOMEM;
         return -1;
     }
-    hp->items[0] = NULL;
-    hp->ncached = 0;
-    hp->ncanceled = 0;
     return 0;
 }
 
-static void
-minheap_clear(struct minheap_s *hp) {
-    while (hp->ncached) {
-        mill_free(hp->cache[--hp->ncached]);
-    }
-    mill_free(hp->cache);
-    mill_free(hp->items);
+static inline void
+minheap_place(struct mill_timers_s *hp, struct mill_timer_entry e, int i) {
+    hp->items[i] = e;
+    e.tm->index = i;
 }
 
 static void
-minheap_insert_item(struct minheap_item_s **items,
-            struct minheap_item_s *item, int i) {
+minheap_up(struct mill_timers_s *hp, struct mill_timer_entry e, int i) {
     while (i) {
         int j = PARENT(i);
-        if (! ISLT(item, items[j]))
+        if (hp->items[j].expiry <= e.expiry)
             break;
-        items[i] = items[j];
-        items[j]->index = i;
+        minheap_place(hp, hp->items[j], i);
         i = j;
     }
-    items[i] = item;
-    item->index = i;
+    minheap_place(hp, e, i);
+}
+
+static void
+minheap_down(struct mill_timers_s *hp, struct mill_timer_entry e, int i) {
+    while (1) {
+        int first = FIRST_CHILD(i);
+        if (first >= hp->len)
+            break;
+        int end = first + HEAP_ARITY < hp->len ? first + HEAP_ARITY : hp->len;
+        int min = first, j;
+        for (j = first + 1; j < end; j++) {
+            if (hp->items[j].expiry < hp->items[min].expiry)
+                min = j;
+        }
+        if (hp->items[min].expiry >= e.expiry)
+            break;
+        minheap_place(hp, hp->items[min], i);
+        i = min;
+    }
+    minheap_place(hp, e, i);
+}
+
+/* Puts the entry to position 'i', wherever it has to go from there. */
+static void
+minheap_fix(struct mill_timers_s *hp, struct mill_timer_entry e, int i) {
+    if (i && hp->items[PARENT(i)].expiry > e.expiry)
+        minheap_up(hp, e, i);
+    else
+        minheap_down(hp, e, i);
 }
 
 /*
@@ -162,235 +227,161 @@ minheap_insert_item(struct minheap_item_s **items,
  */
 
 static int
-minheap_insert(struct minheap_s *hp,
-            struct minheap_item_s *item) {
-    struct minheap_item_s **items = hp->items;
+minheap_insert(struct mill_timers_s *hp, struct mill_timer_item *tm) {
     if (hp->len == hp->size) {
-        hp->size *= 2;
-        items = mill_realloc(hp->items,
-                    hp->size * sizeof (struct minheap_item_s *));
+        struct mill_timer_entry *items = mill_realloc(hp->items,
+                    2 * hp->size * sizeof (struct mill_timer_entry));
         if (!items) {
             errno = ENOMEM;
             return -1;
         }
         hp->items = items;
+        hp->size *= 2;
     }
-    minheap_insert_item(items, item, hp->len);
-    hp->len++;
+    struct mill_timer_entry e = {tm->expiry, tm};
+    minheap_up(hp, e, hp->len++);
     return 0;
 }
 
-static void
-min_heapify(struct minheap_s *hp, unsigned i) {
-    int min_child;
-    int left = LEFT_CHILD(i), right = RIGHT_CHILD(i);
-
-    min_child = (left < hp->len
-                && ISLT(hp->items[left], hp->items[i])) ? left : i;
-    if (right < hp->len
-            && ISLT(hp->items[right], hp->items[min_child])
-    )
-        min_child = right;
-
-    if (min_child != i) {
-        /* swap i and min */
-        struct minheap_item_s *tmp = hp->items[i];
-        hp->items[i] = hp->items[min_child];
-        hp->items[min_child]->index = i;
-        hp->items[min_child] = tmp;
-        tmp->index = min_child;
-        min_heapify(hp, min_child);
-    }
-}
-
 /*
- *  Remove the root node, heapify and then return the removed node.
- *  Complexity is O(log n).
+ * Remove the item at position 'i'. Complexity is O(log n).
  */
 
-static void *
-minheap_remove(struct minheap_s *hp) {
-    void *item;
-    if (hp->len == 0)
-        return NULL;
-    item = hp->items[0];
-    if (--hp->len == 0) {
-        hp->items[0] = NULL;
-        return item;
-    }
-    hp->items[0] = hp->items[hp->len];
-    hp->items[hp->len]->index = 0;
-    if (hp->len > 1)
-        min_heapify(hp, 0);
-    return item;
-}
-
-/* Get a canceled timer */
-static struct mill_timer_item *
-mill_timer_get(struct minheap_s *hp) {
-ll2:
-    if (hp->ncached > 0) {
-        hp->ncanceled++;
-        return hp->cache[--hp->ncached];
-    }
-
-    if (hp->ncanceled >= MILL_TIMER_CACHE_SIZE) {
-        /* re-heap */
-        int k, len = 0;
-        struct minheap_item_s **items = mill_malloc(hp->size
-                            * sizeof (struct minheap_item_s *));
-        if (!items)
-            goto ll1;
-        for (k = 0; k < hp->len; k++) {
-            struct minheap_item_s *item = hp->items[k];
-            if (item->state == MILL_TIMER_CANCELED) {
-                if (hp->ncached == MILL_TIMER_CACHE_SIZE)
-                    mill_free(item);
-                else
-                    hp->cache[hp->ncached++] = item;
-            } else {
-                minheap_insert_item(items, item, len);
-                len++;
-            }
-        }
-        hp->len = len;
-        mill_free(hp->items);
-        hp->items = items;
-        hp->ncanceled = 0;
-        mill_assert(hp->ncached > 0);
-        goto ll2;
-    }
-ll1:;
-    void *ptr = mill_malloc(sizeof (struct mill_timer_item));
-    if (!ptr) {
-        errno = ENOMEM;
-        return NULL;
-    }
-    hp->ncanceled++;
-    return ptr;
-}
-
-/* Dispose a canceled timer */
 static void
-mill_timer_dispose(struct minheap_s *hp,
-            struct mill_timer_item *item) {
-    mill_assert(item);
-    if (hp->ncached < MILL_TIMER_CACHE_SIZE)
-        hp->cache[hp->ncached++] = item;
-    else
-        mill_free(item);
-    hp->ncanceled--;
+minheap_remove(struct mill_timers_s *hp, int i) {
+    mill_assert(i < hp->len);
+    struct mill_timer_entry last = hp->items[--hp->len];
+    if (i != hp->len)
+        minheap_fix(hp, last, i);
 }
 
 int
 mill_timers_init(void) {
+#if defined MILL_HAVE_TSC
+    pthread_once(&mill_tsc_once, mill_tsc_calibrate);
+#endif
+    mill_clock_refresh();
+    mill->timers.wheel = NULL;
+    mill->timers.slack = 0;
+    if (mill_timers_backend == MILL_TIMERS_WHEEL)
+        return mill_wheel_init(&mill->timers);
     return minheap_init(&mill->timers);
 }
 
 void
 mill_timers_fini(void) {
-#if 1
-    /* Should be only canceled timers ? */
-    mill_assert(mill->num_cr == 0);
-
-    while (mill->timers.len > 0) {
-        struct mill_timer_item *tm = minheap_remove(&mill->timers);
-        if (tm->state == MILL_TIMER_CANCELED)
-            mill_timer_dispose(&mill->timers, tm);
+    if (mill->timers.wheel) {
+        mill_wheel_fini(&mill->timers);
+        return;
     }
-#endif
-    minheap_clear(&mill->timers);
+    mill_free(mill->timers.items);
 }
 
 #define timer_first() \
-    ((struct mill_timer_item *) mill->timers.items[0])
+    (mill->timers.len ? mill->timers.items[0].tm : NULL)
 
-int
+static int64_t
+minheap_next(void) {
+    struct mill_timer_item *tm = timer_first();
+    if (! tm)
+        return -1;
+    int64_t timeout = tm->expiry - mill->now;
+    return timeout <= 0 ? 0 : timeout;
+}
+
+int64_t
 mill_timer_next(void) {
-    struct mill_timer_item *tm;
-    int timeout;
-    while ((tm = timer_first()) && (tm->state != MILL_TIMER_ARMED)) {
-        (void) minheap_remove(&mill->timers);
-        if (tm->state == MILL_TIMER_CANCELED)
-            mill_timer_dispose(&mill->timers, tm);
-        tm->state = 0;
-    }
-    if (! tm) {
-        mill_assert(mill->timers.len == 0);
+    int64_t timeout;
+    if (mill->timers.wheel)
+        timeout = mill_wheel_next(&mill->timers);
+    else
+        timeout = minheap_next();
+    int64_t slack = mill->timers.slack;
+    if (timeout <= 0 || slack == 0)
+        return timeout;
+    /* Wake up at the next multiple of the slack instead. The boundaries
+       are the same for all the timers, and all the threads. */
+    int64_t t = mill->now + timeout;
+    if (t > INT64_MAX - slack)
+        return timeout;
+    t = (t + slack - 1) / slack * slack;
+    return t - mill->now;
+}
+
+int
+mill_settimerslack(int64_t slack) {
+    if (slack < 0) {
+        errno = EINVAL;
         return -1;
     }
-    timeout = tm->expiry - now();
-    return timeout <= 0 ? 0 : timeout;
+    mill->timers.slack = slack;
+    return 0;
 }
 
 int
 mill_timer_fire(void) {
-    /* Avoid getting current time if there are no timers anyway. */
     if (mill->timers.len == 0)
         return 0;
+    if (mill->timers.wheel)
+        return mill_wheel_fire(&mill->timers);
     struct mill_timer_item *tm;
-    int64_t nw = now();
+    int64_t nw = mill->now;
     int fired = 0;
-    while ((tm = timer_first()) && nw >= tm->expiry) {
-        (void) minheap_remove(&mill->timers);
-        int state = tm->state;
+    while ((tm = timer_first()) && nw >= mill->timers.items[0].expiry) {
+        minheap_remove(&mill->timers, 0);
         tm->state = 0;
-        if (state == MILL_TIMER_CANCELED) {
-            mill_timer_dispose(&mill->timers, tm);
-            continue;
-        }
-        if (state == MILL_TIMER_ARMED) {
-            if (((struct mill_timer *)tm)->callback) {
-                struct mill_timer *timer = (struct mill_timer *) tm;
-                timer->callback(timer);
-            }
-            fired = 1;
+        if (((struct mill_timer *)tm)->callback) {
+            struct mill_timer *timer = (struct mill_timer *) tm;
+            timer->callback(timer);
         }
+        fired = 1;
     }
     return fired;
 }
 
-/* Replace the coroutine timer with a canceled timer.
- * Unlike the coroutine timer, this canceled timer can outlive the coroutine.  */
+/* Remove the timer from the heap, the coroutine owning it goes away. */
 void
 mill_timer_cancel(struct mill_timer *timer) {
-    int state = ((struct mill_timer_item *)timer)->state;
-    if (!state)
+    struct mill_timer_item *tm = (struct mill_timer_item *) timer;
+    if (!tm->state)
+        return;
+    if (mill->timers.wheel) {
+        mill_wheel_rm(&mill->timers, tm);
         return;
-    mill_assert(state == MILL_TIMER_DISARMED);
-    struct mill_timer_item *tm = mill_timer_get(&mill->timers);
-    if (!tm)
-        mill_panic(strerror(errno));
-    memcpy(tm, timer, sizeof (*tm));
-    tm->state = MILL_TIMER_CANCELED;
-    int i = tm->index;
-    mill_assert(mill->timers.items[i] == (struct mill_timer_item *) timer);
-    mill->timers.items[i] = tm;
-    ((struct mill_timer_item *)timer)->state = 0;
+    }
+    mill_assert(mill->timers.items[tm->index].tm == tm);
+    minheap_remove(&mill->timers, tm->index);
+    tm->state = 0;
 }
 
 int
 mill_timer_add(struct mill_timer *timer,
             int64_t deadline, mill_timer_callback callback) {
+    return mill_timer_add_us(timer, mill_mstous(deadline), callback);
+}
+
+int
+mill_timer_add_us(struct mill_timer *timer,
+            int64_t deadline, mill_timer_callback callback) {
     mill_assert(deadline >= 0);
     struct mill_timer_item *tm = (struct mill_timer_item *) timer;
-    if (tm->state == MILL_TIMER_DISARMED) {
-        if (tm->expiry == deadline) {
-            timer->callback = callback;
-            tm->state = MILL_TIMER_ARMED;
-            return 0;
+    timer->callback = callback;
+    timer->data = NULL;
+    if (mill->timers.wheel) {
+        mill_wheel_add(&mill->timers, tm, deadline);
+        return 0;
+    }
+    if (tm->state) {
+        /* Still armed, move it if the deadline changed. */
+        if (tm->expiry != deadline) {
+            struct mill_timer_entry e = {deadline, tm};
+            tm->expiry = deadline;
+            minheap_fix(&mill->timers, e, tm->index);
         }
-
-        /* Not using a fixed deadline for a session (e.g. resetting deadline
-         * everytime in a send/recv loop!)
-         */
-        mill_timer_cancel(timer);   /* FIXME -- here we can ignore OOM */
+        return 0;
     }
-
-    timer->callback = callback;
     tm->expiry = deadline;
-    timer->data = NULL;
-    int rc = minheap_insert(&mill->timers, (struct mill_timer_item *) tm);
+    int rc = minheap_insert(&mill->timers, tm);
     if (rc == -1) {
         /* Out of memory? Ignore. */
         mill_assert(errno == ENOMEM);
@@ -398,13 +389,10 @@ mill_timer_add(struct mill_timer *timer,
     }
     tm->state = MILL_TIMER_ARMED;
     return 0;
-
 }
 
+/* The timer leaves the heap straight away, re-arming inserts it again. */
 void
 mill_timer_rm(struct mill_timer *timer) {
-    struct mill_timer_item *tm = (struct mill_timer_item *) timer;
-    if (tm->state == MILL_TIMER_ARMED)
-        tm->state = MILL_TIMER_DISARMED;
+    mill_timer_cancel(timer);
 }
-
@@ -37,11 +37,19 @@ struct mill_timer_item {
     /* state == 0 when timer is not on the min-heap */
     int state;
 #define MILL_TIMER_ARMED     1
-#define MILL_TIMER_DISARMED  2
-#define MILL_TIMER_CANCELED  3
 
-    /* The deadline when the timer expires. */
+    /* The deadline when the timer expires, in microseconds. */
     int64_t expiry;
+
+    /* Member of a slot of the timing wheel, unused by the min-heap. */
+    struct mill_list_item item;
+};
+
+/* Element of the min-heap. */
+struct mill_timer_entry {
+    /* Copy of tm->expiry. */
+    int64_t expiry;
+    struct mill_timer_item *tm;
 };
 
 /* min-heap of timers */
@@ -53,14 +61,15 @@ struct mill_timers_s {
     int len;
 
     /* Array of timers */
-    struct mill_timer_item **items;
+    struct mill_timer_entry *items;
 
-    /* Cache for cancelled timer items */
-    struct mill_timer_item **cache;
-    int ncached;
+    /* The timing wheel used instead of the heap, NULL if none.
+       See wheel.c. */
+    struct mill_wheel_s *wheel;
 
-    /* Number of canceled timers on the heap */
-    int ncanceled;
+    /* Wakeups are delayed to a multiple of this many microseconds, so that
+       the timers expiring in between fire together. 0 if none. */
+    int64_t slack;
 };
 
 typedef void (*mill_timer_callback)(struct mill_timer *timer);
@@ -82,22 +91,52 @@ void mill_timers_fini(void);
 #define mill_timer_enabled(tm) \
     (((struct mill_timer_item *) tm)->state == MILL_TIMER_ARMED)
 
+/* Converts a deadline in milliseconds to microseconds. The deadline is
+   the end of the millisecond, the way it was with the millisecond clock,
+   so that now() + N lasts N ms at least. Negative stands for no deadline
+   and stays that way, the far future saturates. */
+static inline int64_t mill_mstous(int64_t deadline) {
+    if (deadline < 0)
+        return -1;
+    if (deadline > (INT64_MAX - 999) / 1000)
+        return INT64_MAX;
+    return deadline * 1000 + 999;
+}
+
 /* Add a timer for the running coroutine. */
 int mill_timer_add(struct mill_timer *timer, int64_t deadline,
     mill_timer_callback callback);
 
+/* Same as mill_timer_add() with the deadline in microseconds. */
+int mill_timer_add_us(struct mill_timer *timer, int64_t deadline,
+    mill_timer_callback callback);
+
 /* Disarm the timer associated with the running coroutine. */
 void mill_timer_rm(struct mill_timer *timer);
 
-/* Number of milliseconds till the next timer expires.
-   If there are no timers returns -1. */
-int mill_timer_next(void);
+/* Reads the clock into mill->now, the time (in microseconds) the timers
+   are compared to. */
+void mill_clock_refresh(void);
 
-/* Resumes all coroutines whose timers have already expired.
+/* Number of microseconds till the next timer expires, or till the slack
+   boundary after that. If there are no timers returns -1. */
+int64_t mill_timer_next(void);
+
+/* Resumes all coroutines whose timers expired by mill->now, so unless
+   called from mill_wait() the clock has to be refreshed beforehand.
    Returns zero if no coroutine was resumed, 1 otherwise. */
 int mill_timer_fire(void);
 
 void mill_timer_cancel(struct mill_timer *timer);
 
+/* The timing wheel counterparts of the functions above. */
+int mill_wheel_init(struct mill_timers_s *timers);
+void mill_wheel_fini(struct mill_timers_s *timers);
+void mill_wheel_add(struct mill_timers_s *timers,
+    struct mill_timer_item *tm, int64_t deadline);
+void mill_wheel_rm(struct mill_timers_s *timers, struct mill_timer_item *tm);
+int64_t mill_wheel_next(struct mill_timers_s *timers);
+int mill_wheel_fire(struct mill_timers_s *timers);
+
 #endif
 
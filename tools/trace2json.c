@@ -0,0 +1,199 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+/* Converts the traces written by mill_trace_write() to the JSON format
+   understood by chrome://tracing and Perfetto.
+
+   Each traced thread becomes a process and each coroutine a thread of it.
+   Time slices during which a coroutine was running are shown as complete
+   events; the remaining records are shown as instant events. The time
+   the thread spent blocked in the poller is shown in a separate lane. */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../trace.h"
+
+#define IDLE_LANE 4294967295u
+
+static const char *state_names[] = {
+    "none", "ready", "msleep", "fdwait", "chr", "chs", "choose", "dead"
+};
+
+static const char *event_names[] = {
+    "none", "go", "exit", "run", "suspend", "ready", "fdwait",
+    "task submit", "task done", "idle", "wake"
+};
+
+static int first_event = 1;
+
+static void emit(const char *fmt, ...) {
+    va_list ap;
+    printf(first_event ? "\n" : ",\n");
+    first_event = 0;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* Start of the current run of each coroutine, negative if not running. */
+static double *starts = NULL;
+static size_t nstarts = 0;
+
+static double *start_of(uint32_t cr) {
+    if(cr >= nstarts) {
+        size_t n = nstarts ? nstarts : 1024;
+        while(n <= cr)
+            n *= 2;
+        starts = realloc(starts, n * sizeof(double));
+        if(!starts) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        size_t i;
+        for(i = nstarts; i != n; ++i)
+            starts[i] = -1;
+        nstarts = n;
+    }
+    return &starts[cr];
+}
+
+static int convert(const char *fname) {
+    FILE *f = fopen(fname, "rb");
+    if(!f) {
+        perror(fname);
+        return -1;
+    }
+    struct mill_trace_hdr hdr;
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+          memcmp(hdr.magic, MILL_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+          hdr.version != 1) {
+        fprintf(stderr, "%s: not a trace file\n", fname);
+        fclose(f);
+        return -1;
+    }
+    if(hdr.dropped)
+        fprintf(stderr, "%s: %llu oldest records were overwritten\n", fname,
+            (unsigned long long) hdr.dropped);
+    double scale = hdr.tsc1 != hdr.tsc0 ?
+        (double)(hdr.ns1 - hdr.ns0) / (double)(hdr.tsc1 - hdr.tsc0) : 1.0;
+    unsigned pid = hdr.tid;
+    emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+        "\"args\":{\"name\":\"thread %u\"}}", pid, pid);
+    emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+        "\"args\":{\"name\":\"idle\"}}", pid, IDLE_LANE);
+
+    size_t i;
+    for(i = 0; i != nstarts; ++i)
+        starts[i] = -1;
+    double first = -1;
+    double idle = -1;
+    uint64_t n;
+    for(n = 0; n != hdr.count; ++n) {
+        struct mill_trace_rec rec;
+        if(fread(&rec, sizeof(rec), 1, f) != 1) {
+            fprintf(stderr, "%s: truncated\n", fname);
+            fclose(f);
+            return -1;
+        }
+        /* Microseconds since the start of the tracing. */
+        double ts = ((double)(int64_t)(rec.tsc - hdr.tsc0) * scale) / 1000;
+        if(first < 0)
+            first = ts;
+        unsigned ev = mill_trace_event(rec.ev);
+        unsigned arg = mill_trace_arg(rec.ev);
+        double *start;
+        switch(ev) {
+        case MILL_TRACE_RUN:
+            *start_of(rec.cr) = ts;
+            break;
+        case MILL_TRACE_GO:
+            *start_of(rec.cr) = ts;
+            emit("{\"name\":\"go\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,"
+                "\"tid\":%u,\"ts\":%.3f,\"args\":{\"parent\":%u}}",
+                pid, rec.cr, ts, arg);
+            break;
+        case MILL_TRACE_SUSPEND:
+        case MILL_TRACE_EXIT:
+            start = start_of(rec.cr);
+            /* The coroutine running when the tracing started. */
+            if(*start < 0)
+                *start = first;
+            emit("{\"name\":\"run\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"until\":\"%s\"}}",
+                pid, rec.cr, *start, ts - *start,
+                ev == MILL_TRACE_EXIT ? "exit" :
+                arg < sizeof(state_names) / sizeof(state_names[0]) ?
+                state_names[arg] : "?");
+            *start = -1;
+            break;
+        case MILL_TRACE_IDLE:
+            idle = ts;
+            break;
+        case MILL_TRACE_WAKE:
+            if(idle < 0)
+                idle = first;
+            emit("{\"name\":\"idle\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f}", pid, IDLE_LANE, idle, ts - idle);
+            idle = -1;
+            break;
+        case MILL_TRACE_FDWAIT:
+        case MILL_TRACE_TASK_SUBMIT:
+        case MILL_TRACE_TASK_DONE:
+            emit("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,"
+                "\"tid\":%u,\"ts\":%.3f,\"args\":{\"arg\":%d}}",
+                event_names[ev], pid, rec.cr, ts,
+                arg == 0xffffff ? -1 : (int) arg);
+            break;
+        case MILL_TRACE_READY:
+            emit("{\"name\":\"ready\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,"
+                "\"tid\":%u,\"ts\":%.3f}", pid, rec.cr, ts);
+            break;
+        default:
+            fprintf(stderr, "%s: unknown event %u\n", fname, ev);
+            break;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: trace2json <trace-file>... > trace.json\n");
+        return 1;
+    }
+    printf("{\"traceEvents\":[");
+    int i, rc = 0;
+    for(i = 1; i != argc; ++i) {
+        if(convert(argv[i]) == -1)
+            rc = 1;
+    }
+    printf("\n]}\n");
+    free(starts);
+    return rc;
+}
@@ -0,0 +1,158 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "cr.h"
+#include "libpill.h"
+#include "trace.h"
+#include "utils.h"
+
+#if defined MILL_TRACE
+
+static int64_t mill_trace_ns(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    mill_assert(rc == 0);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int mill_trace_start(size_t size) {
+    if(size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Round up to the power of two. */
+    size_t n = 1;
+    while(n < size)
+        n <<= 1;
+    struct mill_trace_s *tr = mill_malloc(sizeof(struct mill_trace_s));
+    if(!tr) {
+        errno = ENOMEM;
+        return -1;
+    }
+    tr->ring = mill_malloc(n * sizeof(struct mill_trace_rec));
+    if(!tr->ring) {
+        mill_free(tr);
+        errno = ENOMEM;
+        return -1;
+    }
+    tr->mask = n - 1;
+    tr->head = 0;
+    tr->ns0 = mill_trace_ns();
+    tr->tsc0 = mill_rdtsc();
+    mill_trace_stop();
+    mill->trace = tr;
+    return 0;
+}
+
+void mill_trace_stop(void) {
+    struct mill_trace_s *tr = mill->trace;
+    if(!tr)
+        return;
+    mill->trace = NULL;
+    mill_free(tr->ring);
+    mill_free(tr);
+}
+
+void mill_trace_fini(void) {
+    mill_trace_stop();
+}
+
+static int mill_trace_writeall(int fd, const void *buf, size_t len) {
+    const char *pos = buf;
+    while(len) {
+        ssize_t n = write(fd, pos, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int mill_trace_write(int fd) {
+    struct mill_trace_s *tr = mill->trace;
+    if(!tr) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* Don't let the records of this very call wrap the ring. */
+    mill->trace = NULL;
+    uint64_t size = tr->mask + 1;
+    uint64_t count = tr->head < size ? tr->head : size;
+    struct mill_trace_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MILL_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = 1;
+#if defined __linux__
+    hdr.tid = (uint32_t) syscall(SYS_gettid);
+#else
+    hdr.tid = (uint32_t) getpid();
+#endif
+    hdr.tsc0 = tr->tsc0;
+    hdr.ns0 = tr->ns0;
+    hdr.ns1 = mill_trace_ns();
+    hdr.tsc1 = mill_rdtsc();
+    hdr.count = count;
+    hdr.dropped = tr->head - count;
+    /* Oldest records first; the ring may have wrapped around. */
+    uint64_t first = (tr->head - count) & tr->mask;
+    uint64_t len1 = size - first < count ? size - first : count;
+    int rc = mill_trace_writeall(fd, &hdr, sizeof(hdr));
+    if(rc == 0)
+        rc = mill_trace_writeall(fd, &tr->ring[first],
+            len1 * sizeof(struct mill_trace_rec));
+    if(rc == 0)
+        rc = mill_trace_writeall(fd, &tr->ring[0],
+            (count - len1) * sizeof(struct mill_trace_rec));
+    mill->trace = tr;
+    return rc;
+}
+
+#else
+
+int mill_trace_start(size_t size) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+void mill_trace_stop(void) {
+}
+
+int mill_trace_write(int fd) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_TRACE_INCLUDED
+#define MILL_TRACE_INCLUDED
+
+#include <stdint.h>
+
+/* Trace file format. The file written by mill_trace_write() consists of
+   the header followed by 'count' records, oldest first. All the fields
+   are in the native byte order. Timestamps are in ticks of mill_rdtsc();
+   two (ticks, ns) pairs taken at the start of the tracing and at the time
+   of writing allow to convert them to nanoseconds. */
+
+#define MILL_TRACE_MAGIC "MILLTRC1"
+
+struct mill_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    /* Thread which recorded the trace. */
+    uint32_t tid;
+    uint64_t tsc0;
+    int64_t ns0;
+    uint64_t tsc1;
+    int64_t ns1;
+    uint64_t count;
+    /* Number of records overwritten because the ring was full. */
+    uint64_t dropped;
+};
+
+/* 'ev' holds the event type in the low 8 bits and the argument
+   in the upper 24 bits. */
+struct mill_trace_rec {
+    uint64_t tsc;
+    uint32_t cr;
+    uint32_t ev;
+};
+
+enum mill_trace_event {
+    /* Coroutine created; arg is the parent. */
+    MILL_TRACE_GO = 1,
+    MILL_TRACE_EXIT,
+    /* Coroutine picked from the ready queue. */
+    MILL_TRACE_RUN,
+    /* Coroutine switched out; arg is enum mill_state. */
+    MILL_TRACE_SUSPEND,
+    /* Coroutine made ready. */
+    MILL_TRACE_READY,
+    /* Waiting for a file descriptor, arg is the fd, 0xffffff for sleep. */
+    MILL_TRACE_FDWAIT,
+    /* Worker task submitted/completed; arg is the task code. */
+    MILL_TRACE_TASK_SUBMIT,
+    MILL_TRACE_TASK_DONE,
+    /* The thread blocks waiting for events, and wakes up. */
+    MILL_TRACE_IDLE,
+    MILL_TRACE_WAKE
+};
+
+#define mill_trace_event(ev) ((ev) & 0xff)
+#define mill_trace_arg(ev) ((ev) >> 8)
+
+#if defined MILL_TRACE
+
+struct mill_trace_s {
+    struct mill_trace_rec *ring;
+    uint64_t mask;
+    uint64_t head;
+    uint64_t tsc0;
+    int64_t ns0;
+};
+
+/* Appends a record to the ring of the calling thread if tracing is on.
+   The ring belongs to the thread, so there's no synchronisation. */
+#define mill_trace(crid, event, arg) \
+    do {\
+        struct mill_trace_s *mill_tr = mill->trace;\
+        if(mill_slow(mill_tr != NULL)) {\
+            struct mill_trace_rec *mill_rec =\
+                &mill_tr->ring[mill_tr->head++ & mill_tr->mask];\
+            mill_rec->tsc = mill_rdtsc();\
+            mill_rec->cr = (crid);\
+            mill_rec->ev = (event) | ((uint32_t)(arg) << 8);\
+        }\
+    } while(0)
+
+#define mill_trace_id(cr) ((cr)->id)
+#define mill_trace_setid(cr) ((cr)->id = ++mill->trace_lastid)
+
+void mill_trace_fini(void);
+
+#else
+
+#define mill_trace(crid, event, arg) ((void)0)
+#define mill_trace_setid(cr) ((void)0)
+#define mill_trace_fini() ((void)0)
+
+#endif
+
+#endif
@@ -70,6 +70,44 @@ void mill_panic(const char *text);
     __sync_bool_compare_and_swap(ptr, oldval, newval)
 #define mill_atomic_add(ptr, val)   __sync_add_and_fetch(ptr, val)
 #define mill_atomic_sub(ptr, val)   __sync_sub_and_fetch(ptr, val)
+#define mill_atomic_load(ptr)   __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define mill_atomic_store(ptr, val)   __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define mill_atomic_fence()   __sync_synchronize()
+
+/* Fast monotonic timestamp in CPU-specific ticks. Falls back to nanoseconds
+   of the monotonic clock where there's no usable cycle counter. */
+#if (defined __GNUC__ || defined __clang__) && defined __x86_64__
+static inline uint64_t mill_rdtsc(void) {
+    uint32_t low;
+    uint32_t high;
+    __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+    return (uint64_t)high << 32 | low;
+}
+#elif (defined __GNUC__ || defined __clang__) && defined __aarch64__
+static inline uint64_t mill_rdtsc(void) {
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r" (val));
+    return val;
+}
+#else
+#include <time.h>
+static inline uint64_t mill_rdtsc(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/* Per-thread pseudo-random numbers, cheaper than random() which takes
+   a global lock. The state must never be zero. */
+static inline uint32_t mill_xorshift(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
 
 #define mill_malloc(sz)  mill_realloc_func(NULL, sz)
 #define mill_realloc(ptr, sz)   mill_realloc_func(ptr, sz)
@@ -0,0 +1,281 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "cr.h"
+#include "libpill.h"
+#include "list.h"
+#include "timer.h"
+#include "utils.h"
+
+/*
+ * Hierarchical timing wheel. Level 0 has a slot for each of the next
+ * MILL_WHEEL_SLOTS milliseconds, every level above has slots
+ * MILL_WHEEL_SLOTS times as wide. A timer goes to the level of the highest
+ * bits in which its expiry differs from the current time, and into the slot
+ * given by those bits. Once the time gets to the start of a slot above
+ * level 0, its timers are moved (cascaded) to the levels below. Timers too
+ * far away for the top level wait in the overflow list. Adding and removing
+ * a timer is O(1); each timer is cascaded at most once per level.
+ *
+ * The expiry of the timers is in microseconds, the wheel ticks in
+ * milliseconds. The expiry is rounded up to the tick so that the timers
+ * never fire early.
+ */
+
+#define MILL_WHEEL_BITS     8
+#define MILL_WHEEL_SLOTS    (1 << MILL_WHEEL_BITS)
+#define MILL_WHEEL_MASK     (MILL_WHEEL_SLOTS - 1)
+#define MILL_WHEEL_LEVELS   4
+
+struct mill_wheel_s {
+    /* The first millisecond not yet processed. */
+    int64_t current;
+
+    /* Bitmaps of the non-empty slots. */
+    uint64_t bits[MILL_WHEEL_LEVELS][MILL_WHEEL_SLOTS / 64];
+
+    struct mill_list slots[MILL_WHEEL_LEVELS][MILL_WHEEL_SLOTS];
+
+    /* Timers beyond the reach of the top level. */
+    struct mill_list overflow;
+};
+
+#define LEVEL_SHIFT(level) (MILL_WHEEL_BITS * (level))
+
+#define WHEEL_TICK(us) ((us) / 1000 + ((us) % 1000 != 0))
+
+static void
+wheel_link(struct mill_wheel_s *w, struct mill_timer_item *tm) {
+    /* Expired timers fire with the current slot. */
+    int64_t expiry = WHEEL_TICK(tm->expiry);
+    if (expiry < w->current)
+        expiry = w->current;
+    uint64_t diff = (uint64_t) (expiry ^ w->current);
+    int level = 0;
+    while (level < MILL_WHEEL_LEVELS && (diff >> LEVEL_SHIFT(level + 1)))
+        level++;
+    if (level == MILL_WHEEL_LEVELS) {
+        mill_list_insert(&w->overflow, &tm->item, NULL);
+        tm->index = -1;
+        return;
+    }
+    int slot = (int) (expiry >> LEVEL_SHIFT(level)) & MILL_WHEEL_MASK;
+    mill_list_insert(&w->slots[level][slot], &tm->item, NULL);
+    w->bits[level][slot / 64] |= (uint64_t) 1 << (slot % 64);
+    tm->index = level * MILL_WHEEL_SLOTS + slot;
+}
+
+static void
+wheel_unlink(struct mill_wheel_s *w, struct mill_timer_item *tm) {
+    if (tm->index < 0) {
+        mill_list_erase(&w->overflow, &tm->item);
+        return;
+    }
+    int level = tm->index / MILL_WHEEL_SLOTS;
+    int slot = tm->index % MILL_WHEEL_SLOTS;
+    mill_list_erase(&w->slots[level][slot], &tm->item);
+    if (mill_list_empty(&w->slots[level][slot]))
+        w->bits[level][slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+}
+
+/* Returns the first non-empty slot of the level starting at 'from',
+   -1 if there's none. */
+static int
+wheel_scan(struct mill_wheel_s *w, int level, int from) {
+    int i;
+    for (i = from / 64; i < MILL_WHEEL_SLOTS / 64; i++) {
+        uint64_t bits = w->bits[level][i];
+        if (i == from / 64)
+            bits &= ~(uint64_t) 0 << (from % 64);
+        if (bits)
+            return i * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+static int
+wheel_level_empty(struct mill_wheel_s *w, int level) {
+    int i;
+    for (i = 0; i < MILL_WHEEL_SLOTS / 64; i++) {
+        if (w->bits[level][i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Moves the timers of the list to the levels below. */
+static void
+wheel_relink(struct mill_wheel_s *w, struct mill_list *list) {
+    struct mill_list_item *it = mill_list_begin(list);
+    mill_list_init(list);
+    while (it) {
+        struct mill_list_item *next = mill_list_next(it);
+        wheel_link(w, mill_cont(it, struct mill_timer_item, item));
+        it = next;
+    }
+}
+
+/* The time has got to 't', the start of a slot on one or more levels. */
+static void
+wheel_cascade(struct mill_wheel_s *w, int64_t t) {
+    int level;
+    for (level = 1; level < MILL_WHEEL_LEVELS; level++) {
+        int slot = (int) (t >> LEVEL_SHIFT(level)) & MILL_WHEEL_MASK;
+        if (! mill_list_empty(&w->slots[level][slot])) {
+            w->bits[level][slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+            wheel_relink(w, &w->slots[level][slot]);
+        }
+        if (slot)
+            return;
+    }
+    wheel_relink(w, &w->overflow);
+}
+
+int
+mill_wheel_init(struct mill_timers_s *timers) {
+    struct mill_wheel_s *w = mill_malloc(sizeof (struct mill_wheel_s));
+    if (!w) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int level, slot;
+    for (level = 0; level < MILL_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < MILL_WHEEL_SLOTS; slot++)
+            mill_list_init(&w->slots[level][slot]);
+        for (slot = 0; slot < MILL_WHEEL_SLOTS / 64; slot++)
+            w->bits[level][slot] = 0;
+    }
+    mill_list_init(&w->overflow);
+    w->current = mill->now / 1000;
+    timers->wheel = w;
+    timers->len = 0;
+    return 0;
+}
+
+void
+mill_wheel_fini(struct mill_timers_s *timers) {
+    mill_free(timers->wheel);
+    timers->wheel = NULL;
+}
+
+void
+mill_wheel_add(struct mill_timers_s *timers,
+            struct mill_timer_item *tm, int64_t deadline) {
+    if (tm->state == MILL_TIMER_ARMED)
+        mill_wheel_rm(timers, tm);
+    tm->expiry = deadline;
+    wheel_link(timers->wheel, tm);
+    tm->state = MILL_TIMER_ARMED;
+    timers->len++;
+}
+
+void
+mill_wheel_rm(struct mill_timers_s *timers, struct mill_timer_item *tm) {
+    if (tm->state != MILL_TIMER_ARMED)
+        return;
+    wheel_unlink(timers->wheel, tm);
+    tm->state = 0;
+    timers->len--;
+}
+
+int64_t
+mill_wheel_next(struct mill_timers_s *timers) {
+    struct mill_wheel_s *w = timers->wheel;
+    if (timers->len == 0)
+        return -1;
+    /* Above level 0 only the start of the slot is known, which is when
+       the timers get cascaded. */
+    int64_t t = -1;
+    int level;
+    for (level = 0; level < MILL_WHEEL_LEVELS; level++) {
+        if (wheel_level_empty(w, level))
+            continue;
+        int from = (int) (w->current >> LEVEL_SHIFT(level)) & MILL_WHEEL_MASK;
+        int slot = wheel_scan(w, level, level ? from + 1 : from);
+        mill_assert(slot >= 0);
+        t = (w->current >> LEVEL_SHIFT(level + 1)) << LEVEL_SHIFT(level + 1);
+        t |= (int64_t) slot << LEVEL_SHIFT(level);
+        break;
+    }
+    if (t < 0) {
+        t = ((w->current >> LEVEL_SHIFT(MILL_WHEEL_LEVELS)) + 1)
+                << LEVEL_SHIFT(MILL_WHEEL_LEVELS);
+    }
+    int64_t timeout = t * 1000 - mill->now;
+    return timeout <= 0 ? 0 : timeout;
+}
+
+int
+mill_wheel_fire(struct mill_timers_s *timers) {
+    struct mill_wheel_s *w = timers->wheel;
+    int64_t nw = mill->now / 1000;
+    int fired = 0;
+    while (w->current <= nw) {
+        if (timers->len == 0) {
+            w->current = nw + 1;
+            break;
+        }
+        if (wheel_level_empty(w, 0)) {
+            /* Skip to the next cascade of the lowest non-empty level. */
+            int level = 1;
+            while (level < MILL_WHEEL_LEVELS && wheel_level_empty(w, level))
+                level++;
+            int64_t next = ((w->current >> LEVEL_SHIFT(level)) + 1)
+                    << LEVEL_SHIFT(level);
+            if (next > nw + 1) {
+                w->current = nw + 1;
+                break;
+            }
+            w->current = next;
+            wheel_cascade(w, next);
+            continue;
+        }
+        int slot = wheel_scan(w, 0, (int) w->current & MILL_WHEEL_MASK);
+        mill_assert(slot >= 0);
+        int64_t t = (w->current & ~(int64_t) MILL_WHEEL_MASK) | slot;
+        if (t > nw) {
+            w->current = nw + 1;
+            break;
+        }
+        w->current = t;
+        /* The callbacks may add timers to the slot being processed. */
+        struct mill_list *list = &w->slots[0][slot];
+        while (! mill_list_empty(list)) {
+            struct mill_timer_item *tm = mill_cont(mill_list_begin(list),
+                    struct mill_timer_item, item);
+            mill_wheel_rm(timers, tm);
+            struct mill_timer *timer = (struct mill_timer *) tm;
+            if (timer->callback)
+                timer->callback(timer);
+            fired = 1;
+        }
+        w->current++;
+        if (! (w->current & MILL_WHEEL_MASK))
+            wheel_cascade(w, w->current);
+    }
+    return fired;
+}
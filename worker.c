@@ -58,6 +58,8 @@ typedef struct mill_task_s {
 #define TASK_TIMEDOUT       -2
 #define TASK_INPROGRESS     0
 
+    /* For tasks started by task_submit(), the coroutine waiting for it in
+       choose, if any. */
     struct mill_cr *cr;
     void *buf;
     union {
@@ -81,6 +83,10 @@ typedef struct mill_task_s {
     };
 
     int res_fd; /* response */
+
+    /* Set for tasks started by task_submit(); 'done' once it finished. */
+    int async;
+    int done;
 } task;
 
 /* Global work queue for anonymous (permanent) workers */
@@ -124,7 +130,17 @@ coroutine static void task_wait(int fd) {
             count -= n;
             ptr += n;
             if (count == 0) {
+                if (res->async) {
+                    res->done = 1;
+                    if (res->cr)
+                        mill_choose_taskdone(res->cr, res);
+                    ptr = (char *) &res;
+                    count = size;
+                    continue;
+                }
                 mill->num_tasks--;
+                mill_trace(mill_trace_id(res->cr), MILL_TRACE_TASK_DONE,
+                    res->code);
                 if (mill_timer_enabled(&res->cr->timer))
                     mill_timer_rm(&res->cr->timer);
                 mill_resume(res->cr, 1);
@@ -157,8 +173,7 @@ coroutine static void task_wait(int fd) {
 
 #define task_free(ptr)    mill_free((void *) ptr)
 
-static ssize_t queue_task(mill_pipe task_queue,
-            volatile task *req, int64_t deadline) {
+static int submit_task(mill_pipe task_queue, volatile task *req) {
     mill_assert(mill);
 
     if (mill_slow(mill->task_fd[0] == -1)) {
@@ -177,11 +192,24 @@ static ssize_t queue_task(mill_pipe task_queue,
     if (!task_queue)
         task_queue = mill_task_queue;
     req->errcode = TASK_QUEUED;
-    req->cr = mill->running;
+    req->cr = req->async ? NULL : mill->running;
     /* enqueue task */
     req->res_fd = mill->task_fd[1];
     mill_pipesend(task_queue, (void *) &req);
-    mill->num_tasks++;
+    /* Nobody is blocked on the tasks started by task_submit(), so they
+       don't hold up mill_waitall(). */
+    if (!req->async)
+        mill->num_tasks++;
+    mill_trace(mill_trace_id(mill->running), MILL_TRACE_TASK_SUBMIT,
+        req->code);
+    return 0;
+}
+
+static ssize_t queue_task(mill_pipe task_queue,
+            volatile task *req, int64_t deadline) {
+    req->async = 0;
+    if (submit_task(task_queue, req) == -1)
+        return -1;
 
     if (deadline >= 0) {
         mill_timer_add(&mill->running->timer, deadline, mill_task_timedout);
@@ -333,6 +361,52 @@ int task_go(struct mill_worker_s *w,
     return queue_task(w ? w->task_queue : NULL, req, deadline);
 }
 
+mill_task task_submit(struct mill_worker_s *w, taskfunc fn, void *da) {
+    task *req = mill_malloc(sizeof(task));
+    if (!req) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    req->code = tTASK;
+    req->taskfn = fn;
+    req->buf = da;
+    req->async = 1;
+    req->done = 0;
+    if (submit_task(w ? w->task_queue : NULL, req) == -1)
+        return NULL;
+    return req;
+}
+
+int task_join(task *t, int64_t deadline) {
+    char clause[MILL_CLAUSELEN];
+    mill_choose_init();
+    mill_choose_task(clause, t, 0);
+    mill_choose_deadline(deadline);
+    if (mill_choose_wait() == -1) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return mill_choose_taskres();
+}
+
+int mill_task_isdone(task *t) {
+    return t->done;
+}
+
+void mill_task_setwaiter(task *t, struct mill_cr *cr) {
+    if (mill_slow(cr && t->cr))
+        mill_panic("multiple coroutines waiting for the same task");
+    t->cr = cr;
+}
+
+int mill_task_reap(task *t, int *err) {
+    mill_assert(t->done);
+    int rc = (int) t->ssz;
+    *err = t->errcode;
+    task_free(t);
+    return rc;
+}
+
 int mill_worker_await(struct mill_worker_s *w, int64_t deadline) {
     task *req;
     if (! w) {
@@ -1,2 +1,11 @@
 void init_workers(int nworkers);
 void close_task_fds(void);
+
+struct mill_cr;
+struct mill_task_s;
+
+/* Tasks started by task_submit() and waited for by choose, see chan.c.
+   mill_task_reap() returns the result of the task and releases it. */
+int mill_task_isdone(struct mill_task_s *t);
+void mill_task_setwaiter(struct mill_task_s *t, struct mill_cr *cr);
+int mill_task_reap(struct mill_task_s *t, int *err);
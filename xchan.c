@@ -0,0 +1,401 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "chan.h"
+#include "cr.h"
+#include "libpill.h"
+#include "list.h"
+#include "utils.h"
+#include "xchan.h"
+
+/* The values are passed through a bounded MPMC ring (D. Vyukov's design).
+   Each cell starts with a sequence number which tells whether the cell
+   is ready to be written or read at the given position. Both operations
+   claim the position with a single CAS and never wait for each other.
+
+   Coroutines can't block on the ring itself. Each thread using the channel
+   attaches an ordinary channel to it instead and coroutines block on that.
+   The attachment then registers its interest in the ring and the peer
+   which makes progress on the ring resumes the bridge coroutine of
+   the attachment, which in turn serves the blocked coroutines. The resume
+   goes through the inbox of the thread, so the eventfd is signalled only
+   if the other side actually waits. */
+
+#define MILL_CACHELINE 64
+
+struct mill_xchan_s {
+    /* Positions of the next write and the next read. */
+    volatile size_t head;
+    char pad1[MILL_CACHELINE - sizeof(size_t)];
+    volatile size_t tail;
+    char pad2[MILL_CACHELINE - sizeof(size_t)];
+    /* Size of an element, size of the cell including the sequence number
+       and the number of cells minus one. */
+    size_t sz;
+    size_t stride;
+    size_t mask;
+    int refcount;
+    /* -1 while chdone() is storing the done-with value, 1 once it's
+       stored. */
+    volatile int done;
+    /* Number of attachments with coroutines blocked on receiving and
+       sending, respectively. */
+    volatile int nrecv;
+    volatile int nsend;
+    /* Protects the list of attachments and their interests. */
+    int lock;
+    struct mill_list attachments;
+    /* The cells follow the structure, then the done-with value. */
+};
+
+struct mill_xattach_s {
+    struct mill_xchan_s *xch;
+    struct mill_chan *ch;
+    struct mill_list_item item;
+    /* The coroutine serving the blocked coroutines of the channel and
+       whether it's suspended waiting to be resumed. */
+    struct mill_cr *bridge;
+    volatile int parked;
+    int wantrecv;
+    int wantsend;
+    int closing;
+};
+
+static void mill_xchlock(struct mill_xchan_s *xch) {
+    while(!mill_atomic_set(&xch->lock, 0, 1))
+        sched_yield();
+}
+
+static void mill_xchunlock(struct mill_xchan_s *xch) {
+    int ret = mill_atomic_set(&xch->lock, 1, 0);
+    mill_assert(ret);
+}
+
+static size_t *mill_xchcell(struct mill_xchan_s *xch, size_t pos) {
+    return (size_t*)(((char*)(xch + 1)) + ((pos & xch->mask) * xch->stride));
+}
+
+static void *mill_xchdoneval(struct mill_xchan_s *xch) {
+    return ((char*)(xch + 1)) + ((xch->mask + 1) * xch->stride);
+}
+
+static int mill_xchpush(struct mill_xchan_s *xch, void *val) {
+    size_t pos = xch->head;
+    size_t *cell;
+    while(1) {
+        cell = mill_xchcell(xch, pos);
+        intptr_t dif = (intptr_t)mill_atomic_load(cell) - (intptr_t)pos;
+        if(dif == 0) {
+            if(mill_atomic_set(&xch->head, pos, pos + 1))
+                break;
+        }
+        else if(dif < 0) {
+            return -1;
+        }
+        pos = xch->head;
+    }
+    memcpy(cell + 1, val, xch->sz);
+    mill_atomic_store(cell, pos + 1);
+    return 0;
+}
+
+static int mill_xchpop(struct mill_xchan_s *xch, void *val) {
+    size_t pos = xch->tail;
+    size_t *cell;
+    while(1) {
+        cell = mill_xchcell(xch, pos);
+        intptr_t dif = (intptr_t)mill_atomic_load(cell) - (intptr_t)(pos + 1);
+        if(dif == 0) {
+            if(mill_atomic_set(&xch->tail, pos, pos + 1))
+                break;
+        }
+        else if(dif < 0) {
+            return -1;
+        }
+        pos = xch->tail;
+    }
+    memcpy(val, cell + 1, xch->sz);
+    mill_atomic_store(cell, pos + xch->mask + 1);
+    return 0;
+}
+
+static int mill_xchcanpush(struct mill_xchan_s *xch) {
+    size_t pos = xch->head;
+    return mill_atomic_load(mill_xchcell(xch, pos)) == pos;
+}
+
+static int mill_xchcanpop(struct mill_xchan_s *xch) {
+    size_t pos = xch->tail;
+    return mill_atomic_load(mill_xchcell(xch, pos)) == pos + 1;
+}
+
+/* Resumes the bridge coroutine unless someone else already did. */
+static void mill_xchkick(struct mill_xattach_s *xa) {
+    if(mill_atomic_set(&xa->parked, 1, 0))
+        mill_resume(xa->bridge, 0);
+}
+
+/* Resumes the bridges of the attachments interested in receiving or
+   in sending. */
+static void mill_xchwake(struct mill_xchan_s *xch, int recv) {
+    mill_xchlock(xch);
+    struct mill_list_item *it;
+    for(it = mill_list_begin(&xch->attachments); it; it = mill_list_next(it)) {
+        struct mill_xattach_s *xa = mill_cont(it, struct mill_xattach_s, item);
+        if(recv && xa->wantrecv) {
+            xa->wantrecv = 0;
+            mill_atomic_sub(&xch->nrecv, 1);
+            mill_xchkick(xa);
+        }
+        if(!recv && xa->wantsend) {
+            xa->wantsend = 0;
+            mill_atomic_sub(&xch->nsend, 1);
+            mill_xchkick(xa);
+        }
+    }
+    mill_xchunlock(xch);
+}
+
+int mill_xchtrysend(struct mill_xattach_s *xa, void *val) {
+    struct mill_xchan_s *xch = xa->xch;
+    if(mill_slow(xch->done)) {
+        errno = EPIPE;
+        return -1;
+    }
+    if(mill_xchpush(xch, val) < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    /* Pairs with the registration of the interest in mill_xchserve(). */
+    mill_atomic_fence();
+    if(mill_slow(xch->nrecv))
+        mill_xchwake(xch, 1);
+    return 0;
+}
+
+int mill_xchtryrecv(struct mill_xattach_s *xa, void *val) {
+    struct mill_xchan_s *xch = xa->xch;
+    if(mill_xchpop(xch, val) < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    mill_atomic_fence();
+    if(mill_slow(xch->nsend))
+        mill_xchwake(xch, 0);
+    return 0;
+}
+
+int mill_xchgetdone(struct mill_xattach_s *xa, void *val) {
+    struct mill_xchan_s *xch = xa->xch;
+    /* Values sent before chdone() come first. */
+    if(mill_fast(mill_atomic_load(&xch->done) != 1) || mill_xchcanpop(xch)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    memcpy(val, mill_xchdoneval(xch), xch->sz);
+    return 0;
+}
+
+int mill_xchisdone(struct mill_xattach_s *xa) {
+    return xa->xch->done != 0;
+}
+
+/* Moves values between the ring and the coroutines blocked on the local
+   channel and registers the interest for the rest of them. Returns 1 if
+   the ring changed meanwhile and there may be more to do. */
+static int mill_xchserve(struct mill_xattach_s *xa) {
+    struct mill_chan *ch = xa->ch;
+    struct mill_xchan_s *xch = xa->xch;
+    struct mill_clause *cl;
+    while(!mill_list_empty(&ch->receiver.clauses)) {
+        cl = mill_cont(mill_list_begin(&ch->receiver.clauses),
+            struct mill_clause, epitem);
+        void *dst = mill_clause_dst(cl, ch->sz);
+        if(mill_xchtryrecv(xa, dst) < 0 && mill_xchgetdone(xa, dst) < 0)
+            break;
+        mill_choose_unblock(cl);
+    }
+    while(!mill_list_empty(&ch->sender.clauses)) {
+        cl = mill_cont(mill_list_begin(&ch->sender.clauses),
+            struct mill_clause, epitem);
+        if(mill_xchtrysend(xa, cl->val) < 0) {
+            if(errno != EPIPE)
+                break;
+            /* Done with: chs() fails with EPIPE and choose starts over
+               from mill_choose_init(), which makes it skip the clause. */
+            cl->idx = -2;
+        }
+        mill_choose_unblock(cl);
+    }
+    int wantrecv = !mill_list_empty(&ch->receiver.clauses);
+    int wantsend = !mill_list_empty(&ch->sender.clauses);
+    mill_xchlock(xch);
+    if(wantrecv != xa->wantrecv)
+        mill_atomic_add(&xch->nrecv, wantrecv ? 1 : -1);
+    if(wantsend != xa->wantsend)
+        mill_atomic_add(&xch->nsend, wantsend ? 1 : -1);
+    xa->wantrecv = wantrecv;
+    xa->wantsend = wantsend;
+    mill_xchunlock(xch);
+    /* A value may have been sent or received before the interest was
+       registered. */
+    if(wantrecv && (mill_xchcanpop(xch) || xch->done == 1))
+        return 1;
+    if(wantsend && (mill_xchcanpush(xch) || xch->done))
+        return 1;
+    return 0;
+}
+
+coroutine static void mill_xchbridge(struct mill_xattach_s *xa) {
+    xa->bridge = mill->running;
+    /* The bridge doesn't count as a coroutine for mill_waitall(). */
+    mill->num_cr--;
+    while(1) {
+        __sync_lock_test_and_set(&xa->parked, 1);
+        if(xa->closing)
+            break;
+        if(mill_xchserve(xa) && mill_atomic_set(&xa->parked, 1, 0))
+            continue;
+        mill_suspend();
+    }
+    struct mill_xchan_s *xch = xa->xch;
+    mill_free(xa);
+    mill_xchclose(xch);
+    mill->num_cr++;
+}
+
+void mill_xchblock(struct mill_xattach_s *xa) {
+    mill_xchkick(xa);
+}
+
+int mill_xchdone(struct mill_xattach_s *xa, void *val) {
+    struct mill_xchan_s *xch = xa->xch;
+    if(!mill_atomic_set(&xch->done, 0, -1)) {
+        errno = EPIPE;
+        return -1;
+    }
+    memcpy(mill_xchdoneval(xch), val, xch->sz);
+    mill_atomic_store(&xch->done, 1);
+    mill_atomic_fence();
+    mill_xchwake(xch, 1);
+    /* The senders blocked on a full ring fail with EPIPE. */
+    mill_xchwake(xch, 0);
+    return 0;
+}
+
+void mill_xchdetach(struct mill_xattach_s *xa) {
+    struct mill_xchan_s *xch = xa->xch;
+    mill_xchlock(xch);
+    mill_list_erase(&xch->attachments, &xa->item);
+    if(xa->wantrecv)
+        mill_atomic_sub(&xch->nrecv, 1);
+    if(xa->wantsend)
+        mill_atomic_sub(&xch->nsend, 1);
+    mill_xchunlock(xch);
+    /* The bridge frees the attachment once it gets to run. */
+    xa->closing = 1;
+    mill_xchkick(xa);
+}
+
+xchan mill_xchmake(size_t sz, size_t bufsz) {
+    if(mill_slow(bufsz == 0 || bufsz > SIZE_MAX / 2)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /* With a single cell, the sequence number of a full cell would be
+       the same as of an empty one at the next position. */
+    size_t cap = 2;
+    while(cap < bufsz)
+        cap <<= 1;
+    size_t stride = (sizeof(size_t) + sz + sizeof(size_t) - 1) &
+        ~(sizeof(size_t) - 1);
+    struct mill_xchan_s *xch = mill_malloc(sizeof(struct mill_xchan_s) +
+        (cap * stride) + sz);
+    if(!xch) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(xch, 0, sizeof(struct mill_xchan_s));
+    xch->sz = sz;
+    xch->stride = stride;
+    xch->mask = cap - 1;
+    xch->refcount = 1;
+    mill_list_init(&xch->attachments);
+    size_t i;
+    for(i = 0; i != cap; ++i)
+        *mill_xchcell(xch, i) = i;
+    /* Make the cells visible to the other threads. */
+    mill_atomic_fence();
+    return xch;
+}
+
+xchan mill_xchdup(xchan xch) {
+    mill_atomic_add(&xch->refcount, 1);
+    return xch;
+}
+
+void mill_xchclose(xchan xch) {
+    if(mill_atomic_sub(&xch->refcount, 1))
+        return;
+    mill_assert(mill_list_empty(&xch->attachments));
+    mill_free(xch);
+}
+
+chan mill_xchattach(xchan xch) {
+    if(mill_inbox_open() < 0)
+        return NULL;
+    struct mill_xattach_s *xa = mill_malloc(sizeof(struct mill_xattach_s));
+    if(!xa) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    chan ch = mill_chmake(xch->sz, 0);
+    if(!ch) {
+        mill_free(xa);
+        errno = ENOMEM;
+        return NULL;
+    }
+    xa->xch = mill_xchdup(xch);
+    xa->ch = ch;
+    xa->bridge = NULL;
+    xa->parked = 0;
+    xa->wantrecv = 0;
+    xa->wantsend = 0;
+    xa->closing = 0;
+    ch->xa = xa;
+    mill_xchlock(xch);
+    mill_list_insert(&xch->attachments, &xa->item, NULL);
+    mill_xchunlock(xch);
+    /* The bridge only moves the values, it doesn't need much stack. Wakeups
+       from other threads shouldn't queue behind local work. */
+    mill_setspawnstack(MILL_STACK_16K);
+    mill_setspawnprio(MILL_PRIO_HIGH);
+    mill_go(mill_xchbridge(xa), NULL);
+    return ch;
+}
@@ -0,0 +1,64 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#ifndef MILL_XCHAN_INCLUDED
+#define MILL_XCHAN_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libpill.h"
+
+struct mill_chan;
+
+/* Ties a channel of the calling thread to a cross-thread channel. Values
+   pass through the shared ring directly. A coroutine blocked on the local
+   channel is served by the bridge coroutine of the attachment, which is
+   woken up through the inbox of the thread only if there's such a blocked
+   coroutine. See xchan.c. */
+struct mill_xattach_s;
+
+/* Non-blocking operations on the ring. They return 0 on success and -1 if
+   the ring is full or empty, respectively. mill_xchtrysend() fails with
+   EPIPE on a done-with channel. */
+int mill_xchtrysend(struct mill_xattach_s *xa, void *val);
+int mill_xchtryrecv(struct mill_xattach_s *xa, void *val);
+
+/* Gets the done-with value if chdone() was called and the ring is empty.
+   Returns -1 otherwise. */
+int mill_xchgetdone(struct mill_xattach_s *xa, void *val);
+
+/* Returns 1 if chdone() was called on the channel. */
+int mill_xchisdone(struct mill_xattach_s *xa);
+
+/* A coroutine of the calling thread got blocked on the local channel. */
+void mill_xchblock(struct mill_xattach_s *xa);
+
+/* chdone() was called on the local channel. */
+int mill_xchdone(struct mill_xattach_s *xa, void *val);
+
+/* The local channel is being deallocated. */
+void mill_xchdetach(struct mill_xattach_s *xa);
+
+#endif